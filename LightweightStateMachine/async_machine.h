@@ -0,0 +1,363 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_ASYNC_MACHINE_H
+#define LIGHTWEIGHT_STATE_MACHINE_ASYNC_MACHINE_H
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <cassert>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    template <typename T = void>
+    class task;
+
+    namespace details
+    {
+        template <typename T>
+        struct task_promise_base
+        {
+            // Resumes whoever awaited the task, by symmetric transfer so that chains of tasks don't grow the stack.
+            struct final_awaiter
+            {
+                bool await_ready() const noexcept { return false; }
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) const noexcept
+                {
+                    const std::coroutine_handle<> next = h.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+                void await_resume() const noexcept {}
+            };
+
+            task<T> get_return_object() noexcept;
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            final_awaiter final_suspend() const noexcept { return {}; }
+            void unhandled_exception() noexcept { error = std::current_exception(); }
+
+            void rethrow() const { if (error) std::rethrow_exception(error); }
+
+            std::coroutine_handle<> continuation;
+            std::exception_ptr error;
+        };
+
+        template <typename T>
+        struct task_promise : task_promise_base<T>
+        {
+            template <typename U>
+            void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+            T result() { this->rethrow(); return std::move(*value); }
+
+            std::optional<T> value;
+        };
+
+        template <>
+        struct task_promise<void> : task_promise_base<void>
+        {
+            void return_void() const noexcept {}
+            void result() const { rethrow(); }
+        };
+    }
+
+    // Lazy coroutine: it starts once awaited, or start()ed by code that isn't a coroutine, and resumes its awaiter when
+    // it's over. Exceptions are kept and rethrown to the awaiter. A default constructed task<> is empty and already done.
+    template <typename T>
+    class task
+    {
+    public:
+        typedef details::task_promise<T> promise_type;
+        typedef std::coroutine_handle<promise_type> handle_type;
+
+    public:
+        task() noexcept : handle_(nullptr) {}
+        explicit task(handle_type h) noexcept : handle_(h) {}
+        task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+        task& operator=(task &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (handle_) handle_.destroy();
+                handle_ = std::exchange(other.handle_, nullptr);
+            }
+            return *this;
+        }
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+        ~task() { if (handle_) handle_.destroy(); }
+
+        explicit operator bool() const { return static_cast<bool>(handle_); }
+        bool done() const { return !handle_ || handle_.done(); }
+
+        // Runs the task until its first suspension, without anyone to resume when it's over: the owner keeps the task
+        // alive and checks done(), then get().
+        void start() { assert(handle_ && !handle_.done()); handle_.resume(); }
+        T get() { assert(done()); return result(); }
+
+        auto operator co_await() noexcept
+        {
+            struct awaiter
+            {
+                bool await_ready() const noexcept { return !t.handle_ || t.handle_.done(); }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+                {
+                    t.handle_.promise().continuation = awaiting;
+                    return t.handle_;
+                }
+                T await_resume() { return t.result(); }
+
+                task &t;
+            };
+            return awaiter{ *this };
+        }
+
+    private:
+        T result()
+        {
+            if constexpr (std::is_void_v<T>)
+            {
+                if (handle_) handle_.promise().result();
+            }
+            else
+            {
+                assert(handle_ && "An empty task has no value");
+                return handle_.promise().result();
+            }
+        }
+
+    private:
+        handle_type handle_;
+    };
+
+    namespace details
+    {
+        template <typename T>
+        task<T> task_promise_base<T>::get_return_object() noexcept
+        {
+            return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(static_cast<task_promise<T>&>(*this)));
+        }
+
+        // Tasks returned by the handlers of the transition being dispatched, awaited in turn once it's resolved.
+        inline std::vector<task<>>*& async_sink()
+        {
+            static thread_local std::vector<task<>> *sink = nullptr;
+            return sink;
+        }
+
+        // Handler of an async_policy: a callback returning a task<>, or nothing for one that completes synchronously.
+        // Called by the dispatch like any other handler, it hands the task over to the async_machine dispatching. Once a
+        // handler of the transition is pending, the next synchronous ones are deferred behind it to keep their order.
+        template <typename Base, typename... Args>
+        class async_function
+        {
+        public:
+            typedef typename Base::template function<task<>(Args...)> function_type;
+
+            async_function() = default;
+            async_function(std::nullptr_t) {}
+            template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, async_function> && std::is_invocable_v<F&, Args...>>>
+            async_function(F f) : f_(wrap(std::move(f))) {}
+
+            explicit operator bool() const { return static_cast<bool>(f_); }
+
+            void operator()(Args... args) const
+            {
+                std::vector<task<>> *sink = async_sink();
+                if (sink != nullptr && !sink->empty())
+                {
+                    sink->push_back(deferred(f_, args...));
+                    return;
+                }
+                task<> t = f_(args...);
+                if (!t) return;
+                assert(sink != nullptr && "Handlers returning a task are only run by the *_async() calls of an async_machine");
+                sink->push_back(std::move(t));
+            }
+
+        private:
+            static task<> deferred(const function_type &f, Args... args) { co_await f(args...); }
+
+            template <typename F>
+            static function_type wrap(F f)
+            {
+                if constexpr (std::is_void_v<std::invoke_result_t<F&, Args...>>)
+                {
+                    return [f = std::move(f)](Args... args) -> task<> { f(args...); return task<>(); };
+                }
+                else
+                {
+                    return function_type(std::move(f));
+                }
+            }
+
+        private:
+            function_type f_;
+        };
+
+        template <typename Base, typename Signature>
+        struct async_callable
+        {
+            typedef typename Base::template function<Signature> type;
+        };
+
+        template <typename Base, typename... Args>
+        struct async_callable<Base, void(Args...)>
+        {
+            typedef async_function<Base, Args...> type;
+        };
+    }
+
+    // Actions and enter/leave handlers may return a task<>, awaited in turn by async_machine::notify_async() once the
+    // transition is resolved. Guards stay synchronous, they decide the transition before anything is awaited.
+    template <typename Base = std_function_policy>
+    struct async_policy : Base
+    {
+        typedef async_policy<typename Base::callables> callables;
+        template <typename Signature> using function = typename details::async_callable<Base, Signature>::type;
+        template <typename Signature> using move_only_function = function<Signature>;
+    };
+
+    // A machine whose handlers may suspend, typically on I/O: co_await sm.notify_async(e) resolves the transition, then
+    // awaits the tasks of its leave handlers, actions and enter handlers in that order. Meanwhile the thread is free to
+    // run other machines, this one queueing later notifications until the transition is over.
+    //
+    // The machine is in the target state as soon as the transition is resolved. One thread drives a machine and the
+    // tasks awaited by it; timers and notify() straight on the underlying machine don't accept handlers returning a task.
+    template <typename Event, typename Policy = async_policy<>>
+    class async_machine
+    {
+    public:
+        typedef Event event_type;
+        typedef Policy policy_type;
+        typedef async_machine<event_type, policy_type> self_type;
+        typedef machine<event_type, policy_type> machine_type;
+        typedef typename machine_type::state state;
+
+    public:
+        async_machine() : is_busy_(false), is_handing_over_(false), is_released_(false) {}
+
+        // Tasks awaited refer to the machine.
+        async_machine(const async_machine&) = delete;
+        async_machine& operator=(const async_machine&) = delete;
+
+        template <typename T>
+        self_type& operator<<(T &&t) { machine_ << std::forward<T>(t); return *this; }
+
+        void finalize() { machine_.finalize(); }
+
+        bool is_running() const { return machine_.is_running(); }
+        bool is_stopped() const { return !is_running(); }
+        bool is_in(const state &s) const { return machine_.is_in(s); }
+        // Whether a transition is being awaited.
+        bool is_busy() const { return is_busy_; }
+
+        // A payload given to these must outlive the task returned.
+        template <typename... Payload>
+        task<> start_async(const Payload&... payload)
+        {
+            co_await run([&]() { machine_.start(payload...); });
+        }
+
+        template <typename... Payload>
+        task<> stop_async(const Payload&... payload)
+        {
+            co_await run([&]() { machine_.stop(payload...); });
+        }
+
+        // The event is copied, so the task may as well be awaited later.
+        template <typename... Payload>
+        task<> notify_async(event_type event, const Payload&... payload)
+        {
+            co_await run([&]() { machine_.notify(event, payload...); });
+        }
+
+        const machine_type& get_machine() const { return machine_; }
+        machine_type& get_machine() { return machine_; }
+
+    private:
+        // Waits for the ongoing transition to be over, then owns the machine until released.
+        struct turn
+        {
+            bool await_ready() const
+            {
+                if (m.is_busy_) return false;
+                m.is_busy_ = true;
+                return true;
+            }
+            void await_suspend(std::coroutine_handle<> h) const { m.waiters_.push_back(h); }
+            void await_resume() const noexcept {}
+
+            self_type &m;
+        };
+
+        struct turn_scope
+        {
+            ~turn_scope() { m.hand_over(); }
+
+            self_type &m;
+        };
+
+        // The turn goes to the next waiter, if any, without the machine being seen idle in between. Turns released
+        // while a waiter is being resumed are handed over by the loop that resumed it, so a queue of synchronous
+        // notifications doesn't resume each one from the frame of the previous.
+        void hand_over()
+        {
+            if (is_handing_over_)
+            {
+                is_released_ = true;
+                return;
+            }
+            is_handing_over_ = true;
+            do
+            {
+                is_released_ = false;
+                if (waiters_.empty())
+                {
+                    is_busy_ = false;
+                    break;
+                }
+                const std::coroutine_handle<> next = waiters_.front();
+                waiters_.pop_front();
+                next.resume();
+            } while (is_released_);
+            is_handing_over_ = false;
+        }
+
+        struct sink_scope
+        {
+            explicit sink_scope(std::vector<task<>> *sink) : previous(std::exchange(details::async_sink(), sink)) {}
+            ~sink_scope() { details::async_sink() = previous; }
+
+            std::vector<task<>> *previous;
+        };
+
+        template <typename Dispatch>
+        task<> run(Dispatch dispatch)
+        {
+            co_await turn{ *this };
+            const turn_scope scope{ *this };
+
+            std::vector<task<>> pending;
+            {
+                const sink_scope collecting(&pending);
+                dispatch();
+            }
+            for (task<> &t : pending) co_await t;
+        }
+
+    private:
+        machine_type machine_;
+        bool is_busy_, is_handing_over_, is_released_;
+        std::deque<std::coroutine_handle<>> waiters_;
+    };
+}
+
+#endif
+
+#endif
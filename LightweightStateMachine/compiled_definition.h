@@ -0,0 +1,395 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_COMPILED_DEFINITION_H
+#define LIGHTWEIGHT_STATE_MACHINE_COMPILED_DEFINITION_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <map>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    // Machine images: a flat machine compiled ahead of time, typically from a configuration file, into a block of bytes
+    // that is loaded by mapping it, without rebuilding anything. Callbacks are referred to by name and bound at load
+    // time from a callback_registry.
+    //
+    // All fields are little-endian 32-bit words and all offsets are relative to the image, so it can live at any
+    // address. After a fixed header of image_header_words words:
+    //
+    //     magic, version, state_count, transition_count, action_count, name_count, name_bytes, initial_state
+    //     first[state_count + 1]       transitions from state s are [first[s], first[s + 1]), sorted by event
+    //     enter[state_count], leave[state_count]
+    //     event[transition_count], target[transition_count], guard[transition_count]
+    //     actions[transition_count + 1]  the actions of transition t are action_list[actions[t], actions[t + 1])
+    //     action_list[action_count]
+    //     name_offsets[name_count + 1] into the name bytes that follow, padded to a whole word
+    //
+    // Callbacks are name indices, no_name when there's none. Transitions sharing a source and an event keep the order
+    // they were added in, their guards are tried in that order.
+    namespace details
+    {
+        constexpr std::uint32_t image_magic = 0x494d534c;   // "LSMI"
+        constexpr std::uint32_t image_version = 1;
+        constexpr std::size_t image_header_words = 8;
+    }
+
+    // Named guards and actions an image is bound with. Enter and leave handlers are actions.
+    class callback_registry
+    {
+    public:
+        callback_registry& add_guard(std::string name, guard_func g) { guards_[std::move(name)] = std::move(g); return *this; }
+        callback_registry& add_action(std::string name, action_func a) { actions_[std::move(name)] = std::move(a); return *this; }
+
+        const guard_func* find_guard(std::string_view name) const
+        {
+            auto found = guards_.find(name);
+            return found == guards_.end() ? nullptr : &found->second;
+        }
+
+        const action_func* find_action(std::string_view name) const
+        {
+            auto found = actions_.find(name);
+            return found == actions_.end() ? nullptr : &found->second;
+        }
+
+    private:
+        std::map<std::string, guard_func, std::less<>> guards_;
+        std::map<std::string, action_func, std::less<>> actions_;
+    };
+
+    // Builds an image from a description of states and transitions, events being 32-bit ids. The first state added is
+    // the initial one. Empty names stand for no callback.
+    class definition_compiler
+    {
+    public:
+        static constexpr std::uint32_t no_name = std::numeric_limits<std::uint32_t>::max();
+
+        state_id add_state(std::string_view on_enter = {}, std::string_view on_leave = {})
+        {
+            enter_.push_back(intern(on_enter));
+            leave_.push_back(intern(on_leave));
+            return static_cast<state_id>(enter_.size() - 1);
+        }
+
+        void add_transition(state_id from, state_id to, std::uint32_t event, std::string_view guard = {}, std::initializer_list<std::string_view> actions = {})
+        {
+            assert(from < enter_.size() && to < enter_.size());
+            compiled_transition t{ from, to, event, intern(guard), {} };
+            for (std::string_view a : actions)
+            {
+                assert(!a.empty());
+                t.actions.push_back(intern(a));
+            }
+            transitions_.push_back(std::move(t));
+        }
+
+        std::size_t state_count() const { return enter_.size(); }
+        std::size_t transition_count() const { return transitions_.size(); }
+
+        std::vector<unsigned char> compile() const
+        {
+            assert(!enter_.empty() && "An image needs at least its initial state");
+
+            std::vector<const compiled_transition*> sorted;
+            sorted.reserve(transitions_.size());
+            for (const compiled_transition &t : transitions_) sorted.push_back(&t);
+            std::stable_sort(sorted.begin(), sorted.end(), [](const compiled_transition *a, const compiled_transition *b)
+            {
+                return a->from != b->from ? a->from < b->from : a->event < b->event;
+            });
+
+            std::size_t action_count = 0, name_bytes = 0;
+            for (const compiled_transition &t : transitions_) action_count += t.actions.size();
+            for (const std::string &n : names_) name_bytes += n.size();
+
+            const std::size_t states = enter_.size(), transitions = transitions_.size();
+            std::vector<std::uint32_t> words;
+            words.reserve(details::image_header_words + 3 * states + 4 * transitions + action_count + names_.size() + 3 + name_bytes / 4);
+            for (std::size_t v : { std::size_t(details::image_magic), std::size_t(details::image_version), states, transitions,
+                                   action_count, names_.size(), name_bytes, std::size_t(0) })
+            {
+                words.push_back(static_cast<std::uint32_t>(v));
+            }
+
+            std::size_t next = 0;
+            for (std::size_t s = 0; s <= states; ++s)
+            {
+                while (next != transitions && sorted[next]->from < s) ++next;
+                words.push_back(static_cast<std::uint32_t>(next));
+            }
+            words.insert(words.end(), enter_.begin(), enter_.end());
+            words.insert(words.end(), leave_.begin(), leave_.end());
+            for (const compiled_transition *t : sorted) words.push_back(t->event);
+            for (const compiled_transition *t : sorted) words.push_back(t->to);
+            for (const compiled_transition *t : sorted) words.push_back(t->guard);
+            std::uint32_t offset = 0;
+            for (const compiled_transition *t : sorted)
+            {
+                words.push_back(offset);
+                offset += static_cast<std::uint32_t>(t->actions.size());
+            }
+            words.push_back(offset);
+            for (const compiled_transition *t : sorted) words.insert(words.end(), t->actions.begin(), t->actions.end());
+            offset = 0;
+            for (const std::string &n : names_)
+            {
+                words.push_back(offset);
+                offset += static_cast<std::uint32_t>(n.size());
+            }
+            words.push_back(offset);
+
+            std::vector<unsigned char> image(words.size() * 4 + (name_bytes + 3) / 4 * 4, 0);
+            for (std::size_t i = 0; i < words.size(); ++i) details::store_le32(image.data() + 4 * i, words[i]);
+            unsigned char *chars = image.data() + words.size() * 4;
+            for (const std::string &n : names_)
+            {
+                std::memcpy(chars, n.data(), n.size());
+                chars += n.size();
+            }
+            return image;
+        }
+
+    private:
+        struct compiled_transition
+        {
+            state_id from, to;
+            std::uint32_t event;
+            std::uint32_t guard;
+            std::vector<std::uint32_t> actions;
+        };
+
+        std::uint32_t intern(std::string_view name)
+        {
+            if (name.empty()) return no_name;
+            auto found = name_ids_.find(name);
+            if (found != name_ids_.end()) return found->second;
+            const std::uint32_t id = static_cast<std::uint32_t>(names_.size());
+            names_.emplace_back(name);
+            name_ids_.emplace(names_.back(), id);
+            return id;
+        }
+
+    private:
+        std::vector<std::uint32_t> enter_, leave_;
+        std::vector<compiled_transition> transitions_;
+        std::vector<std::string> names_;
+        std::map<std::string, std::uint32_t, std::less<>> name_ids_;
+    };
+
+    // Runs instances straight from an image, which must outlive the definition: load() only checks it and keeps track of
+    // where its arrays are, bind() resolves its callbacks by name. Like a finalized machine_definition, it's immutable
+    // and may be shared by any number of instances, even across threads if the callbacks allow it.
+    template <typename Event>
+    class compiled_definition
+    {
+    public:
+        static_assert(std::is_integral_v<Event> || std::is_enum_v<Event>, "Images identify events by 32-bit ids");
+        static_assert(sizeof(Event) <= sizeof(std::uint32_t), "Wider events would be truncated to their 32-bit id, and could alias");
+
+        typedef Event event_type;
+
+        static constexpr std::uint32_t no_name = definition_compiler::no_name;
+
+    public:
+        compiled_definition()
+            : image_(nullptr), first_(nullptr), enter_(nullptr), leave_(nullptr), events_(nullptr), targets_(nullptr), guards_(nullptr),
+              actions_(nullptr), action_list_(nullptr), name_offsets_(nullptr), names_(nullptr), state_count_(0), transition_count_(0),
+              name_count_(0), initial_state_(0), is_bound_(false)
+        {
+        }
+
+        // False, leaving the definition empty, if the image is truncated, of another version, or refers to states,
+        // transitions or names it doesn't have.
+        bool load(const void *image, std::size_t size)
+        {
+            *this = compiled_definition();
+            const unsigned char *in = static_cast<const unsigned char*>(image);
+            if (size < details::image_header_words * 4 || details::load_le32(in) != details::image_magic
+                || details::load_le32(in + 4) != details::image_version) return false;
+
+            const std::uint64_t states = details::load_le32(in + 8), transitions = details::load_le32(in + 12),
+                                actions = details::load_le32(in + 16), names = details::load_le32(in + 20),
+                                name_bytes = details::load_le32(in + 24), initial = details::load_le32(in + 28);
+            const std::uint64_t words = details::image_header_words + 3 * states + 1 + 4 * transitions + 1 + actions + names + 1;
+            if (states == 0 || initial >= states || words * 4 + name_bytes > size) return false;
+
+            const unsigned char *p = in + details::image_header_words * 4;
+            first_ = p;                       p += (states + 1) * 4;
+            enter_ = p;                       p += states * 4;
+            leave_ = p;                       p += states * 4;
+            events_ = p;                      p += transitions * 4;
+            targets_ = p;                     p += transitions * 4;
+            guards_ = p;                      p += transitions * 4;
+            actions_ = p;                     p += (transitions + 1) * 4;
+            action_list_ = p;                 p += actions * 4;
+            name_offsets_ = p;                p += (names + 1) * 4;
+            names_ = reinterpret_cast<const char*>(p);
+
+            auto name_ok = [names](std::uint32_t n) { return n == no_name || n < names; };
+            if (word(first_, 0) != 0 || word(first_, states) != transitions) return false;
+            for (std::size_t s = 0; s < states; ++s)
+            {
+                const std::uint32_t begin = word(first_, s), end = word(first_, s + 1);
+                if (begin > end || !name_ok(word(enter_, s)) || !name_ok(word(leave_, s))) return false;
+                for (std::uint32_t t = begin; t + 1 < end; ++t)
+                {
+                    if (word(events_, t) > word(events_, t + 1)) return false;
+                }
+            }
+            if (word(actions_, 0) != 0 || word(actions_, transitions) != actions) return false;
+            for (std::size_t t = 0; t < transitions; ++t)
+            {
+                if (word(targets_, t) >= states || !name_ok(word(guards_, t)) || word(actions_, t) > word(actions_, t + 1)) return false;
+            }
+            for (std::size_t a = 0; a < actions; ++a)
+            {
+                if (word(action_list_, a) >= names) return false;
+            }
+            if (word(name_offsets_, 0) != 0 || word(name_offsets_, names) != name_bytes) return false;
+            for (std::size_t n = 0; n < names; ++n)
+            {
+                if (word(name_offsets_, n) > word(name_offsets_, n + 1)) return false;
+            }
+
+            image_ = in;
+            state_count_ = static_cast<std::size_t>(states);
+            transition_count_ = static_cast<std::size_t>(transitions);
+            name_count_ = static_cast<std::size_t>(names);
+            initial_state_ = static_cast<state_id>(initial);
+            return true;
+        }
+
+        // Copies the callbacks named by the image out of the registry. False if one is missing, its name then being
+        // given through missing: the definition stays unbound.
+        bool bind(const callback_registry &registry, std::string_view *missing = nullptr)
+        {
+            assert(image_ != nullptr);
+            std::vector<guard_func> guards(name_count_);
+            std::vector<action_func> actions(name_count_);
+
+            auto bind_guard = [&](std::uint32_t n)
+            {
+                if (n == no_name || guards[n]) return true;
+                const guard_func *g = registry.find_guard(name(n));
+                if (g != nullptr) guards[n] = *g;
+                return g != nullptr;
+            };
+            auto bind_action = [&](std::uint32_t n)
+            {
+                if (n == no_name || actions[n]) return true;
+                const action_func *a = registry.find_action(name(n));
+                if (a != nullptr) actions[n] = *a;
+                return a != nullptr;
+            };
+            auto fail = [&](std::uint32_t n)
+            {
+                if (missing != nullptr) *missing = name(n);
+                return false;
+            };
+
+            for (std::size_t s = 0; s < state_count_; ++s)
+            {
+                if (!bind_action(word(enter_, s))) return fail(word(enter_, s));
+                if (!bind_action(word(leave_, s))) return fail(word(leave_, s));
+            }
+            for (std::size_t t = 0; t < transition_count_; ++t)
+            {
+                if (!bind_guard(word(guards_, t))) return fail(word(guards_, t));
+            }
+            for (std::uint32_t a = 0; a < word(actions_, transition_count_); ++a)
+            {
+                if (!bind_action(word(action_list_, a))) return fail(word(action_list_, a));
+            }
+
+            bound_guards_ = std::move(guards);
+            bound_actions_ = std::move(actions);
+            is_bound_ = true;
+            return true;
+        }
+
+        bool is_loaded() const { return image_ != nullptr; }
+        bool is_bound() const { return is_bound_; }
+        std::size_t state_count() const { return state_count_; }
+        std::size_t transition_count() const { return transition_count_; }
+        std::string_view name(std::uint32_t n) const
+        {
+            assert(n < name_count_);
+            const std::uint32_t begin = word(name_offsets_, n);
+            return std::string_view(names_ + begin, word(name_offsets_, n + 1) - begin);
+        }
+
+        void start(machine_instance &instance) const
+        {
+            assert(is_bound_);
+            instance.is_running = true;
+            instance.current_state = initial_state_;
+            call(word(enter_, initial_state_));
+        }
+
+        void stop(machine_instance &instance) const
+        {
+            assert(is_bound_);
+            if (instance.current_state != machine_instance::no_state) call(word(leave_, instance.current_state));
+            instance.is_running = false;
+            instance.current_state = machine_instance::no_state;
+        }
+
+        // The transitions of the current state for event are found by a binary search in the image, then their guards
+        // are tried in turn. True if one was taken.
+        bool notify(machine_instance &instance, const event_type &event) const
+        {
+            assert(is_bound_);
+            if (!instance.is_running) return false;
+
+            const std::uint32_t key = static_cast<std::uint32_t>(event);
+            const state_id from = instance.current_state;
+            assert(from < state_count_);
+            std::uint32_t low = word(first_, from), high = word(first_, from + 1);
+            while (low < high)
+            {
+                const std::uint32_t middle = low + (high - low) / 2;
+                if (word(events_, middle) < key) low = middle + 1;
+                else                             high = middle;
+            }
+
+            for (const std::uint32_t end = word(first_, from + 1); low != end && word(events_, low) == key; ++low)
+            {
+                const std::uint32_t g = word(guards_, low);
+                if (g != no_name && !bound_guards_[g]()) continue;
+
+                call(word(leave_, from));
+                for (std::uint32_t a = word(actions_, low), last = word(actions_, low + 1); a != last; ++a) call(word(action_list_, a));
+                instance.current_state = word(targets_, low);
+                call(word(enter_, instance.current_state));
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        static std::uint32_t word(const unsigned char *array, std::size_t i) { return details::load_le32(array + 4 * i); }
+
+        void call(std::uint32_t n) const { if (n != no_name) bound_actions_[n](); }
+
+    private:
+        const unsigned char *image_;
+        const unsigned char *first_, *enter_, *leave_, *events_, *targets_, *guards_, *actions_, *action_list_, *name_offsets_;
+        const char *names_;
+        std::size_t state_count_, transition_count_, name_count_;
+        state_id initial_state_;
+        std::vector<guard_func> bound_guards_;
+        std::vector<action_func> bound_actions_;
+        bool is_bound_;
+    };
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_CONCURRENT_MACHINE_H
+#define LIGHTWEIGHT_STATE_MACHINE_CONCURRENT_MACHINE_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <utility>
+
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    // Bounded lock-free queue for many producers and a single consumer (Vyukov's array queue). Each cell carries a
+    // sequence number telling whether it's ready to be written or read, so producers only contend on one counter.
+    template <typename T>
+    class mpsc_queue
+    {
+    public:
+        // The capacity is rounded up to the next power of two.
+        explicit mpsc_queue(std::size_t capacity)
+            : mask_(round_up(capacity) - 1), cells_(new cell[mask_ + 1]), enqueue_pos_(0), dequeue_pos_(0)
+        {
+            for (std::size_t i = 0; i <= mask_; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        mpsc_queue(const mpsc_queue&) = delete;
+        mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+        std::size_t capacity() const { return mask_ + 1; }
+
+        // Any thread. Fails if the queue is full.
+        bool try_push(const T &value)
+        {
+            cell *c;
+            std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                c = &cells_[pos & mask_];
+                const std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+                const std::intptr_t diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+                if (diff == 0)
+                {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+
+            c->value = value;
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer thread only.
+        bool try_pop(T &value)
+        {
+            cell &c = cells_[dequeue_pos_ & mask_];
+            const std::size_t sequence = c.sequence.load(std::memory_order_acquire);
+            if (static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(dequeue_pos_ + 1) < 0) return false;
+
+            value = std::move(c.value);
+            c.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+            ++dequeue_pos_;
+            return true;
+        }
+
+    private:
+        struct cell
+        {
+            std::atomic<std::size_t> sequence;
+            T value;
+        };
+
+        static std::size_t round_up(std::size_t n)
+        {
+            std::size_t p = 2;
+            while (p < n) p <<= 1;
+            return p;
+        }
+
+    private:
+        const std::size_t mask_;
+        std::unique_ptr<cell[]> cells_;
+        alignas(64) std::atomic<std::size_t> enqueue_pos_;
+        alignas(64) std::size_t dequeue_pos_;
+    };
+
+    // A machine fed through a lock-free inbox: any thread may post() events, while a single owner thread builds,
+    // starts and stops the machine and drain()s the inbox to dispatch them.
+    //
+    // The wakeup hook, if any, is called by the producer whose post() makes the inbox non-empty since the last drain, so
+    // an idle owner can sleep on a condition variable or an eventfd instead of polling.
+    template <typename Event, typename Policy = default_policy>
+    class concurrent_machine
+    {
+    public:
+        typedef Event event_type;
+        typedef Policy policy_type;
+        typedef concurrent_machine<event_type, policy_type> self_type;
+        typedef machine<event_type, policy_type> machine_type;
+        typedef std::function<void()> wakeup_func;
+
+    public:
+        explicit concurrent_machine(std::size_t inbox_capacity = 1024) : inbox_(inbox_capacity), wakeup_pending_(false) {}
+
+        concurrent_machine(const concurrent_machine&) = delete;
+        concurrent_machine& operator=(const concurrent_machine&) = delete;
+
+        // Building, starting and stopping belong to the owner thread, before any event is drained.
+        template <typename T>
+        self_type& operator<<(T &&t) { machine_ << std::forward<T>(t); return *this; }
+
+        void finalize() { machine_.finalize(); }
+        void start()    { machine_.start(); }
+        void stop()     { machine_.stop(); }
+
+        bool is_running() const { return machine_.is_running(); }
+        bool is_stopped() const { return !is_running(); }
+
+        // Must be set before producers start posting.
+        void on_wakeup(wakeup_func w) { wakeup_ = std::move(w); }
+
+        // Any thread. Returns false, dropping the event, if the inbox is full.
+        bool post(const event_type &event)
+        {
+            if (!inbox_.try_push(event)) return false;
+            if (!wakeup_pending_.exchange(true, std::memory_order_acq_rel) && wakeup_) wakeup_();
+            return true;
+        }
+
+        // Owner thread: dispatches up to max_events queued events, returns how many were. When that's max_events, more
+        // may be waiting and won't trigger another wakeup.
+        std::size_t drain(std::size_t max_events = std::numeric_limits<std::size_t>::max())
+        {
+            // Reset first, so that a post racing with the end of this drain wakes the owner up again.
+            wakeup_pending_.exchange(false, std::memory_order_acq_rel);
+
+            std::size_t count = 0;
+            event_type event;
+            while (count < max_events && inbox_.try_pop(event))
+            {
+                machine_.notify(event);
+                count++;
+            }
+            return count;
+        }
+
+        const machine_type& get_machine() const { return machine_; }
+
+    private:
+        machine_type machine_;
+        mpsc_queue<event_type> inbox_;
+        std::atomic<bool> wakeup_pending_;
+        wakeup_func wakeup_;
+    };
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_INSTANCE_ARRAY_H
+#define LIGHTWEIGHT_STATE_MACHINE_INSTANCE_ARRAY_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    // Many instances of one finalized flat definition, stored as a single array of current state ids: a fleet of
+    // identical devices rather than sessions each with their own context.
+    //
+    // Events applied to the whole array or to a list of indices go through a column built once per event, giving for
+    // each state the target of a transition that only switches state. Most instances are then moved by a gather and a
+    // store, 8 at a time with AVX2, and only those whose transition has a guard or callbacks are dispatched one by one.
+    // Instances have no timers, so the definition mustn't have after() transitions. Columns are built again once the
+    // definition is reordered.
+    template <typename Definition>
+    class instance_array
+    {
+    public:
+        typedef Definition definition_type;
+        typedef typename definition_type::event_type event_type;
+
+        static_assert(definition_type::is_finalizable, "Instance arrays dispatch through a finalized definition");
+        static_assert(std::is_void_v<typename definition_type::payload_type>, "Broadcast events carry no payload");
+
+    public:
+        // All stopped. The definition must outlive the array.
+        instance_array(const definition_type &definition, std::size_t count)
+            : definition_(definition), states_(count, machine_instance::no_state), columns_revision_(definition.revision())
+        {
+            assert(definition.is_finalized() && definition.timeout_count() == 0);
+        }
+
+        std::size_t size() const { return states_.size(); }
+        // no_state while stopped.
+        state_id current_state(std::size_t i) const { return states_[i]; }
+        const state_id* data() const { return states_.data(); }
+
+        void start(std::size_t i)
+        {
+            machine_instance instance = load(i);
+            definition_.start(instance);
+            states_[i] = instance.current_state;
+        }
+
+        void start_all() { for (std::size_t i = 0; i < states_.size(); ++i) start(i); }
+
+        void stop(std::size_t i)
+        {
+            machine_instance instance = load(i);
+            definition_.stop(instance);
+            states_[i] = machine_instance::no_state;
+        }
+
+        // Same as notify() on the instance alone.
+        void notify(std::size_t i, const event_type &event)
+        {
+            machine_instance instance = load(i);
+            definition_.notify(instance, event);
+            states_[i] = instance.current_state;
+        }
+
+        // Applies event to every running instance, in index order.
+        void notify_all(const event_type &event)
+        {
+            const state_id *targets = column(event).data();
+            const std::size_t n = states_.size();
+            std::size_t i = 0;
+#if defined(__AVX2__)
+            const __m256i last = _mm256_set1_epi32(static_cast<int>(definition_.state_count()));
+            const __m256i none = _mm256_set1_epi32(static_cast<int>(machine_instance::no_state));
+            const __m256i dispatch = _mm256_set1_epi32(static_cast<int>(definition_type::dispatch_needed));
+            for (; i + 8 <= n; i += 8)
+            {
+                __m256i *block = reinterpret_cast<__m256i*>(states_.data() + i);
+                const __m256i from = _mm256_loadu_si256(block);
+                const __m256i to = _mm256_i32gather_epi32(reinterpret_cast<const int*>(targets), _mm256_min_epu32(from, last), 4);
+                // Lanes left as they are: nothing fired, or a dispatch is needed, done afterwards.
+                const __m256i slow = _mm256_cmpeq_epi32(to, dispatch);
+                const __m256i keep = _mm256_or_si256(_mm256_cmpeq_epi32(to, none), slow);
+                _mm256_storeu_si256(block, _mm256_blendv_epi8(to, from, keep));
+
+                const int lanes = _mm256_movemask_ps(_mm256_castsi256_ps(slow));
+                for (unsigned lane = 0; lanes != 0 && lane < 8; ++lane)
+                {
+                    if (lanes & (1 << lane)) notify(i + lane, event);
+                }
+            }
+#endif
+            for (; i < n; ++i) apply(i, targets, event);
+        }
+
+        // Applies event to the instances listed, in that order. An index may only be listed once.
+        void notify_each(const std::uint32_t *indices, std::size_t count, const event_type &event)
+        {
+            const state_id *targets = column(event).data();
+            std::size_t k = 0;
+#if defined(__AVX2__)
+            assert(states_.size() <= static_cast<std::size_t>(INT32_MAX));
+            const __m256i last = _mm256_set1_epi32(static_cast<int>(definition_.state_count()));
+            for (; k + 8 <= count; k += 8)
+            {
+                const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + k));
+                const __m256i from = _mm256_i32gather_epi32(reinterpret_cast<const int*>(states_.data()), index, 4);
+                alignas(32) state_id to[8];
+                _mm256_store_si256(reinterpret_cast<__m256i*>(to), _mm256_i32gather_epi32(reinterpret_cast<const int*>(targets), _mm256_min_epu32(from, last), 4));
+                // AVX2 has no scatter: lanes are stored one by one.
+                for (unsigned lane = 0; lane < 8; ++lane) store(indices[k + lane], to[lane], event);
+            }
+#endif
+            for (; k < count; ++k)
+            {
+                assert(indices[k] < states_.size());
+                apply(indices[k], targets, event);
+            }
+        }
+
+    private:
+        machine_instance load(std::size_t i) const
+        {
+            machine_instance instance;
+            instance.current_state = states_[i];
+            instance.is_running = states_[i] != machine_instance::no_state;
+            return instance;
+        }
+
+        void apply(std::size_t i, const state_id *targets, const event_type &event)
+        {
+            const state_id from = states_[i];
+            store(i, targets[from < definition_.state_count() ? from : definition_.state_count()], event);
+        }
+
+        void store(std::size_t i, state_id to, const event_type &event)
+        {
+            if (to < definition_type::dispatch_needed) states_[i] = to;
+            else if (to == definition_type::dispatch_needed) notify(i, event);
+        }
+
+        // Target of each state for event, then no_state for stopped instances. Built on first use, and again after the
+        // definition moved its transitions.
+        const std::vector<state_id>& column(const event_type &event)
+        {
+            if (columns_revision_ != definition_.revision())
+            {
+                columns_.clear();
+                columns_revision_ = definition_.revision();
+            }
+
+            auto found = columns_.find(event);
+            if (found != columns_.end()) return found->second;
+
+            std::vector<state_id> targets(definition_.state_count() + 1, machine_instance::no_state);
+            for (state_id s = 0; s < definition_.state_count(); ++s) targets[s] = definition_.direct_target(s, event);
+            return columns_.emplace(event, std::move(targets)).first->second;
+        }
+
+    private:
+        const definition_type &definition_;
+        std::vector<state_id> states_;
+        std::map<event_type, std::vector<state_id>> columns_;
+        // Revision of the definition the columns were built from.
+        std::uint32_t columns_revision_;
+    };
+}
+
+#endif
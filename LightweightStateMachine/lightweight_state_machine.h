@@ -1,153 +1,2740 @@
 #ifndef LIGHTWEIGHT_STATE_MACHINE_H
 #define LIGHTWEIGHT_STATE_MACHINE_H
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#include <span>
+#endif
+#include <string_view>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "timing_wheel.h"
+
 namespace lightweight_state_machine
 {
-    typedef std::function<void()> enter_func;
-    typedef std::function<void()> leave_func;
-    typedef std::function<bool()> guard_func;
-    typedef std::function<void()> action_func;
+    namespace details
+    {
+        // Stands for the parameter of a copy constructor that mustn't exist.
+        struct not_copyable;
+    }
+
+    // Callable wrapper storing its target in an inline buffer of Capacity bytes: it never allocates, and callables that
+    // don't fit are rejected at compile time. Whether it can be copied is part of its type: a copyable one only takes
+    // copyable callables, a move-only one takes any.
+    template <typename Signature, std::size_t Capacity, bool Copyable>
+    class basic_inplace_function;
+
+    template <typename Signature, std::size_t Capacity = 4 * sizeof(void*)>
+    using inplace_function = basic_inplace_function<Signature, Capacity, false>;
+
+    template <typename Signature, std::size_t Capacity = 4 * sizeof(void*)>
+    using copyable_inplace_function = basic_inplace_function<Signature, Capacity, true>;
 
-    class state
+    template <typename R, typename... Args, std::size_t Capacity, bool Copyable>
+    class basic_inplace_function<R(Args...), Capacity, Copyable>
     {
+        typedef std::conditional_t<Copyable, basic_inplace_function, details::not_copyable> copied_type;
+
     public:
-        state() = default;
-        state(const state&) = default;
-        state& operator=(const state&) = default;
-        ~state() = default;
+        basic_inplace_function() noexcept : invoke_(nullptr), relocate_(nullptr), copy_(nullptr) {}
+        basic_inplace_function(std::nullptr_t) noexcept : basic_inplace_function() {}
+
+        template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, basic_inplace_function>>>
+        basic_inplace_function(F &&f)
+        {
+            typedef std::decay_t<F> callable;
+            static_assert(sizeof(callable) <= Capacity, "Callable is too big for this inplace_function, increase its capacity");
+            static_assert(alignof(callable) <= alignof(std::max_align_t), "Callable is over-aligned for inplace_function");
+            static_assert(std::is_invocable_r_v<R, callable&, Args...>, "Callable doesn't match the inplace_function signature");
+            static_assert(!Copyable || std::is_copy_constructible_v<callable>, "Callable is move-only, use an inplace_function rather than a copyable_inplace_function");
+
+            ::new (static_cast<void*>(storage_)) callable(std::forward<F>(f));
+            invoke_ = [](void *c, Args... args) -> R { return (*static_cast<callable*>(c))(std::forward<Args>(args)...); };
+            relocate_ = [](void *to, void *from)
+            {
+                if (to != nullptr) ::new (to) callable(std::move(*static_cast<callable*>(from)));
+                static_cast<callable*>(from)->~callable();
+            };
+            if constexpr (Copyable)
+            {
+                copy_ = [](void *to, const void *from) { ::new (to) callable(*static_cast<const callable*>(from)); };
+            }
+            else
+            {
+                copy_ = nullptr;
+            }
+        }
+
+        basic_inplace_function(basic_inplace_function &&other) noexcept : invoke_(other.invoke_), relocate_(other.relocate_), copy_(other.copy_)
+        {
+            if (relocate_ != nullptr) relocate_(storage_, other.storage_);
+            other.invoke_ = nullptr;
+            other.relocate_ = nullptr;
+            other.copy_ = nullptr;
+        }
+
+        // Only a copy constructor when Copyable; otherwise the one implicitly declared is deleted, as there is a move
+        // constructor.
+        basic_inplace_function(const copied_type &other) : invoke_(other.invoke_), relocate_(other.relocate_), copy_(other.copy_)
+        {
+            if (copy_ != nullptr) copy_(storage_, other.storage_);
+        }
+
+        basic_inplace_function& operator=(const copied_type &other)
+        {
+            if (this != &other)
+            {
+                basic_inplace_function copy(other);
+                *this = std::move(copy);
+            }
+            return *this;
+        }
+
+        basic_inplace_function& operator=(basic_inplace_function &&other) noexcept
+        {
+            if (this != &other)
+            {
+                this->~basic_inplace_function();
+                ::new (static_cast<void*>(this)) basic_inplace_function(std::move(other));
+            }
+            return *this;
+        }
 
-        state& on_enter(enter_func e) { on_enter_ = e; return *this; }
-        state& on_leave(leave_func l) { on_leave_ = l; return *this; }
+        ~basic_inplace_function() { if (relocate_ != nullptr) relocate_(nullptr, storage_); }
 
-        void enter() const { if (on_enter_) on_enter_(); }
-        void leave() const { if (on_leave_) on_leave_(); }
+        explicit operator bool() const noexcept { return invoke_ != nullptr; }
+
+        R operator()(Args... args) const
+        {
+            assert(invoke_ != nullptr);
+            return invoke_(storage_, std::forward<Args>(args)...);
+        }
 
     private:
-        enter_func on_enter_;
-        leave_func on_leave_;
+        alignas(std::max_align_t) mutable unsigned char storage_[Capacity];
+        R (*invoke_)(void*, Args...);
+        void (*relocate_)(void *to, void *from);
+        void (*copy_)(void *to, const void *from);
     };
 
-    template <typename Event>
-    class transition
+    namespace details
     {
-    public:
-        typedef Event event_type;
-        typedef transition<event_type> self_type;
-        typedef std::vector<action_func> actions;
+        struct no_event_queue
+        {
+            no_event_queue() = default;
+            template <typename Allocator> explicit no_event_queue(const Allocator&) {}
+        };
+
+        // FIFO of events over a circular buffer that doubles when full.
+        template <typename Event, typename Allocator>
+        class event_ring
+        {
+        public:
+            explicit event_ring(const Allocator &alloc = Allocator()) : events_(alloc), head_(0), size_(0) {}
+
+            bool empty() const { return size_ == 0; }
+            std::size_t size() const { return size_; }
+
+            void push(const Event &e)
+            {
+                if (size_ == events_.size()) grow();
+                events_[(head_ + size_) % events_.size()] = e;
+                size_++;
+            }
+
+            Event pop()
+            {
+                assert(!empty());
+                Event e = std::move(events_[head_]);
+                head_ = (head_ + 1) % events_.size();
+                size_--;
+                return e;
+            }
+
+            void clear() { head_ = size_ = 0; }
+
+        private:
+            void grow()
+            {
+                decltype(events_) grown(std::max<std::size_t>(16, events_.size() * 2), events_.get_allocator());
+                for (std::size_t i = 0; i < size_; ++i) grown[i] = std::move(events_[(head_ + i) % events_.size()]);
+                events_.swap(grown);
+                head_ = 0;
+            }
+
+        private:
+            std::vector<Event, typename std::allocator_traits<Allocator>::template rebind_alloc<Event>> events_;
+            std::size_t head_, size_;
+        };
+
+        // FIFO of at most Capacity events, stored inline. Pushing to a full ring drops the event.
+        template <typename Event, std::size_t Capacity>
+        class fixed_event_ring
+        {
+        public:
+            fixed_event_ring() : head_(0), size_(0) {}
+            template <typename Allocator> explicit fixed_event_ring(const Allocator&) : fixed_event_ring() {}
+
+            bool empty() const { return size_ == 0; }
+            std::size_t size() const { return size_; }
+
+            void push(const Event &e)
+            {
+                assert(size_ < Capacity && "run-to-completion queue overflow");
+                if (size_ == Capacity) return;
+                events_[(head_ + size_) % Capacity] = e;
+                size_++;
+            }
+
+            Event pop()
+            {
+                assert(!empty());
+                Event e = std::move(events_[head_]);
+                head_ = (head_ + 1) % Capacity;
+                size_--;
+                return e;
+            }
+
+            void clear() { head_ = size_ = 0; }
+
+        private:
+            std::array<Event, Capacity> events_;
+            std::size_t head_, size_;
+        };
+
+        // Events a machine deferred, by decreasing priority, then in the order they arrived in.
+        template <typename Event, typename Allocator>
+        class deferred_queue
+        {
+        public:
+            struct entry
+            {
+                // Constructed in place, rather than copied whole from fields just stored.
+                entry(const Event &e, int p, std::uint64_t a) : event(e), priority(p), arrival(a) {}
+
+                Event event;
+                int priority;
+                std::uint64_t arrival;
+            };
+
+            typedef std::vector<entry, typename std::allocator_traits<Allocator>::template rebind_alloc<entry>> entries;
+
+            explicit deferred_queue(const Allocator &alloc = Allocator()) : entries_(alloc), arrivals_(0) {}
+
+            bool empty() const { return entries_.empty(); }
+            std::size_t size() const { return entries_.size(); }
+
+            // Arriving last, an event goes after those of its priority: mostly appended, as events are mostly deferred
+            // at one priority.
+            void push(const Event &e, int priority)
+            {
+                if (entries_.empty() || priority <= entries_.back().priority) entries_.emplace_back(e, priority, arrivals_++);
+                else                                                         push(entry(e, priority, arrivals_++));
+            }
+
+            // Deferred again, an entry keeps its place among those of its priority.
+            void push(entry e) { entries_.insert(std::upper_bound(entries_.begin(), entries_.end(), e, precedes), std::move(e)); }
+
+            // Hands every entry over to batch, in order, and empties the queue.
+            void take(entries &batch)
+            {
+                batch.clear();
+                batch.swap(entries_);
+            }
+
+            void clear() { entries_.clear(); }
+
+        private:
+            static bool precedes(const entry &a, const entry &b) { return a.priority > b.priority || (a.priority == b.priority && a.arrival < b.arrival); }
+
+        private:
+            entries entries_;
+            std::uint64_t arrivals_;
+        };
+
+        // Where a definition's timers are handed to once due, see machine_definition::route_timers(). Not copied, as it
+        // refers to the definition's owner: copies start with their timers unrouted.
+        struct timer_route
+        {
+            timer_route() = default;
+            timer_route(const timer_route&) {}
+            timer_route& operator=(const timer_route&) { return *this; }
+
+            timing_wheel::expiry_func func = nullptr;
+            const void *owner = nullptr;
+        };
+    }
+
+    namespace details
+    {
+        // Events that can be laid out in a dense [state][event] table: integral and enum types, indexed by their value.
+        template <typename Event>
+        constexpr bool is_dense_event_v = (std::is_integral_v<Event> || std::is_enum_v<Event>) && !std::is_same_v<Event, bool>;
+
+        struct no_dispatch_table;
+        template <typename Event, typename Allocator> class dense_dispatch_table;
+        template <typename Event, typename Hash, typename Allocator> class hashed_dispatch_table;
+
+        // Hashes events and the keys they're notified with alike: anything convertible to a string_view is hashed as
+        // one, so that std::string events can be found from string_views and literals.
+        struct event_hash
+        {
+            template <typename Key>
+            std::size_t operator()(const Key &key) const
+            {
+                if constexpr (std::is_convertible_v<const Key&, std::string_view>) return std::hash<std::string_view>()(key);
+                else                                                                return std::hash<Key>()(key);
+            }
+        };
+    }
+
+    // Index of a state in the machine_definition it was added to, in registration order.
+    typedef std::uint32_t state_id;
+
+    struct machine_instance;
+
+    // Observer interface, and the default one doing nothing. The definition doesn't even read the clock for it, so an
+    // unobserved notify() is the same code as without hooks. Observers derive from it and hide the hooks they need.
+    // States are reported by index, as in machine_instance::current_state, and transitions by their position in the
+    // definition, which changes when it's finalized, and when it's reordered. Events are given as notified, possibly as
+    // a key standing for the event type.
+    struct null_observer
+    {
+        typedef std::chrono::steady_clock clock;
+        typedef clock::time_point time_point;
+
+        static constexpr std::size_t no_transition = std::numeric_limits<std::size_t>::max();
+
+        // Called by finalize(), while the definition isn't used yet.
+        void on_finalize(std::size_t /*state_count*/, std::size_t /*transition_count*/) {}
+        // Called by reorder(): the transition now at position i was at positions[i].
+        void on_reorder(const std::size_t * /*positions*/, std::size_t /*transition_count*/) {}
+
+        template <typename Event>
+        void on_dispatch_begin(const machine_instance&, const Event&, time_point) {}
+        // fired is no_transition when none was taken.
+        template <typename Event>
+        void on_dispatch_end(const machine_instance&, const Event&, std::size_t /*fired*/, time_point /*begin*/, time_point /*end*/) {}
+        void on_guard(const machine_instance&, std::size_t /*transition*/, bool /*accepted*/) {}
+        // No transition leaves the current state on this event.
+        template <typename Event>
+        void on_unmatched(const machine_instance&, const Event&, time_point) {}
+
+        // Reported once the callbacks returned, with the time they took.
+        void on_enter(const machine_instance&, state_id, time_point /*begin*/, time_point /*end*/) {}
+        void on_leave(const machine_instance&, state_id, time_point /*begin*/, time_point /*end*/) {}
+        void on_actions(const machine_instance&, std::size_t /*transition*/, time_point /*begin*/, time_point /*end*/) {}
+    };
+
+    namespace details
+    {
+        // Observers compiled out keep their interface but declare a static constexpr bool is_enabled = false, and are
+        // then never called, as if they were a null_observer.
+        template <typename Observer, typename = void>
+        struct is_enabled_observer : std::true_type {};
+
+        template <typename Observer>
+        struct is_enabled_observer<Observer, std::void_t<decltype(Observer::is_enabled)>> : std::bool_constant<Observer::is_enabled> {};
+
+        // Observers only interested in dispatches declare a static constexpr bool observes_callbacks = false: the enter,
+        // leave and action hooks aren't called nor timed, and transitions without callbacks stay a plain store.
+        template <typename Observer, typename = void>
+        struct observes_callbacks : std::true_type {};
+
+        template <typename Observer>
+        struct observes_callbacks<Observer, std::void_t<decltype(Observer::observes_callbacks)>> : std::bool_constant<Observer::observes_callbacks> {};
+
+        // Observers that don't measure how long dispatches take declare a static constexpr bool times_dispatch = false:
+        // the clock is only read when a dispatch ends, and the begin time they're given is a default time_point.
+        template <typename Observer, typename = void>
+        struct times_dispatch : std::true_type {};
+
+        template <typename Observer>
+        struct times_dispatch<Observer, std::void_t<decltype(Observer::times_dispatch)>> : std::bool_constant<Observer::times_dispatch> {};
+    }
+
+    // Policies select how states and transitions store their callbacks, and the allocator backing what a machine owns.
+    // States only depend on the callables part of a policy, so they can be shared by machines with different policies.
+    struct std_function_policy
+    {
+        typedef std_function_policy callables;
+        // Callbacks of states, which are copied into the machines they're added to, and those of transitions, which
+        // only have to be moved when they're moved in.
+        template <typename Signature> using function = std::function<Signature>;
+        template <typename Signature> using move_only_function = function<Signature>;
+        typedef std::allocator<std::byte> allocator_type;
+        // Events notified from a callback are dispatched right away, from within that callback.
+        template <typename Event, typename Allocator> using event_queue = details::no_event_queue;
+        typedef null_observer observer;
+        // Index built by finalize(): a [state][event] table, so only integral and enum events can be finalized.
+        template <typename Event, typename Allocator>
+        using dispatch_table = std::conditional_t<details::is_dense_event_v<Event>, details::dense_dispatch_table<Event, Allocator>, details::no_dispatch_table>;
+        // Guards, actions and enter/leave handlers take no argument.
+        typedef void payload;
+    };
 
+    // Allocation-free callbacks. States are copied into the machines they're added to, so their callbacks must be
+    // copyable; guards and actions may be move-only, transitions then have to be moved in and their definitions can't
+    // be copied. Both are checked at compile time.
+    template <std::size_t Capacity = 4 * sizeof(void*)>
+    struct inplace_function_policy : std_function_policy
+    {
+        typedef inplace_function_policy callables;
+        template <typename Signature> using function = copyable_inplace_function<Signature, Capacity>;
+        template <typename Signature> using move_only_function = inplace_function<Signature, Capacity>;
+    };
+
+    // Backs the containers of a machine (and the action lists of its transitions) with a polymorphic allocator, usually
+    // drawing from a machine_arena. Combine with inplace_function_policy for callbacks that don't allocate either.
+    template <typename Base = std_function_policy>
+    struct arena_policy : Base
+    {
+        typedef std::pmr::polymorphic_allocator<std::byte> allocator_type;
+    };
+
+    // Run-to-completion: events notified while the machine is dispatching are queued and handled one after the other
+    // once the current transition is over, so chains of automatic transitions don't grow the stack. The queue grows as
+    // needed when Capacity is 0, otherwise it's a fixed ring of Capacity events.
+    template <typename Base = std_function_policy, std::size_t Capacity = 0>
+    struct run_to_completion_policy : Base
+    {
+        template <typename Event, typename Allocator>
+        using event_queue = std::conditional_t<Capacity == 0, details::event_ring<Event, Allocator>, details::fixed_event_ring<Event, Capacity>>;
+    };
+
+    // Finalizes into an open-addressing hash table keyed on (state, event) instead, for events from a wide or sparse
+    // domain such as 64-bit message codes or strings, which a dense table can't hold. Transitions sharing a trigger are
+    // still stored contiguously in registration order. Events need operator== and a Hash, which must hash the keys
+    // notified for them like the events themselves.
+    template <typename Base = std_function_policy, typename Hash = details::event_hash>
+    struct hashed_dispatch_policy : Base
+    {
+        template <typename Event, typename Allocator>
+        using dispatch_table = details::hashed_dispatch_table<Event, Hash, Allocator>;
+    };
+
+    // Instruments dispatch with an Observer, owned by the definition. Hooks are called from notify(), so an observer of a
+    // definition shared across threads has to be thread-safe.
+    template <typename Observer, typename Base = std_function_policy>
+    struct observer_policy : Base
+    {
+        typedef Observer observer;
+    };
+
+    // Guards, actions and enter/leave handlers take a const Payload&, given to notify() along with the event, which
+    // stays the dispatch key. The payload is passed down by reference and never copied, so it can live on the caller's
+    // stack. Being part of the callables, it also changes the type of states.
+    template <typename Payload, typename Base = std_function_policy>
+    struct payload_policy : Base
+    {
+        static_assert(!std::is_reference_v<Payload> && !std::is_void_v<Payload>, "The payload is given by const reference, use its plain type");
+
+        typedef payload_policy<Payload, typename Base::callables> callables;
+        typedef Payload payload;
+    };
+
+    namespace details
+    {
+        // Signature of the callbacks of a callables policy, returning R: type for states, move_only_type for
+        // transitions.
+        template <typename Callables, typename R, typename Payload = typename Callables::payload>
+        struct callback
+        {
+            typedef typename Callables::template function<R(const Payload&)> type;
+            typedef typename Callables::template move_only_function<R(const Payload&)> move_only_type;
+        };
+
+        template <typename Callables, typename R>
+        struct callback<Callables, R, void>
+        {
+            typedef typename Callables::template function<R()> type;
+            typedef typename Callables::template move_only_function<R()> move_only_type;
+        };
+
+        // Whether what's given to notify() matches the payload of a definition: nothing when it has none, otherwise
+        // exactly a Payload, so that no temporary is made.
+        template <typename Payload, typename... Args>
+        constexpr bool is_payload_v = sizeof...(Args) == 0 ? std::is_void_v<Payload> : (sizeof...(Args) == 1 && (std::is_same_v<Args, Payload> && ...));
+    }
+
+    // Monotonic memory for short-lived machines: allocations are pointer bumps into one block, growing geometrically
+    // from upstream if the initial size was too small, and everything is released at once when the arena goes away.
+    // The arena must outlive the machines allocated from it.
+    class machine_arena
+    {
     public:
-        transition(const state &from, const state &to, const event_type &on_this_event)
-            : from_(from), to_(to), on_this_event_(on_this_event)
+        explicit machine_arena(std::size_t initial_size, std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+            : resource_(initial_size, upstream)
+        {
+        }
+
+        machine_arena(void *buffer, std::size_t size, std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+            : resource_(buffer, size, upstream)
         {
         }
 
-        self_type& operator() (guard_func g) { guard_ = std::move(g); return *this; }
-        self_type& operator/ (action_func a) { actions_.push_back(std::move(a)); return *this; }
+        machine_arena(const machine_arena&) = delete;
+        machine_arena& operator=(const machine_arena&) = delete;
 
-        const state& from() const { return from_; }
-        const state& to() const { return to_; }
-        const event_type& get_event() const { return on_this_event_; }
-        bool check_guard() const { return !guard_ || guard_(); }
-        void invoke_actions() const { for(auto &a : actions_) { a(); } }
+        std::pmr::polymorphic_allocator<std::byte> get_allocator() { return &resource_; }
+        std::pmr::memory_resource* resource() { return &resource_; }
 
     private:
-        const state &from_, &to_;
-        event_type on_this_event_;
-        guard_func guard_;
-        actions actions_;
-
+        std::pmr::monotonic_buffer_resource resource_;
     };
 
-    template <typename Event>
-    class machine
+    typedef std_function_policy default_policy;
+
+    typedef default_policy::function<void()> enter_func;
+    typedef default_policy::function<void()> leave_func;
+    typedef default_policy::function<bool()> guard_func;
+    typedef default_policy::function<void()> action_func;
+
+    template <typename Policy = default_policy>
+    class basic_state
     {
     public:
-        static_assert(!std::is_same_v<Event, void>, "void-event typed machine are illegal");
+        static_assert(std::is_same_v<Policy, typename Policy::callables>, "States are parameterized by a callable policy, use basic_state<machine_policy::callables>");
+
+        typedef Policy policy_type;
+        typedef typename details::callback<policy_type, void>::type enter_func;
+        typedef typename details::callback<policy_type, void>::type leave_func;
+
+    public:
+        basic_state() = default;
+        basic_state(const basic_state&) = default;
+        basic_state(basic_state&&) = default;
+        basic_state& operator=(const basic_state&) = default;
+        basic_state& operator=(basic_state&&) = default;
+        ~basic_state() = default;
+
+        basic_state& on_enter(enter_func e) & { on_enter_ = std::move(e); return *this; }
+        basic_state& on_leave(leave_func l) & { on_leave_ = std::move(l); return *this; }
+        basic_state&& on_enter(enter_func e) && { on_enter_ = std::move(e); return std::move(*this); }
+        basic_state&& on_leave(leave_func l) && { on_leave_ = std::move(l); return std::move(*this); }
+
+        // Given the payload, if the policy has one.
+        template <typename... Payload>
+        void enter(const Payload&... payload) const { if (on_enter_) on_enter_(payload...); }
+        template <typename... Payload>
+        void leave(const Payload&... payload) const { if (on_leave_) on_leave_(payload...); }
+
+        bool has_on_enter() const { return static_cast<bool>(on_enter_); }
+        bool has_on_leave() const { return static_cast<bool>(on_leave_); }
+
+    private:
+        enter_func on_enter_;
+        leave_func on_leave_;
+    };
+
+    typedef basic_state<> state;
+
+    namespace details
+    {
+        template <typename Callables, std::size_t N>
+        struct nesting
+        {
+            const basic_state<Callables> *parent;
+            std::array<const basic_state<Callables>*, N> children;
+        };
+    }
+
+    // Makes children substates of parent: while in one of them, the machine is also in parent, and parent's
+    // transitions apply to them unless they handle the event themselves. The first child listed is the one entered
+    // along with parent.
+    //
+    //     sm << lsm::nest(connected, idle, busy)
+    //        << (connected | disconnected) [Event::hang_up];   // from idle and busy alike
+    template <typename Callables, typename... Children>
+    details::nesting<Callables, sizeof...(Children)> nest(const basic_state<Callables> &parent, const Children&... children)
+    {
+        static_assert(sizeof...(Children) > 0, "A composite state needs at least one substate");
+        static_assert((std::is_same_v<Children, basic_state<Callables>> && ...), "Substates must be states of the same policy as their parent");
+        return { &parent, {{ &children... }} };
+    }
+
+    namespace details
+    {
+        template <typename Callables>
+        struct region_start
+        {
+            const basic_state<Callables> *initial;
+        };
+    }
+
+    // Adds an orthogonal region starting in initial, next to the one started by the machine's initial state. Each region
+    // has its own current state and every event goes to all of them in turn; transitions must stay within a region.
+    template <typename Callables>
+    details::region_start<Callables> region(const basic_state<Callables> &initial)
+    {
+        return { &initial };
+    }
+
+    namespace details
+    {
+        struct completion_event {};
+    }
+
+    // Trigger of completion transitions, which need no event: they're taken as soon as their source becomes the
+    // current state, if their guard accepts. Their guard and actions are given the payload of the notify() or start()
+    // that entered the source. The completions of a composite state are tried whenever one of its substates becomes
+    // current, after those of the substate.
+    //
+    //     sm << (loading | ready) [lsm::completion] ([&]() { return cache.is_warm(); });
+    inline constexpr details::completion_event completion{};
+
+    namespace details
+    {
+        struct timeout_event
+        {
+            timing_wheel::duration delay;
+        };
+    }
+
+    // Trigger of timed transitions, taken once their source has been the current state for delay, if their guard
+    // accepts; otherwise the next one by delay gets its turn. Timers run on the timing_wheel given to the definition.
+    // An instance holds a single timer, for its innermost state: composite states can't have timed transitions.
+    //
+    //     sm << (waiting | timed_out) [lsm::after(std::chrono::seconds(30))];
+    template <typename Rep, typename Period>
+    details::timeout_event after(std::chrono::duration<Rep, Period> delay)
+    {
+        return { std::chrono::duration_cast<timing_wheel::duration>(delay) };
+    }
+
+    namespace details
+    {
+        template <typename Callables, typename Event>
+        struct deferral
+        {
+            const basic_state<Callables> *state;
+            Event event;
+            int priority_value;
+
+            deferral& priority(int p) & { priority_value = p; return *this; }
+            deferral&& priority(int p) && { priority_value = p; return std::move(*this); }
+        };
+    }
+
+    // Makes state keep event instead of dropping it when no transition takes it there. A machine notifies deferred
+    // events again once its current state has changed, as a batch by decreasing priority and then in arrival order;
+    // those the new state defers as well wait for the next change. Substates defer what their ancestors do.
+    //
+    //     sm << lsm::defer(handshake, Event::key_pressed).priority(1);
+    template <typename Callables, typename Event>
+    details::deferral<Callables, std::decay_t<Event>> defer(const basic_state<Callables> &state, Event &&event)
+    {
+        return { &state, std::forward<Event>(event), 0 };
+    }
 
+    template <typename Event, typename Policy = default_policy>
+    class transition
+    {
     public:
         typedef Event event_type;
-        typedef machine<event_type> self_type;
-        typedef std::multimap<std::pair<event_type, const state*>, transition<event_type>> transitions;
+        typedef Policy policy_type;
+        typedef transition<event_type, policy_type> self_type;
+        typedef basic_state<typename policy_type::callables> state_type;
+        typedef typename details::callback<typename policy_type::callables, bool>::move_only_type guard_func;
+        typedef typename details::callback<typename policy_type::callables, void>::move_only_type action_func;
+        typedef typename std::allocator_traits<typename policy_type::allocator_type>::template rebind_alloc<action_func> allocator_type;
+        typedef std::vector<action_func, allocator_type> actions;
 
-   public:
-       machine() : is_running_(false), initial_state_(nullptr), current_state_(nullptr) {}
-	   machine(const machine&) = default;
-	   machine& operator=(const machine&) = default;
-	   ~machine() = default;
+    public:
+        transition(const state_type &from, const state_type &to, event_type on_this_event, const allocator_type &alloc = allocator_type())
+            : from_(&from), to_(&to), on_this_event_(std::move(on_this_event)), priority_(0), actions_(alloc)
+        {
+        }
 
-	   self_type& operator<<(const state &initial_state)
-	   {
-           assert(initial_state_ == nullptr);
-           initial_state_ = &initial_state;
-           return *this;
-	   }
+        transition(const transition&) = default;
+        transition(transition&&) = default;
+        transition& operator=(const transition&) = default;
+        transition& operator=(transition&&) = default;
 
-        template <typename TransitionEventType>
-        self_type& operator<<(transition<TransitionEventType> &t) 
+        // Allocator-extended forms, used when a transition is stored into a machine with its own allocator.
+        transition(const transition &other, const allocator_type &alloc)
+            : from_(other.from_), to_(other.to_), on_this_event_(other.on_this_event_), priority_(other.priority_), guard_(other.guard_), actions_(other.actions_, alloc)
         {
-            static_assert(std::is_same_v<TransitionEventType, event_type>, "You can't add a transition with an event type different from the machine");
-            transitions_.insert(std::make_pair(std::make_pair(t.get_event(), &t.from()), t));
-            return *this;
         }
 
-        void start()	{ current_state_ = initial_state_; is_running_ = true; current_state_->enter(); }
-        void stop()     { if (current_state_ != nullptr) current_state_->leave(); is_running_ = false; }
+        transition(transition &&other, const allocator_type &alloc)
+            : from_(other.from_), to_(other.to_), on_this_event_(std::move(other.on_this_event_)), priority_(other.priority_), guard_(std::move(other.guard_)), actions_(std::move(other.actions_), alloc)
+        {
+        }
 
-        bool is_running() const { return is_running_; }
-        bool is_stopped() const { return !is_running(); }
+        // Conversions from a transition built for another policy with the same callables, typically one made by the
+        // builder being stored into a machine that uses its own allocator.
+        template <typename OtherPolicy, typename = std::enable_if_t<!std::is_same_v<OtherPolicy, Policy>>>
+        transition(const transition<Event, OtherPolicy> &other, const allocator_type &alloc = allocator_type())
+            : from_(other.from_), to_(other.to_), on_this_event_(other.on_this_event_), priority_(other.priority_), guard_(other.guard_), actions_(other.actions_.begin(), other.actions_.end(), alloc)
+        {
+            static_assert(std::is_same_v<typename OtherPolicy::callables, typename Policy::callables>, "Transitions can only be converted between policies sharing their callables");
+        }
 
-        void notify(const event_type &event)
+        template <typename OtherPolicy, typename = std::enable_if_t<!std::is_same_v<OtherPolicy, Policy>>>
+        transition(transition<Event, OtherPolicy> &&other, const allocator_type &alloc = allocator_type())
+            : from_(other.from_), to_(other.to_), on_this_event_(std::move(other.on_this_event_)), priority_(other.priority_), guard_(std::move(other.guard_)), actions_(alloc)
         {
-            transitions::key_type key(std::make_pair(event, current_state_));
-            auto range = transitions_.equal_range(key);
-            for (auto it = range.first; it != range.second; ++it)
-            {
-                if (it->second.check_guard())
-                {
-                    if (current_state_ != nullptr) current_state_->leave();
-                    it->second.invoke_actions();
-                    current_state_ = &it->second.to();
-                    if (current_state_ != nullptr) current_state_->enter();
-                    break;
-                }
-            }
+            static_assert(std::is_same_v<typename OtherPolicy::callables, typename Policy::callables>, "Transitions can only be converted between policies sharing their callables");
+            actions_.reserve(other.actions_.size());
+            for (auto &a : other.actions_) actions_.push_back(std::move(a));
         }
 
+        self_type& operator() (guard_func g) & { guard_ = std::move(g); return *this; }
+        self_type& operator/ (action_func a) & { actions_.push_back(std::move(a)); return *this; }
+        self_type&& operator() (guard_func g) && { guard_ = std::move(g); return std::move(*this); }
+        self_type&& operator/ (action_func a) && { actions_.push_back(std::move(a)); return std::move(*this); }
+
+        // Among transitions sharing a trigger, higher priorities have their guard checked first; equal priorities keep
+        // the order the transitions were added in.
+        self_type& priority(int p) & { priority_ = p; return *this; }
+        self_type&& priority(int p) && { priority_ = p; return std::move(*this); }
+
+        // The states the transition was built from; transitions stored in a definition refer to states by id instead.
+        const state_type& from() const { assert(from_ != nullptr); return *from_; }
+        const state_type& to() const { assert(to_ != nullptr); return *to_; }
+        const event_type& get_event() const { return on_this_event_; }
+        int get_priority() const { return priority_; }
+        bool has_guard() const { return static_cast<bool>(guard_); }
+        bool has_actions() const { return !actions_.empty(); }
+        template <typename... Payload>
+        bool check_guard(const Payload&... payload) const { return !guard_ || guard_(payload...); }
+        template <typename... Payload>
+        void invoke_actions(const Payload&... payload) const { for(auto &a : actions_) { a(payload...); } }
+
     private:
-        bool is_running_;
-        const state *initial_state_, *current_state_;
-        transitions transitions_;
+        template <typename, typename> friend class transition;
+        template <typename, typename> friend class machine_definition;
+
+        // Only identifies the states, machines copy them.
+        const state_type *from_, *to_;
+        event_type on_this_event_;
+        int priority_;
+        guard_func guard_;
+        actions actions_;
+
     };
 
     namespace details
     {
-        struct transition_builder
+        template <typename Event>
+        constexpr auto event_value(const Event &e)
+        {
+            if constexpr (std::is_enum_v<Event>) return static_cast<std::underlying_type_t<Event>>(e);
+            else                                return e;
+        }
+
+        struct no_dispatch_table
         {
-            transition_builder(const state &from, const state &to)
+            no_dispatch_table() = default;
+            template <typename Allocator> explicit no_dispatch_table(const Allocator&) {}
+        };
+
+        // Same candidate layout, with cells numbered in the order their (state, event) is first seen and found through
+        // an open-addressing table with linear probing, kept at most half full. Entries only hold the mixed hash, so
+        // probing compares full words and reads the event of a cell only when the hash matches.
+        template <typename Event, typename Hash, typename Allocator>
+        class hashed_dispatch_table
+        {
+        public:
+            typedef std::pair<std::uint32_t, std::uint32_t> span;
+
+        private:
+            template <typename T>
+            using allocator_for = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+            static constexpr std::uint32_t no_cell = std::numeric_limits<std::uint32_t>::max();
+
+            struct entry
+            {
+                std::uint64_t hash;
+                std::uint32_t state, cell;
+            };
+
+        public:
+            explicit hashed_dispatch_table(const Allocator &alloc = Allocator()) : entries_(alloc), events_(alloc), offsets_(alloc), mask_(0) {}
+
+            template <typename Keys>
+            void build(std::size_t /*state_count*/, const Keys &keys)
+            {
+                entries_.clear();
+                events_.clear();
+                offsets_.clear();
+                mask_ = 0;
+                if (keys.empty()) return;
+                assert(keys.size() < no_cell);
+
+                std::size_t capacity = 2;
+                while (capacity < 2 * keys.size()) capacity <<= 1;
+                entries_.assign(capacity, entry{ 0, 0, no_cell });
+                mask_ = capacity - 1;
+
+                offsets_.push_back(0);
+                for (auto &k : keys)
+                {
+                    const std::uint32_t state = static_cast<std::uint32_t>(k.first);
+                    const std::uint64_t h = mix(state, k.second);
+                    entry *e = probe(h, state, k.second);
+                    if (e->cell == no_cell)
+                    {
+                        *e = entry{ h, state, static_cast<std::uint32_t>(events_.size()) };
+                        events_.push_back(k.second);
+                        offsets_.push_back(0);
+                    }
+                    offsets_[e->cell + 1]++;
+                }
+                for (std::size_t i = 1; i < offsets_.size(); ++i) offsets_[i] += offsets_[i - 1];
+            }
+
+            std::uint32_t cell(std::size_t state_index, const Event &e) const
+            {
+                const std::uint32_t state = static_cast<std::uint32_t>(state_index);
+                return probe(mix(state, e), state, e)->cell;
+            }
+
+            template <typename Key>
+            span find(std::size_t state_index, const Key &key) const
+            {
+                if (entries_.empty()) return span(0, 0);
+                const std::uint32_t state = static_cast<std::uint32_t>(state_index);
+                const entry *e = probe(mix(state, key), state, key);
+                if (e->cell == no_cell) return span(0, 0);
+                return span(offsets_[e->cell], offsets_[e->cell + 1]);
+            }
+
+        private:
+            // The state is folded in before a multiplicative finalizer, as std::hash is often the identity for
+            // integers and message codes tend to differ in a few bits only.
+            template <typename Key>
+            static std::uint64_t mix(std::uint32_t state, const Key &key)
+            {
+                std::uint64_t h = static_cast<std::uint64_t>(Hash()(key)) ^ (static_cast<std::uint64_t>(state) * 0x9E3779B97F4A7C15ull);
+                h ^= h >> 32;
+                h *= 0xD6E8FEB86659FD93ull;
+                h ^= h >> 32;
+                return h;
+            }
+
+            // The entry holding (state, key), or the empty one where it would go.
+            template <typename Key>
+            const entry* probe(std::uint64_t h, std::uint32_t state, const Key &key) const
+            {
+                for (std::size_t i = static_cast<std::size_t>(h) & mask_; ; i = (i + 1) & mask_)
+                {
+                    const entry &e = entries_[i];
+                    if (e.cell == no_cell) return &e;
+                    if (e.hash == h && e.state == state && events_[e.cell] == key) return &e;
+                }
+            }
+
+            template <typename Key>
+            entry* probe(std::uint64_t h, std::uint32_t state, const Key &key)
+            {
+                return const_cast<entry*>(static_cast<const hashed_dispatch_table*>(this)->probe(h, state, key));
+            }
+
+        private:
+            std::vector<entry, allocator_for<entry>> entries_;
+            // Event of each cell.
+            std::vector<Event, allocator_for<Event>> events_;
+            std::vector<std::uint32_t, allocator_for<std::uint32_t>> offsets_;
+            std::size_t mask_;
+        };
+
+        // CSR-style index over a finalized machine: the candidates of cell (state, event) are the transitions
+        // [offsets_[cell], offsets_[cell + 1]), stored contiguously by the machine in registration order. Events too
+        // sparse for a table of every (state, value), such as 32 or 64-bit message codes, are hashed instead.
+        template <typename Event, typename Allocator>
+        class dense_dispatch_table
+        {
+        public:
+            static_assert(is_dense_event_v<Event>, "dense dispatch requires an integral or enum event type");
+
+            typedef std::pair<std::uint32_t, std::uint32_t> span;
+
+        public:
+            // Cells a dense table may take, per candidate and in any case.
+            static constexpr std::uintmax_t cells_per_candidate = 64, min_cells = 4096;
+
+            explicit dense_dispatch_table(const Allocator &alloc = Allocator()) : offsets_(alloc), event_bias_(0), event_width_(0), is_sparse_(false), sparse_(alloc) {}
+
+            // keys are the (state index, event) of each candidate, in any order. The machine then sorts the candidates
+            // by cell().
+            template <typename Keys>
+            void build(std::size_t state_count, const Keys &keys)
+            {
+                offsets_.clear();
+                event_bias_ = event_width_ = 0;
+                is_sparse_ = false;
+                if (keys.empty()) return;
+
+                auto [lowest, highest] = std::minmax_element(keys.begin(), keys.end(),
+                    [](const auto &a, const auto &b) { return event_value(a.second) < event_value(b.second); });
+                // Modular, so that the span of the whole range doesn't overflow.
+                const std::uintmax_t range = static_cast<std::uintmax_t>(event_value(highest->second)) - static_cast<std::uintmax_t>(event_value(lowest->second));
+                if (range >= (min_cells + cells_per_candidate * keys.size()) / state_count)
+                {
+                    is_sparse_ = true;
+                    sparse_.build(state_count, keys);
+                    return;
+                }
+                event_bias_  = static_cast<std::uintmax_t>(event_value(lowest->second));
+                event_width_ = range + 1;
+                assert(keys.size() <= std::numeric_limits<std::uint32_t>::max());
+
+                offsets_.assign(state_count * event_width_ + 1, 0);
+                for (auto &k : keys) offsets_[cell(k.first, k.second) + 1]++;
+                for (std::size_t i = 1; i < offsets_.size(); ++i) offsets_[i] += offsets_[i - 1];
+            }
+
+            std::uintmax_t cell(std::size_t state_index, const Event &e) const
+            {
+                if (is_sparse_) return sparse_.cell(state_index, e);
+                return state_index * event_width_ + (static_cast<std::uintmax_t>(event_value(e)) - event_bias_);
+            }
+
+            span find(std::size_t state_index, const Event &e) const
+            {
+                if (is_sparse_) return sparse_.find(state_index, e);
+                const std::uintmax_t column = static_cast<std::uintmax_t>(event_value(e)) - event_bias_;
+                if (column >= event_width_) return span(0, 0);
+                const std::uintmax_t c = state_index * event_width_ + column;
+                return span(offsets_[c], offsets_[c + 1]);
+            }
+
+        private:
+            std::vector<std::uint32_t, typename std::allocator_traits<Allocator>::template rebind_alloc<std::uint32_t>> offsets_;
+            std::uintmax_t event_bias_, event_width_;
+            bool is_sparse_;
+            hashed_dispatch_table<Event, event_hash, Allocator> sparse_;
+        };
+    }
+
+    // Per-session part of a machine: which state it's in, whether it runs and a user context slot the engine never
+    // touches. It's only meaningful along with the machine_definition driving it, and holds nothing but plain values,
+    // so it can be copied around or stored as is.
+    struct machine_instance
+    {
+        static constexpr state_id no_state = std::numeric_limits<state_id>::max();
+
+        state_id current_state = no_state;
+        bool is_running = false;
+        // Armed on the definition's timing_wheel while the current state has after() transitions. The wheel then
+        // points to the instance, which mustn't move until the timer fires or the state is left.
+        timing_wheel::timer_id timer = timing_wheel::no_timer;
+        void *context = nullptr;
+    };
+
+    static_assert(std::is_trivially_copyable_v<machine_instance>, "machine_instance must stay relocatable");
+
+    namespace details
+    {
+        // Words are copied whole, and only swapped on big-endian targets; MSVC only has little-endian ones.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        constexpr bool is_big_endian = true;
+#else
+        constexpr bool is_big_endian = false;
+#endif
+
+        inline std::uint16_t byteswap16(std::uint16_t v) { return static_cast<std::uint16_t>((v >> 8) | (v << 8)); }
+        inline std::uint32_t byteswap32(std::uint32_t v) { return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24); }
+
+        inline void store_le16(unsigned char *p, std::uint16_t v)
+        {
+            if constexpr (is_big_endian) v = byteswap16(v);
+            std::memcpy(p, &v, sizeof(v));
+        }
+
+        inline void store_le32(unsigned char *p, std::uint32_t v)
+        {
+            if constexpr (is_big_endian) v = byteswap32(v);
+            std::memcpy(p, &v, sizeof(v));
+        }
+
+        inline std::uint16_t load_le16(const unsigned char *p)
+        {
+            std::uint16_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return is_big_endian ? byteswap16(v) : v;
+        }
+
+        inline std::uint32_t load_le32(const unsigned char *p)
+        {
+            std::uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return is_big_endian ? byteswap32(v) : v;
+        }
+    }
+
+    // Shareable part of a machine: states, transitions and dispatch index. Once built it's only read, so one definition
+    // can drive any number of machine_instance.
+    //
+    // States are copied in and given a state_id the first time they're seen. The objects passed in only identify them
+    // while transitions are added, and don't need to outlive the definition.
+    template <typename Event, typename Policy = default_policy>
+    class machine_definition
+    {
+    public:
+        static_assert(!std::is_same_v<Event, void>, "void-event typed machine are illegal");
+
+    public:
+        typedef Event event_type;
+        typedef Policy policy_type;
+        typedef machine_definition<event_type, policy_type> self_type;
+        typedef basic_state<typename policy_type::callables> state;
+        typedef transition<event_type, policy_type> transition_type;
+        typedef transition<details::completion_event, policy_type> completion_type;
+        typedef transition<details::timeout_event, policy_type> timeout_type;
+        typedef typename policy_type::allocator_type allocator_type;
+        typedef typename policy_type::observer observer_type;
+        typedef typename policy_type::payload payload_type;
+
+        typedef typename policy_type::template dispatch_table<event_type, typename std::allocator_traits<allocator_type>::template rebind_alloc<std::uint32_t>> dispatch_table;
+
+        static constexpr bool is_observed = !std::is_same_v<observer_type, null_observer> && details::is_enabled_observer<observer_type>::value;
+        static constexpr bool is_observing_callbacks = is_observed && details::observes_callbacks<observer_type>::value;
+        static constexpr bool is_timing_dispatch = is_observed && details::times_dispatch<observer_type>::value;
+        static constexpr bool is_finalizable = !std::is_same_v<dispatch_table, details::no_dispatch_table>;
+
+    private:
+        template <typename T>
+        using allocator_for = typename std::allocator_traits<allocator_type>::template rebind_alloc<T>;
+
+        typedef std::pair<event_type, state_id> key_type;
+
+        // Also compares keys holding a reference to anything ordered against event_type, typically a string_view
+        // looked up among string events, so that notify() doesn't have to build an event_type.
+        struct key_less
+        {
+            typedef void is_transparent;
+
+            template <typename A, typename B>
+            bool operator()(const A &a, const B &b) const
+            {
+                if (a.first < b.first) return true;
+                if (b.first < a.first) return false;
+                return a.second < b.second;
+            }
+        };
+
+    public:
+        typedef std::vector<transition_type, allocator_for<transition_type>> transitions;
+        typedef std::vector<completion_type, allocator_for<completion_type>> completions;
+        typedef std::vector<timeout_type, allocator_for<timeout_type>> timeouts;
+
+        // Completion transitions taken in a row by one notify() or start(), beyond which the machine is assumed to
+        // loop: it asserts, and stays where it is in release builds.
+        static constexpr std::size_t max_completion_chain = 1024;
+
+    public:
+        machine_definition() : machine_definition(allocator_type()) {}
+        explicit machine_definition(const allocator_type &alloc)
+            : is_finalized_(false), is_validated_(false), is_hierarchical_(false), initial_state_(machine_instance::no_state), revision_(0),
+              transitions_(alloc), sources_(alloc), targets_(alloc), kinds_(alloc), index_(alloc),
+              completions_(alloc), completion_sources_(alloc), completion_targets_(alloc), has_completion_(alloc),
+              timeouts_(alloc), timeout_sources_(alloc), timeout_targets_(alloc), has_timeout_(alloc), timers_(nullptr),
+              states_(alloc), region_initials_(alloc), parents_(alloc), initial_children_(alloc), slots_(alloc), paths_(alloc), state_indices_(alloc), table_(alloc),
+              deferrals_(alloc), deferral_table_(alloc), deferral_priorities_(alloc)
+        {
+        }
+        machine_definition(const machine_definition&) = default;
+        machine_definition(machine_definition&&) = default;
+        machine_definition& operator=(const machine_definition&) = default;
+        machine_definition& operator=(machine_definition&&) = default;
+        ~machine_definition() = default;
+
+        self_type& operator<<(const state &initial_state)
+        {
+            assert(initial_state_ == machine_instance::no_state && !is_finalized_);
+            initial_state_ = register_state(initial_state);
+            return *this;
+        }
+
+        template <typename TransitionEventType, typename TransitionPolicy>
+        self_type& operator<<(const transition<TransitionEventType, TransitionPolicy> &t)
+        {
+            static_assert(std::is_same_v<TransitionEventType, event_type>, "You can't add a transition with an event type different from the machine");
+            static_assert(std::is_same_v<typename TransitionPolicy::callables, typename policy_type::callables>, "You can't add a transition with callables different from the machine");
+            insert_transition(t);
+            return *this;
+        }
+
+        // Preferred form: the builder chain hands its temporary over, so guard and actions are never copied.
+        template <typename TransitionEventType, typename TransitionPolicy>
+        self_type& operator<<(transition<TransitionEventType, TransitionPolicy> &&t)
+        {
+            static_assert(std::is_same_v<TransitionEventType, event_type>, "You can't add a transition with an event type different from the machine");
+            static_assert(std::is_same_v<typename TransitionPolicy::callables, typename policy_type::callables>, "You can't add a transition with callables different from the machine");
+            insert_transition(std::move(t));
+            return *this;
+        }
+
+        template <typename TransitionPolicy>
+        self_type& operator<<(const transition<details::completion_event, TransitionPolicy> &t)
+        {
+            static_assert(std::is_same_v<typename TransitionPolicy::callables, typename policy_type::callables>, "You can't add a transition with callables different from the machine");
+            insert_completion(t);
+            return *this;
+        }
+
+        template <typename TransitionPolicy>
+        self_type& operator<<(transition<details::completion_event, TransitionPolicy> &&t)
+        {
+            static_assert(std::is_same_v<typename TransitionPolicy::callables, typename policy_type::callables>, "You can't add a transition with callables different from the machine");
+            insert_completion(std::move(t));
+            return *this;
+        }
+
+        template <typename TransitionPolicy>
+        self_type& operator<<(const transition<details::timeout_event, TransitionPolicy> &t)
+        {
+            static_assert(std::is_same_v<typename TransitionPolicy::callables, typename policy_type::callables>, "You can't add a transition with callables different from the machine");
+            insert_timeout(t);
+            return *this;
+        }
+
+        template <typename TransitionPolicy>
+        self_type& operator<<(transition<details::timeout_event, TransitionPolicy> &&t)
+        {
+            static_assert(std::is_same_v<typename TransitionPolicy::callables, typename policy_type::callables>, "You can't add a transition with callables different from the machine");
+            insert_timeout(std::move(t));
+            return *this;
+        }
+
+        template <std::size_t N>
+        self_type& operator<<(const details::nesting<typename policy_type::callables, N> &n)
+        {
+            assert(!is_finalized_);
+            const state_id parent = register_state(*n.parent);
+            assert(!has_timeout_[parent] && "Timers belong to innermost states, after() transitions can't leave a composite state");
+            for (const state *c : n.children)
+            {
+                const state_id child = register_state(*c);
+                assert(parents_[child] == machine_instance::no_state && "A state can only have one parent");
+                assert(child != parent && !is_ancestor(child, parent) && "States can't be nested in their own substates");
+                parents_[child] = parent;
+                if (initial_children_[parent] == machine_instance::no_state) initial_children_[parent] = child;
+            }
+            is_hierarchical_ = true;
+            return *this;
+        }
+
+        self_type& operator<<(const details::region_start<typename policy_type::callables> &r)
+        {
+            assert(!is_finalized_);
+            region_initials_.push_back(register_state(*r.initial));
+            return *this;
+        }
+
+        template <typename DeferredEventType>
+        self_type& operator<<(const details::deferral<typename policy_type::callables, DeferredEventType> &d)
+        {
+            static_assert(std::is_same_v<DeferredEventType, event_type>, "You can't defer an event of a type different from the machine");
+            static_assert(std::is_void_v<payload_type>, "Deferred events would have to copy their payload, deferral doesn't support payloads");
+            assert(!is_finalized_);
+            const key_type key(d.event, register_state(*d.state));
+            assert(deferrals_.find(key) == deferrals_.end() && "The state already defers this event");
+            deferrals_.emplace(key, d.priority_value);
+            return *this;
+        }
+
+        allocator_type get_allocator() const { return transitions_.get_allocator(); }
+
+        // Sizes the storage up front, so that building and finalizing a machine of that size takes one block per
+        // container instead of growing them transition by transition.
+        void reserve(std::size_t state_count, std::size_t transition_count)
+        {
+            states_.reserve(state_count);
+            parents_.reserve(state_count);
+            initial_children_.reserve(state_count);
+            transitions_.reserve(transition_count);
+            sources_.reserve(transition_count);
+            targets_.reserve(transition_count);
+        }
+
+        bool is_finalized() const { return is_finalized_; }
+        bool is_validated() const { return is_validated_; }
+        // Changes whenever finalize() or reorder() move transitions around, so that what was derived from
+        // direct_target() can tell it's stale.
+        std::uint32_t revision() const { return revision_; }
+        std::size_t state_count() const { return states_.size(); }
+        std::size_t transition_count() const { return transitions_.size(); }
+        std::size_t completion_count() const { return completions_.size(); }
+        std::size_t timeout_count() const { return timeouts_.size(); }
+        std::size_t deferral_count() const { return deferrals_.size(); }
+
+        // Wheel the timers of after() transitions are armed on, shared by all instances. It must outlive them, as
+        // must the definition, which timers refer to as well: a definition with armed timers mustn't move.
+        void set_timing_wheel(timing_wheel *wheel) { timers_ = wheel; }
+        timing_wheel* get_timing_wheel() const { return timers_; }
+
+        // Hands the timers armed from now on to route, given owner, instead of expiring them here; route passes them
+        // on to expire_timer(). Lets what holds an instance follow up on the changes timers make. Copies of the
+        // definition expire their own timers.
+        void route_timers(timing_wheel::expiry_func route, const void *owner)
+        {
+            route_.func = route;
+            route_.owner = owner;
+        }
+
+        // Expires the timer armed for instance with tag, as given to a route.
+        void expire_timer(machine_instance &instance, std::uint32_t tag) const
+        {
+            instance.timer = timing_wheel::no_timer;
+            expire(instance, tag);
+        }
+
+        // Gives a copy of an instance a timer of its own, as it holds the id of the original's, which it mustn't cancel.
+        // As for restored instances, the timers of its current state start over.
+        void rearm_copy(machine_instance &instance) const
+        {
+            instance.timer = timing_wheel::no_timer;
+            if (instance.is_running && instance.current_state != machine_instance::no_state) arm_first(instance, instance.current_state);
+        }
+
+        // Cancels the timer armed for instance, if any, before it's overwritten.
+        void disarm(machine_instance &instance) const
+        {
+            if (instance.timer == timing_wheel::no_timer) return;
+            timers_->cancel(instance.timer);
+            instance.timer = timing_wheel::no_timer;
+        }
+
+        // Id given to a state object added to this definition.
+        state_id id_of(const state &s) const
+        {
+            auto found = state_indices_.find(&s);
+            assert(found != state_indices_.end() && "This state isn't part of the definition");
+            return found->second;
+        }
+
+        state_id initial_state() const { return initial_state_; }
+        const state& state_at(state_id id) const { return states_[id]; }
+        state_id parent_of(state_id id) const { return parents_[id]; }
+
+        // Whether the instance is in that state or one of its substates.
+        bool is_in(const machine_instance &instance, state_id id) const
+        {
+            for (state_id s = instance.current_state; s != machine_instance::no_state; s = parents_[s])
+            {
+                if (s == id) return true;
+            }
+            return false;
+        }
+
+        // Stored transitions, in dispatch order once finalized. Their from() and to() are only available by id.
+        const transition_type& transition_at(std::size_t i) const { return transitions_[i]; }
+        state_id transition_source(std::size_t i) const { return sources_[i]; }
+        state_id transition_target(std::size_t i) const { return targets_[i]; }
+
+        observer_type& observer() const { return observer_; }
+
+        // Freezes the definition: transitions are regrouped by (state, event) in a contiguous array, indexed by a dense
+        // [state][event] table so that notify() becomes an index computation plus a scan over guards.
+        // With nested states, the cells of each innermost state also list the transitions it inherits, each along with
+        // the states it leaves and enters, so that dispatch never walks the hierarchy.
+        // No transition can be added afterwards.
+        void finalize()
+        {
+            static_assert(is_finalizable, "Only machines with integral or enum events can be finalized, unless they hash them with a hashed_dispatch_policy");
+            assert(!is_finalized_);
+
+            // (from state index, transition index), to be grouped by cell
+            std::vector<std::pair<std::size_t, std::size_t>> order;
+            order.reserve(transitions_.size());
+            std::vector<std::pair<std::size_t, event_type>> keys;
+            keys.reserve(transitions_.size());
+            for (std::size_t i = 0; i < transitions_.size(); ++i)
+            {
+                order.emplace_back(sources_[i], i);
+                keys.emplace_back(order.back().first, transitions_[i].get_event());
+            }
+
+            table_.build(states_.size(), keys);
+            // Stable so that transitions sharing a trigger and a priority keep their registration order.
+            std::stable_sort(order.begin(), order.end(), [this](const auto &a, const auto &b)
+            {
+                const auto cell_a = table_.cell(a.first, transitions_[a.second].get_event()),
+                           cell_b = table_.cell(b.first, transitions_[b.second].get_event());
+                if (cell_a != cell_b) return cell_a < cell_b;
+                return transitions_[a.second].get_priority() > transitions_[b.second].get_priority();
+            });
+
+            std::vector<std::size_t> permutation;
+            permutation.reserve(order.size());
+            for (auto &o : order) permutation.push_back(o.second);
+            permute(permutation);
+            index_.clear();
+
+            if (is_hierarchical_) build_slots();
+            if (!deferrals_.empty()) build_deferrals();
+            assert(regions_are_disjoint() && "A transition crosses orthogonal regions");
+
+            is_finalized_ = true;
+            if constexpr (is_observed) observer_.on_finalize(states_.size(), transitions_.size());
+        }
+
+        // Proves a finalized definition before it's trusted with notify_unchecked(): it has an initial state, and every
+        // state can be reached from it, or from the initial state of a region, by transitions, completions, timers and
+        // substates. Otherwise unreachable, if given, receives the first state that can't be, no_state if the initial
+        // one is missing. Transitions refer to states by id ever since they were added, so none can dangle.
+        bool validate(state_id *unreachable = nullptr)
+        {
+            assert(is_finalized_ && "Only a finalized definition is validated");
+            is_validated_ = false;
+            auto fail = [unreachable](state_id s)
+            {
+                if (unreachable != nullptr) *unreachable = s;
+                return false;
+            };
+            if (initial_state_ == machine_instance::no_state) return fail(machine_instance::no_state);
+
+            std::vector<std::vector<state_id>> targets(states_.size());
+            for (std::size_t i = 0; i < transitions_.size(); ++i) targets[sources_[i]].push_back(targets_[i]);
+            for (std::size_t i = 0; i < completions_.size(); ++i) targets[completion_sources_[i]].push_back(completion_targets_[i]);
+            for (std::size_t i = 0; i < timeouts_.size(); ++i) targets[timeout_sources_[i]].push_back(timeout_targets_[i]);
+
+            // A state reached makes its parent current as well, whose transitions then apply; entering a state also
+            // enters its initial substates.
+            std::vector<bool> reached(states_.size(), false);
+            std::vector<state_id> pending;
+            auto reach = [&](state_id s)
+            {
+                if (reached[s]) return;
+                reached[s] = true;
+                pending.push_back(s);
+            };
+            auto enter = [&](state_id s)
+            {
+                for (; s != machine_instance::no_state; s = initial_children_[s]) reach(s);
+            };
+
+            enter(initial_state_);
+            for (state_id r : region_initials_) enter(r);
+            while (!pending.empty())
+            {
+                const state_id s = pending.back();
+                pending.pop_back();
+                for (state_id t : targets[s]) enter(t);
+                if (parents_[s] != machine_instance::no_state) reach(parents_[s]);
+            }
+
+            for (state_id s = 0; s < states_.size(); ++s)
+            {
+                if (!reached[s]) return fail(s);
+            }
+            is_validated_ = true;
+            return true;
+        }
+
+        // Profile-guided ordering of a finalized flat definition: among transitions sharing a trigger and a priority,
+        // those with the highest weight(transition) have their guard checked first, e.g. the fired counts of a
+        // stats_observer. That only keeps the behavior if their guards are mutually exclusive, as the first guard
+        // accepting the event wins. Transition positions change, as when finalizing, and the observer is told how.
+        template <typename Weight>
+        void reorder(Weight weight)
+        {
+            assert(is_finalized_ && !is_hierarchical_);
+
+            std::vector<std::size_t> permutation(transitions_.size());
+            for (std::size_t i = 0; i < permutation.size(); ++i) permutation[i] = i;
+            for (std::size_t first = 0; first != permutation.size(); )
+            {
+                std::size_t last = first + 1;
+                while (last != permutation.size() && sources_[last] == sources_[first] && transitions_[last].get_event() == transitions_[first].get_event()
+                       && transitions_[last].get_priority() == transitions_[first].get_priority()) ++last;
+                std::stable_sort(permutation.begin() + first, permutation.begin() + last,
+                    [&weight](std::size_t a, std::size_t b) { return weight(b) < weight(a); });
+                first = last;
+            }
+            permute(permutation);
+            if constexpr (is_observed) observer_.on_reorder(permutation.data(), permutation.size());
+        }
+
+        // With a payload_policy, start(), stop() and notify() take the payload their callbacks are given.
+        template <typename... Payload>
+        void start(machine_instance &instance, const Payload&... payload) const
+        {
+            static_assert(details::is_payload_v<payload_type, Payload...>, "Give the payload of the policy, as is, or nothing if it has none");
+            assert(region_initials_.empty() && "Machines with orthogonal regions are started with their configuration");
+            start_at(instance, initial_state_, payload...);
+        }
+
+        template <typename... Payload>
+        void stop(machine_instance &instance, const Payload&... payload) const
+        {
+            static_assert(details::is_payload_v<payload_type, Payload...>, "Give the payload of the policy, as is, or nothing if it has none");
+            // Stopped instances are told apart by their state, so that notify() ignores them.
+            leave_up_to(instance, machine_instance::no_state, payload...);
+            instance.is_running = false;
+        }
+
+        // Checkpoints. An instance is written as a fixed snapshot_size header: its current state id (little-endian, 32
+        // bits), a flags byte (bit 0: running), the format version, then the size of the user blob that follows it
+        // (little-endian, 16 bits). Nothing is allocated, the context pointer isn't saved, and restoring doesn't call
+        // any callback: the instance is just back in the state it was in, whose after() timers start over.
+        static constexpr std::size_t snapshot_size = 8;
+        static constexpr std::uint8_t snapshot_version = 1;
+
+        // Returns the number of bytes written, 0 if they don't fit in size.
+        std::size_t snapshot(const machine_instance &instance, void *buffer, std::size_t size, const void *blob = nullptr, std::size_t blob_size = 0) const
+        {
+            assert(blob_size <= std::numeric_limits<std::uint16_t>::max());
+            if (size < snapshot_size + blob_size) return 0;
+
+            unsigned char *out = static_cast<unsigned char*>(buffer);
+            details::store_le32(out, instance.current_state);
+            out[4] = instance.is_running ? 1 : 0;
+            out[5] = snapshot_version;
+            details::store_le16(out + 6, static_cast<std::uint16_t>(blob_size));
+            if (blob_size != 0) std::memcpy(out + snapshot_size, blob, blob_size);
+            return snapshot_size + blob_size;
+        }
+
+        // Returns the number of bytes read, 0 if the snapshot is truncated, from another format, refers to a state this
+        // definition doesn't have, to a state while stopped, or carries a blob larger than blob_capacity. The instance is
+        // left as is then.
+        std::size_t restore(machine_instance &instance, const void *buffer, std::size_t size, void *blob = nullptr, std::size_t blob_capacity = 0) const
+        {
+            assert(blob != nullptr || blob_capacity == 0);
+            const std::size_t blob_size = restore_header(instance, buffer, size, blob_capacity);
+            if (blob_size == no_snapshot) return 0;
+            if (blob_size != 0 && blob != nullptr) std::memcpy(blob, static_cast<const unsigned char*>(buffer) + snapshot_size, blob_size);
+            return snapshot_size + blob_size;
+        }
+
+        // Bulk forms writing consecutive headers without blobs, for arrays of instances. They return how many instances
+        // were written or restored, stopping at the first that doesn't fit or isn't valid.
+        std::size_t snapshot_all(const machine_instance *instances, std::size_t count, void *buffer, std::size_t size) const
+        {
+            count = std::min(count, size / snapshot_size);
+            unsigned char *out = static_cast<unsigned char*>(buffer);
+            for (std::size_t i = 0; i < count; ++i) snapshot(instances[i], out + i * snapshot_size, snapshot_size);
+            return count;
+        }
+
+        std::size_t restore_all(machine_instance *instances, std::size_t count, const void *buffer, std::size_t size) const
+        {
+            count = std::min(count, size / snapshot_size);
+            const unsigned char *in = static_cast<const unsigned char*>(buffer);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                if (restore_header(instances[i], in + i * snapshot_size, snapshot_size, 0) == no_snapshot) return i;
+            }
+            return count;
+        }
+
+        // Events that aren't integral or enums can be notified as any key ordered against event_type, e.g. a
+        // std::string_view or a literal for std::string events, and are then looked up without being converted.
+        // Returns whether a transition was taken.
+        template <typename Key, typename... Payload>
+        bool notify(machine_instance &instance, const Key &event, const Payload&... payload) const
+        {
+            static_assert(details::is_payload_v<payload_type, Payload...>, "Give the payload of the policy, as is, or nothing if it has none");
+            if (instance.current_state == machine_instance::no_state) return false;
+            return dispatch(instance, event, payload...);
+        }
+
+        // Whether an instance in state s keeps event when no transition takes it, as s or one of its ancestors defers
+        // it; priority then receives that of the innermost deferral. Once finalized, a lookup in a table of the
+        // dispatch policy, as for transitions. The definition only answers, machines keep the events.
+        template <typename Key>
+        bool defers(state_id s, const Key &event, int *priority = nullptr) const
+        {
+            if (deferrals_.empty()) return false;
+            if constexpr (details::is_dense_event_v<event_type> && !std::is_same_v<Key, event_type>)
+            {
+                const event_type e = event;
+                return defers(s, e, priority);
+            }
+            else
+            {
+                if constexpr (is_finalizable)
+                {
+                    if (is_finalized_)
+                    {
+                        const auto found = deferral_table_.find(s, event);
+                        if (found.first == found.second) return false;
+                        if (priority != nullptr) *priority = deferral_priorities_[found.first];
+                        return true;
+                    }
+                }
+                for (; s != machine_instance::no_state; s = parents_[s])
+                {
+                    auto found = deferrals_.find(std::pair<const Key&, state_id>(event, s));
+                    if (found == deferrals_.end()) continue;
+                    if (priority != nullptr) *priority = found->second;
+                    return true;
+                }
+                return false;
+            }
+        }
+
+        // Hot path for a validated definition: no check that the instance runs nor branch on whether the definition is
+        // finalized, only the lookup and the candidates. Both are asserted in debug builds instead; notifying a stopped
+        // instance this way is undefined.
+        template <typename Key, typename... Payload>
+        void notify_unchecked(machine_instance &instance, const Key &event, const Payload&... payload) const
+        {
+            static_assert(is_finalizable, "notify_unchecked() dispatches through the finalized table");
+            static_assert(details::is_payload_v<payload_type, Payload...>, "Give the payload of the policy, as is, or nothing if it has none");
+            assert(is_validated_ && "notify_unchecked() needs a definition that passed validate()");
+            assert(instance.is_running && instance.current_state != machine_instance::no_state && "notify_unchecked() needs a started instance");
+            if constexpr (details::is_dense_event_v<event_type> && !std::is_same_v<Key, event_type>)
+            {
+                const event_type e = event;
+                dispatch_finalized(instance, e, payload...);
+            }
+            else
+            {
+                dispatch_finalized(instance, event, payload...);
+            }
+        }
+
+        // What notify() would do to an instance of a finalized flat definition in state s: no_state if nothing fires,
+        // the target if the transition taken only switches the current state, or dispatch_needed if a guard, a
+        // callback, a completion or the observer has to run. Lets batches of instances be moved without dispatching.
+        static constexpr state_id dispatch_needed = machine_instance::no_state - 1;
+
+        state_id direct_target(state_id s, const event_type &event) const
+        {
+            static_assert(is_finalizable, "Only finalized definitions resolve transitions ahead of time");
+            assert(is_finalized_ && s < states_.size());
+            if (is_observed || is_hierarchical_) return dispatch_needed;
+            const auto candidates = table_.find(s, event);
+            if (candidates.first == candidates.second) return machine_instance::no_state;
+            const std::size_t i = candidates.first;
+            return kinds_[i] == direct && !has_completion_[targets_[i]] ? targets_[i] : dispatch_needed;
+        }
+
+        // Dispatches a batch of events to one instance; checks that don't depend on the event are done once.
+        template <typename InputIt>
+        void notify_all(machine_instance &instance, InputIt first, InputIt last) const
+        {
+            static_assert(std::is_void_v<payload_type>, "Batches carry no payload, notify events one by one");
+            // A callback may stop the instance partway through.
+            if constexpr (is_finalizable)
+            {
+                if (is_finalized_)
+                {
+                    for (; first != last && instance.current_state != machine_instance::no_state; ++first) dispatch_finalized(instance, *first);
+                    return;
+                }
+            }
+            for (; first != last && instance.current_state != machine_instance::no_state; ++first) dispatch_indexed(instance, *first);
+        }
+
+        // Dispatches a batch of (machine_instance*, event) pairs, all driven by this definition.
+        template <typename InputIt>
+        void notify_each(InputIt first, InputIt last) const
+        {
+            static_assert(std::is_void_v<payload_type>, "Batches carry no payload, notify events one by one");
+            if constexpr (is_finalizable)
+            {
+                if (is_finalized_)
+                {
+                    for (; first != last; ++first)
+                    {
+                        if (first->first->current_state != machine_instance::no_state) dispatch_finalized(*first->first, first->second);
+                    }
+                    return;
+                }
+            }
+            for (; first != last; ++first)
+            {
+                if (first->first->current_state != machine_instance::no_state) dispatch_indexed(*first->first, first->second);
+            }
+        }
+
+#if defined(__cpp_lib_span)
+        void notify_all(machine_instance &instance, std::span<const event_type> events) const { notify_all(instance, events.begin(), events.end()); }
+        void notify_each(std::span<const std::pair<machine_instance*, event_type>> events) const { notify_each(events.begin(), events.end()); }
+#endif
+
+        // Orthogonal regions. Their configuration is an array of region_count() state ids, one per region in the order
+        // they were added, the first one being the region of the initial state; the instance keeps the running flag
+        // and context, and mirrors the first region in current_state.
+
+        std::size_t region_count() const { return 1 + region_initials_.size(); }
+
+        template <typename... Payload>
+        void start(machine_instance &instance, state_id *active, std::size_t count, const Payload&... payload) const
+        {
+            static_assert(details::is_payload_v<payload_type, Payload...>, "Give the payload of the policy, as is, or nothing if it has none");
+            assert(count == region_count());
+            assert(timeouts_.empty() && "An instance holds a single timer, after() transitions aren't supported with orthogonal regions");
+            for (std::size_t r = 0; r < count; ++r)
+            {
+                start_at(instance, r == 0 ? initial_state_ : region_initials_[r - 1], payload...);
+                active[r] = instance.current_state;
+            }
+            instance.current_state = active[0];
+        }
+
+        template <typename... Payload>
+        void stop(machine_instance &instance, state_id *active, std::size_t count, const Payload&... payload) const
+        {
+            static_assert(details::is_payload_v<payload_type, Payload...>, "Give the payload of the policy, as is, or nothing if it has none");
+            for (std::size_t r = 0; r < count; ++r)
+            {
+                instance.current_state = active[r];
+                stop(instance, payload...);
+                active[r] = machine_instance::no_state;
+            }
+        }
+
+        // Gives the event to every region, in one pass over the configuration.
+        template <typename Key, typename... Payload>
+        void notify(machine_instance &instance, state_id *active, std::size_t count, const Key &event, const Payload&... payload) const
+        {
+            static_assert(details::is_payload_v<payload_type, Payload...>, "Give the payload of the policy, as is, or nothing if it has none");
+            for (std::size_t r = 0; r < count; ++r)
+            {
+                if (active[r] == machine_instance::no_state) continue;
+                instance.current_state = active[r];
+                dispatch(instance, event, payload...);
+                active[r] = instance.current_state;
+            }
+            instance.current_state = active[0];
+        }
+
+        bool is_in(const state_id *active, std::size_t count, state_id id) const
+        {
+            machine_instance region;
+            for (std::size_t r = 0; r < count; ++r)
+            {
+                region.current_state = active[r];
+                if (is_in(region, id)) return true;
+            }
+            return false;
+        }
+
+    private:
+        typedef typename observer_type::time_point time_point;
+
+        template <typename... Payload>
+        void start_at(machine_instance &instance, state_id initial, const Payload&... payload) const
+        {
+            assert(initial != machine_instance::no_state);
+            // Restarted while running: the timer of the state it was in would still fire otherwise.
+            disarm(instance);
+            instance.is_running = true;
+            enter_from(instance, machine_instance::no_state, initial, payload...);
+            complete(instance, payload...);
+        }
+
+        // Debug check: floods regions from their initial states through transitions and nesting, no state may be
+        // reached from two of them.
+        bool regions_are_disjoint() const
+        {
+            if (region_initials_.empty()) return true;
+
+            std::vector<std::size_t> region_of(states_.size(), region_initials_.size() + 1);
+            region_of[initial_state_] = 0;
+            for (std::size_t r = 0; r < region_initials_.size(); ++r)
+            {
+                if (region_of[region_initials_[r]] != region_initials_.size() + 1) return false;
+                region_of[region_initials_[r]] = r + 1;
+            }
+
+            const std::size_t unknown = region_initials_.size() + 1;
+            auto link = [&](state_id a, state_id b, bool &changed)
+            {
+                if (region_of[a] == region_of[b]) return true;
+                if (region_of[a] != unknown && region_of[b] != unknown) return false;
+                region_of[a] = region_of[b] = std::min(region_of[a], region_of[b]);
+                changed = true;
+                return true;
+            };
+
+            for (bool changed = true; changed; )
+            {
+                changed = false;
+                for (std::size_t i = 0; i < transitions_.size(); ++i)
+                {
+                    if (!link(sources_[i], targets_[i], changed)) return false;
+                }
+                for (std::size_t i = 0; i < completions_.size(); ++i)
+                {
+                    if (!link(completion_sources_[i], completion_targets_[i], changed)) return false;
+                }
+                for (std::size_t i = 0; i < timeouts_.size(); ++i)
+                {
+                    if (!link(timeout_sources_[i], timeout_targets_[i], changed)) return false;
+                }
+                for (state_id s = 0; s < states_.size(); ++s)
+                {
+                    if (parents_[s] != machine_instance::no_state && !link(s, parents_[s], changed)) return false;
+                }
+            }
+            return true;
+        }
+
+        template <typename Key, typename... Payload>
+        bool dispatch(machine_instance &instance, const Key &event, const Payload&... payload) const
+        {
+            if constexpr (details::is_dense_event_v<event_type> && !std::is_same_v<Key, event_type>)
+            {
+                const event_type e = event;
+                return dispatch(instance, e, payload...);
+            }
+            else
+            {
+                if constexpr (is_finalizable)
+                {
+                    if (is_finalized_) return dispatch_finalized(instance, event, payload...);
+                }
+                return dispatch_indexed(instance, event, payload...);
+            }
+        }
+
+        template <typename Key, typename... Payload>
+        bool dispatch_finalized(machine_instance &instance, const Key &event, const Payload&... payload) const
+        {
+            const time_point begin = begin_dispatch(instance, event);
+            std::size_t fired = null_observer::no_transition;
+
+            const auto candidates = table_.find(instance.current_state, event);
+            if (!is_hierarchical_)
+            {
+                for (auto i = candidates.first; i != candidates.second; ++i)
+                {
+                    if (kinds_[i] == direct)
+                    {
+                        instance.current_state = targets_[i];
+                        fired = i;
+                        break;
+                    }
+                    if (kinds_[i] == unguarded)
+                    {
+                        if constexpr (is_observed) observer_.on_guard(instance, i, true);
+                        fire(instance, i, payload...);
+                        fired = i;
+                        break;
+                    }
+                    if (fire_if_allowed(instance, i, payload...))
+                    {
+                        fired = i;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                for (auto i = candidates.first; i != candidates.second; ++i)
+                {
+                    if (fire_slot(instance, slots_[i], payload...))
+                    {
+                        fired = slots_[i].transition;
+                        break;
+                    }
+                }
+            }
+
+            if (fired != null_observer::no_transition) complete(instance, payload...);
+            end_dispatch(instance, event, candidates.first != candidates.second, fired, begin);
+            return fired != null_observer::no_transition;
+        }
+
+        template <typename Key, typename... Payload>
+        bool dispatch_indexed(machine_instance &instance, const Key &event, const Payload&... payload) const
+        {
+            const time_point begin = begin_dispatch(instance, event);
+            std::size_t fired = null_observer::no_transition;
+
+            bool matched = false;
+
+            // Up the hierarchy, until some state handles the event.
+            for (state_id s = instance.current_state; s != machine_instance::no_state && fired == null_observer::no_transition; s = parents_[s])
+            {
+                auto range = index_.equal_range(std::pair<const Key&, state_id>(event, s));
+                matched = matched || range.first != range.second;
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    if (fire_if_allowed(instance, it->second, payload...))
+                    {
+                        fired = it->second;
+                        break;
+                    }
+                }
+            }
+
+            if (fired != null_observer::no_transition) complete(instance, payload...);
+            end_dispatch(instance, event, matched, fired, begin);
+            return fired != null_observer::no_transition;
+        }
+
+        template <typename Key>
+        time_point begin_dispatch(const machine_instance &instance, const Key &event) const
+        {
+            if constexpr (!is_observed) return time_point();
+            else
+            {
+                time_point now;
+                if constexpr (is_timing_dispatch) now = observer_type::clock::now();
+                observer_.on_dispatch_begin(instance, event, now);
+                return now;
+            }
+        }
+
+        template <typename Key>
+        void end_dispatch(const machine_instance &instance, const Key &event, bool matched, std::size_t fired, time_point begin) const
+        {
+            if constexpr (is_observed)
+            {
+                const time_point now = observer_type::clock::now();
+                if (!matched) observer_.on_unmatched(instance, event, now);
+                observer_.on_dispatch_end(instance, event, fired, begin, now);
+            }
+        }
+
+        template <typename... Payload>
+        void enter_state(machine_instance &instance, state_id id, const Payload&... payload) const
+        {
+            if constexpr (!is_observing_callbacks) states_[id].enter(payload...);
+            else
+            {
+                const time_point begin = observer_type::clock::now();
+                states_[id].enter(payload...);
+                observer_.on_enter(instance, id, begin, observer_type::clock::now());
+            }
+            // Timers belong to the state becoming current, which is entered last.
+            if (id == instance.current_state) arm_first(instance, id);
+        }
+
+        void arm_first(machine_instance &instance, state_id s) const
+        {
+            if constexpr (std::is_void_v<payload_type>)
+            {
+                if (!timeouts_.empty() && has_timeout_[s])
+                {
+                    const std::size_t first = first_timeout(s);
+                    arm(instance, first, timeouts_[first].get_event().delay);
+                }
+            }
+        }
+
+        template <typename... Payload>
+        void leave_state(machine_instance &instance, state_id id, const Payload&... payload) const
+        {
+            if (instance.timer != timing_wheel::no_timer)
+            {
+                timers_->cancel(instance.timer);
+                instance.timer = timing_wheel::no_timer;
+            }
+            if constexpr (!is_observing_callbacks) states_[id].leave(payload...);
+            else
+            {
+                const time_point begin = observer_type::clock::now();
+                states_[id].leave(payload...);
+                observer_.on_leave(instance, id, begin, observer_type::clock::now());
+            }
+        }
+
+        template <typename... Payload>
+        void invoke_actions(const machine_instance &instance, std::size_t i, const Payload&... payload) const
+        {
+            if constexpr (!is_observing_callbacks) transitions_[i].invoke_actions(payload...);
+            else
+            {
+                const time_point begin = observer_type::clock::now();
+                transitions_[i].invoke_actions(payload...);
+                observer_.on_actions(instance, i, begin, observer_type::clock::now());
+            }
+        }
+
+        // Moves transition permutation[i] to position i, along with its source and target, then tags the candidates.
+        void permute(const std::vector<std::size_t> &permutation)
+        {
+            transitions grouped(transitions_.get_allocator());
+            grouped.reserve(permutation.size());
+            ids grouped_sources(sources_.get_allocator()),
+                grouped_targets(targets_.get_allocator());
+            grouped_sources.reserve(permutation.size());
+            grouped_targets.reserve(permutation.size());
+            for (std::size_t i : permutation)
+            {
+                grouped_sources.push_back(sources_[i]);
+                grouped_targets.push_back(targets_[i]);
+                grouped.push_back(std::move(transitions_[i]));
+            }
+            transitions_.swap(grouped);
+            sources_.swap(grouped_sources);
+            targets_.swap(grouped_targets);
+            revision_++;
+
+            kinds_.assign(transitions_.size(), guarded);
+            for (std::size_t i = 0; i < transitions_.size(); ++i)
+            {
+                const transition_type &t = transitions_[i];
+                if (t.has_guard()) continue;
+                const bool has_callbacks = t.has_actions() || states_[sources_[i]].has_on_leave() || states_[targets_[i]].has_on_enter()
+                                           || has_timeout_[sources_[i]] || has_timeout_[targets_[i]];
+                kinds_[i] = has_callbacks || is_observing_callbacks ? unguarded : direct;
+            }
+        }
+
+        state_id register_state(const state &s)
+        {
+            assert(states_.size() < machine_instance::no_state);
+            auto inserted = state_indices_.emplace(&s, static_cast<state_id>(states_.size()));
+            if (inserted.second)
+            {
+                states_.push_back(s);
+                parents_.push_back(machine_instance::no_state);
+                initial_children_.push_back(machine_instance::no_state);
+                has_completion_.push_back(false);
+                has_timeout_.push_back(false);
+            }
+            return inserted.first->second;
+        }
+
+        template <typename Transition>
+        void insert_transition(Transition &&t)
+        {
+            assert(!is_finalized_);
+            const state_id from = register_state(t.from());
+            sources_.push_back(from);
+            targets_.push_back(register_state(t.to()));
+            // Before the first candidate of lower priority, so that the index lists them in dispatch order too.
+            const std::pair<const event_type&, state_id> key(t.get_event(), from);
+            auto position = index_.upper_bound(key);
+            for (auto it = index_.lower_bound(key); it != position; ++it)
+            {
+                if (transitions_[it->second].get_priority() < t.get_priority())
+                {
+                    position = it;
+                    break;
+                }
+            }
+            index_.emplace_hint(position, key_type(t.get_event(), from), transitions_.size());
+            transitions_.emplace_back(std::forward<Transition>(t));
+            // Nothing is kept pointing to the states the transition was built from.
+            transitions_.back().from_ = nullptr;
+            transitions_.back().to_ = nullptr;
+        }
+
+        // Kept sorted by source then by decreasing priority, so that the completions of a state are contiguous.
+        template <typename Transition>
+        void insert_completion(Transition &&t)
+        {
+            assert(!is_finalized_);
+            const state_id from = register_state(t.from()),
+                           to = register_state(t.to());
+            std::size_t position = 0;
+            while (position != completions_.size() && (completion_sources_[position] < from
+                   || (completion_sources_[position] == from && completions_[position].get_priority() >= t.get_priority()))) ++position;
+
+            completion_sources_.insert(completion_sources_.begin() + position, from);
+            completion_targets_.insert(completion_targets_.begin() + position, to);
+            auto stored = completions_.emplace(completions_.begin() + position, std::forward<Transition>(t));
+            stored->from_ = nullptr;
+            stored->to_ = nullptr;
+            has_completion_[from] = true;
+        }
+
+        // Takes completion transitions until the current state has none accepting. Iterative, callbacks don't reenter
+        // the dispatch, and states without completions only cost a flag test.
+        template <typename... Payload>
+        void complete(machine_instance &instance, const Payload&... payload) const
+        {
+            if (completions_.empty()) return;
+            for (std::size_t chain = 0; ; ++chain)
+            {
+                // Innermost first, then those of the enclosing states.
+                std::size_t taken = completions_.size();
+                for (state_id s = instance.current_state; s != machine_instance::no_state && taken == completions_.size(); s = parents_[s])
+                {
+                    if (!has_completion_[s]) continue;
+                    const auto range = std::equal_range(completion_sources_.begin(), completion_sources_.end(), s);
+                    for (auto it = range.first; it != range.second; ++it)
+                    {
+                        const std::size_t i = static_cast<std::size_t>(it - completion_sources_.begin());
+                        if (completions_[i].check_guard(payload...))
+                        {
+                            taken = i;
+                            break;
+                        }
+                    }
+                }
+                if (taken == completions_.size()) return;
+                if (chain == max_completion_chain)
+                {
+                    assert(!"Completion transitions keep firing, they probably loop");
+                    return;
+                }
+
+                take(instance, completions_[taken], completion_sources_[taken], completion_targets_[taken], payload...);
+            }
+        }
+
+        static constexpr std::size_t no_snapshot = std::numeric_limits<std::size_t>::max();
+
+        // Restores instance from the header of a snapshot and returns the size of the blob following it, or
+        // no_snapshot if restore() has to fail, the instance being left as is.
+        std::size_t restore_header(machine_instance &instance, const void *buffer, std::size_t size, std::size_t blob_capacity) const
+        {
+            if (size < snapshot_size) return no_snapshot;
+
+            const unsigned char *in = static_cast<const unsigned char*>(buffer);
+            const state_id current = details::load_le32(in);
+            const bool running = (in[4] & 1) != 0;
+            const std::size_t blob_size = details::load_le16(in + 6);
+            if (in[5] != snapshot_version || size < snapshot_size + blob_size || blob_size > blob_capacity) return no_snapshot;
+            // Running instances are in a state, stopped ones in none, which is how notify() tells them apart.
+            if (running != (current != machine_instance::no_state) || (running && current >= states_.size())) return no_snapshot;
+
+            // Timers aren't part of a snapshot: those of the restored state start over, as on its entry.
+            if (instance.timer != timing_wheel::no_timer)
+            {
+                timers_->cancel(instance.timer);
+                instance.timer = timing_wheel::no_timer;
+            }
+            instance.current_state = current;
+            instance.is_running = running;
+            if (running) arm_first(instance, current);
+            return blob_size;
+        }
+
+        // Fires a completion or timed transition. Observers see the states left and entered, these transitions' guards
+        // and actions aren't reported.
+        template <typename Transition, typename... Payload>
+        void take(machine_instance &instance, const Transition &t, state_id from, state_id to, const Payload&... payload) const
+        {
+            const state_id lca = is_hierarchical_ ? common_ancestor(from, to) : machine_instance::no_state;
+            leave_up_to(instance, lca, payload...);
+            if (!instance.is_running) return;
+            t.invoke_actions(payload...);
+            if (!instance.is_running) return;
+            enter_from(instance, lca, to, payload...);
+        }
+
+        // Kept sorted by source then by delay: only the first timer of a state is armed, the next one taking over when
+        // its guard refuses.
+        template <typename Transition>
+        void insert_timeout(Transition &&t)
+        {
+            static_assert(std::is_void_v<payload_type>, "Timers carry no payload, after() transitions need a policy without one");
+            assert(!is_finalized_);
+            const state_id from = register_state(t.from()),
+                           to = register_state(t.to());
+            assert(initial_children_[from] == machine_instance::no_state && "Timers belong to innermost states, after() transitions can't leave a composite state");
+            std::size_t position = 0;
+            while (position != timeouts_.size() && (timeout_sources_[position] < from
+                   || (timeout_sources_[position] == from && timeouts_[position].get_event().delay <= t.get_event().delay))) ++position;
+
+            timeout_sources_.insert(timeout_sources_.begin() + position, from);
+            timeout_targets_.insert(timeout_targets_.begin() + position, to);
+            auto stored = timeouts_.emplace(timeouts_.begin() + position, std::forward<Transition>(t));
+            stored->from_ = nullptr;
+            stored->to_ = nullptr;
+            has_timeout_[from] = true;
+        }
+
+        std::size_t first_timeout(state_id s) const
+        {
+            return static_cast<std::size_t>(std::lower_bound(timeout_sources_.begin(), timeout_sources_.end(), s) - timeout_sources_.begin());
+        }
+
+        void arm(machine_instance &instance, std::size_t i, timing_wheel::duration delay) const
+        {
+            assert(timers_ != nullptr && "Definitions with after() transitions need a timing_wheel");
+            if (route_.func != nullptr) instance.timer = timers_->schedule(delay, route_.func, &instance, route_.owner, static_cast<std::uint32_t>(i));
+            else                        instance.timer = timers_->schedule(delay, &on_timer, &instance, this, static_cast<std::uint32_t>(i));
+        }
+
+        static void on_timer(void *target, const void *owner, std::uint32_t i)
+        {
+            static_cast<const self_type*>(owner)->expire_timer(*static_cast<machine_instance*>(target), i);
+        }
+
+        // Timeout i is due: taken if its guard accepts, otherwise the next one of the state is armed for the rest of
+        // its delay.
+        void expire(machine_instance &instance, std::size_t i) const
+        {
+            assert(instance.current_state == timeout_sources_[i]);
+            if (timeouts_[i].check_guard())
+            {
+                take(instance, timeouts_[i], timeout_sources_[i], timeout_targets_[i]);
+                complete(instance);
+                return;
+            }
+            if (i + 1 != timeouts_.size() && timeout_sources_[i + 1] == timeout_sources_[i])
+            {
+                arm(instance, i + 1, timeouts_[i + 1].get_event().delay - timeouts_[i].get_event().delay);
+            }
+        }
+
+        template <typename... Payload>
+        bool fire_if_allowed(machine_instance &instance, std::size_t i, const Payload&... payload) const
+        {
+            const bool accepted = transitions_[i].check_guard(payload...);
+            if constexpr (is_observed) observer_.on_guard(instance, i, accepted);
+            if (!accepted) return false;
+
+            fire(instance, i, payload...);
+            return true;
+        }
+
+        template <typename... Payload>
+        void fire(machine_instance &instance, std::size_t i, const Payload&... payload) const
+        {
+            // Not finalized yet if hierarchical: the path is worked out on the fly.
+            const state_id lca = is_hierarchical_ ? common_ancestor(sources_[i], targets_[i]) : machine_instance::no_state;
+            leave_up_to(instance, lca, payload...);
+            if (!instance.is_running) return;
+            invoke_actions(instance, i, payload...);
+            if (!instance.is_running) return;
+            enter_from(instance, lca, targets_[i], payload...);
+        }
+
+        // Hierarchy
+
+        // A transition of a finalized hierarchical definition, as seen from one innermost state: it leaves
+        // path_[path_begin, exit_end) then enters path_[exit_end, path_end), the last one becoming current.
+        struct slot
+        {
+            std::uint32_t transition, path_begin, exit_end, path_end;
+        };
+
+        template <typename... Payload>
+        bool fire_slot(machine_instance &instance, const slot &sl, const Payload&... payload) const
+        {
+            const bool accepted = transitions_[sl.transition].check_guard(payload...);
+            if constexpr (is_observed) observer_.on_guard(instance, sl.transition, accepted);
+            if (!accepted) return false;
+
+            for (auto p = sl.path_begin; p != sl.exit_end && instance.is_running; ++p)
+            {
+                instance.current_state = parents_[paths_[p]];
+                leave_state(instance, paths_[p], payload...);
+            }
+            if (instance.is_running) invoke_actions(instance, sl.transition, payload...);
+            for (auto p = sl.exit_end; p != sl.path_end && instance.is_running; ++p)
+            {
+                instance.current_state = paths_[p];
+                enter_state(instance, paths_[p], payload...);
+            }
+            return true;
+        }
+
+        bool is_ancestor(state_id ancestor, state_id s) const
+        {
+            for (s = parents_[s]; s != machine_instance::no_state; s = parents_[s])
+            {
+                if (s == ancestor) return true;
+            }
+            return false;
+        }
+
+        // Innermost state strictly containing both, no_state for the top level. A transition leaves everything below it
+        // on the source side, and enters everything below it on the target side, so self and parent transitions are
+        // external: the states they start from are left and entered again.
+        state_id common_ancestor(state_id from, state_id to) const
+        {
+            state_id a = parents_[from];
+            while (a != machine_instance::no_state && !is_ancestor(a, to)) a = parents_[a];
+            return a;
+        }
+
+        template <typename... Payload>
+        void enter_from(machine_instance &instance, state_id ancestor, state_id to, const Payload&... payload) const
+        {
+            if (!is_hierarchical_)
+            {
+                instance.current_state = to;
+                enter_state(instance, to, payload...);
+                return;
+            }
+            enter_down(instance, ancestor, to, payload...);
+            for (state_id s = to; initial_children_[s] != machine_instance::no_state && instance.is_running; )
+            {
+                s = initial_children_[s];
+                instance.current_state = s;
+                enter_state(instance, s, payload...);
+            }
+        }
+
+        template <typename... Payload>
+        void enter_down(machine_instance &instance, state_id ancestor, state_id to, const Payload&... payload) const
+        {
+            if (parents_[to] != ancestor) enter_down(instance, ancestor, parents_[to], payload...);
+            if (!instance.is_running) return;
+            instance.current_state = to;
+            enter_state(instance, to, payload...);
+        }
+
+        // Leaves the active states below ancestor, innermost first. The current state follows them, so that a stop()
+        // from one of their callbacks only leaves those still active, and the transition stops there.
+        template <typename... Payload>
+        void leave_up_to(machine_instance &instance, state_id ancestor, const Payload&... payload) const
+        {
+            if (!is_hierarchical_)
+            {
+                const state_id s = instance.current_state;
+                instance.current_state = machine_instance::no_state;
+                if (s != machine_instance::no_state) leave_state(instance, s, payload...);
+                return;
+            }
+            while (instance.current_state != ancestor && instance.current_state != machine_instance::no_state)
+            {
+                const state_id s = instance.current_state;
+                instance.current_state = parents_[s];
+                leave_state(instance, s, payload...);
+            }
+        }
+
+        void append_entered(state_id ancestor, state_id to)
+        {
+            if (parents_[to] != ancestor) append_entered(ancestor, parents_[to]);
+            paths_.push_back(to);
+        }
+
+        void build_slots()
+        {
+            slots_.clear();
+            paths_.clear();
+
+            // Transitions of each state, in cell order. Only the dense table numbers cells by state, so sources_ may
+            // not be sorted.
+            std::vector<std::vector<std::size_t>> own(states_.size());
+            for (std::size_t i = 0; i < transitions_.size(); ++i) own[sources_[i]].push_back(i);
+
+            std::vector<std::pair<std::size_t, event_type>> keys;
+            std::vector<slot> unordered;
+            for (state_id leaf = 0; leaf < states_.size(); ++leaf)
+            {
+                // Only innermost states are ever current.
+                if (initial_children_[leaf] != machine_instance::no_state) continue;
+
+                for (state_id a = leaf; a != machine_instance::no_state; a = parents_[a])
+                {
+                    for (std::size_t i : own[a])
+                    {
+                        const state_id lca = common_ancestor(sources_[i], targets_[i]);
+
+                        slot sl;
+                        sl.transition = static_cast<std::uint32_t>(i);
+                        sl.path_begin = static_cast<std::uint32_t>(paths_.size());
+                        for (state_id s = leaf; s != lca; s = parents_[s]) paths_.push_back(s);
+                        sl.exit_end = static_cast<std::uint32_t>(paths_.size());
+                        append_entered(lca, targets_[i]);
+                        for (state_id s = targets_[i]; initial_children_[s] != machine_instance::no_state; )
+                        {
+                            s = initial_children_[s];
+                            paths_.push_back(s);
+                        }
+                        sl.path_end = static_cast<std::uint32_t>(paths_.size());
+
+                        unordered.push_back(sl);
+                        keys.emplace_back(leaf, transitions_[i].get_event());
+                    }
+                }
+            }
+
+            // The state's own transitions come first in each cell, then those of its parent and so on.
+            table_.build(states_.size(), keys);
+            std::vector<std::size_t> order(unordered.size());
+            for (std::size_t k = 0; k < order.size(); ++k) order[k] = k;
+            std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b)
+                { return table_.cell(keys[a].first, keys[a].second) < table_.cell(keys[b].first, keys[b].second); });
+
+            slots_.reserve(order.size());
+            for (std::size_t k : order) slots_.push_back(unordered[k]);
+        }
+
+        // One cell per (state, event) deferred, inherited deferrals included, holding the priority of the innermost.
+        void build_deferrals()
+        {
+            std::vector<std::vector<std::pair<event_type, int>>> own(states_.size());
+            for (auto &d : deferrals_) own[d.first.second].emplace_back(d.first.first, d.second);
+
+            std::vector<std::pair<std::size_t, event_type>> keys;
+            std::vector<int> priorities;
+            for (state_id s = 0; s < states_.size(); ++s)
+            {
+                const std::size_t first = keys.size();
+                for (state_id a = s; a != machine_instance::no_state; a = parents_[a])
+                {
+                    for (auto &d : own[a])
+                    {
+                        if (std::any_of(keys.begin() + first, keys.end(), [&d](const auto &k) { return k.second == d.first; })) continue;
+                        keys.emplace_back(s, d.first);
+                        priorities.push_back(d.second);
+                    }
+                }
+            }
+
+            deferral_table_.build(states_.size(), keys);
+            deferral_priorities_.assign(keys.size(), 0);
+            for (std::size_t k = 0; k < keys.size(); ++k) deferral_priorities_[deferral_table_.find(keys[k].first, keys[k].second).first] = priorities[k];
+        }
+
+    private:
+        typedef std::vector<state_id, allocator_for<state_id>> ids;
+
+        // How a candidate of a finalized flat definition is fired: its guard checked first, or not, or just by
+        // switching the current state when there's no callback to call either.
+        enum candidate_kind : std::uint8_t { guarded, unguarded, direct };
+
+        bool is_finalized_, is_validated_, is_hierarchical_;
+        state_id initial_state_;
+        // Bumped each time transitions are moved, see revision().
+        std::uint32_t revision_;
+
+        // Registration order until finalized, grouped by dispatch cell afterwards; sources_ and targets_ follow the same
+        // order, and so does kinds_ once finalized.
+        transitions transitions_;
+        ids sources_, targets_;
+        std::vector<candidate_kind, allocator_for<candidate_kind>> kinds_;
+        // Lookup used until the definition is finalized.
+        std::multimap<key_type, std::size_t, key_less, allocator_for<std::pair<const key_type, std::size_t>>> index_;
+        // Completion transitions, sorted by source, and whether each state has any.
+        completions completions_;
+        ids completion_sources_, completion_targets_;
+        std::vector<bool, allocator_for<bool>> has_completion_;
+        // Same for timed transitions, sorted by source then delay.
+        timeouts timeouts_;
+        ids timeout_sources_, timeout_targets_;
+        std::vector<bool, allocator_for<bool>> has_timeout_;
+        timing_wheel *timers_;
+        details::timer_route route_;
+
+        std::vector<state, allocator_for<state>> states_;
+        // Initial states of the regions added after the first one.
+        ids region_initials_;
+        // Parent and first substate of each state, no_state when there's none.
+        ids parents_, initial_children_;
+        // Hierarchical definitions only, once finalized: what the dispatch table spans index, and their paths.
+        std::vector<slot, allocator_for<slot>> slots_;
+        ids paths_;
+        // Building only: ids of the state objects seen so far, by address.
+        std::map<const state*, state_id, std::less<const state*>, allocator_for<std::pair<const state* const, state_id>>> state_indices_;
+        dispatch_table table_;
+        // Deferred events by (event, state), with their priority; once finalized, also a table whose cells hold the
+        // priority of each (state, event) deferred, inherited deferrals included.
+        std::map<key_type, int, key_less, allocator_for<std::pair<const key_type, int>>> deferrals_;
+        dispatch_table deferral_table_;
+        std::vector<int, allocator_for<int>> deferral_priorities_;
+
+        mutable observer_type observer_;
+    };
+
+    // A definition along with the single instance it drives.
+    template <typename Event, typename Policy = default_policy>
+    class machine
+    {
+    public:
+        typedef Event event_type;
+        typedef Policy policy_type;
+        typedef machine<event_type, policy_type> self_type;
+        typedef machine_definition<event_type, policy_type> definition_type;
+        typedef typename definition_type::state state;
+        typedef typename definition_type::transition_type transition_type;
+        typedef typename definition_type::allocator_type allocator_type;
+        typedef typename policy_type::template event_queue<event_type, allocator_type> event_queue;
+        typedef details::deferred_queue<event_type, allocator_type> deferred_queue;
+        typedef std::vector<state_id, typename std::allocator_traits<allocator_type>::template rebind_alloc<state_id>> configuration;
+
+        static constexpr bool runs_to_completion = !std::is_same_v<event_queue, details::no_event_queue>;
+
+        static_assert(!runs_to_completion || std::is_void_v<typename policy_type::payload>, "Queued events would have to copy their payload, run to completion doesn't support payloads");
+
+   public:
+       machine() : machine(allocator_type()) {}
+       explicit machine(const allocator_type &alloc)
+           : definition_(alloc), active_(alloc), queue_(alloc), is_dispatching_(false), deferred_(alloc), replayed_(alloc), deferred_in_(machine_instance::no_state), is_replaying_(false)
+       {
+       }
+        // A copy of a running machine arms the timers of its current state anew, instead of sharing those of the original.
+        // So does a machine moved from another, whose timer is cancelled: the wheel only knows where it used to be.
+        machine(const machine &other)
+            : definition_(other.definition_), instance_(other.instance_), active_(other.active_), queue_(other.queue_), is_dispatching_(other.is_dispatching_),
+              deferred_(other.deferred_), replayed_(other.replayed_), deferred_in_(other.deferred_in_), is_replaying_(other.is_replaying_)
+        {
+            adopt_timer();
+        }
+        machine(machine &&other)
+            : definition_(std::move(other.definition_)), instance_(other.instance_), active_(std::move(other.active_)), queue_(std::move(other.queue_)),
+              is_dispatching_(other.is_dispatching_), deferred_(std::move(other.deferred_)), replayed_(std::move(other.replayed_)),
+              deferred_in_(other.deferred_in_), is_replaying_(other.is_replaying_)
+        {
+            definition_.disarm(other.instance_);
+            adopt_timer();
+        }
+        machine& operator=(const machine &other)
+        {
+            if (this == &other) return *this;
+            definition_.disarm(instance_);
+            definition_ = other.definition_;
+            instance_ = other.instance_;
+            active_ = other.active_;
+            queue_ = other.queue_;
+            is_dispatching_ = other.is_dispatching_;
+            deferred_ = other.deferred_;
+            replayed_ = other.replayed_;
+            deferred_in_ = other.deferred_in_;
+            is_replaying_ = other.is_replaying_;
+            adopt_timer();
+            return *this;
+        }
+        machine& operator=(machine &&other)
+        {
+            if (this == &other) return *this;
+            definition_.disarm(instance_);
+            other.definition_.disarm(other.instance_);
+            definition_ = std::move(other.definition_);
+            instance_ = other.instance_;
+            active_ = std::move(other.active_);
+            queue_ = std::move(other.queue_);
+            is_dispatching_ = other.is_dispatching_;
+            deferred_ = std::move(other.deferred_);
+            replayed_ = std::move(other.replayed_);
+            deferred_in_ = other.deferred_in_;
+            is_replaying_ = other.is_replaying_;
+            adopt_timer();
+            return *this;
+        }
+        // The wheel mustn't be left pointing to the instance.
+        ~machine() { definition_.disarm(instance_); }
+
+        template <typename T>
+        self_type& operator<<(T &&t) { definition_ << std::forward<T>(t); return *this; }
+
+        allocator_type get_allocator() const { return definition_.get_allocator(); }
+        void reserve(std::size_t state_count, std::size_t transition_count) { definition_.reserve(state_count, transition_count); }
+        void finalize() { definition_.finalize(); }
+        // See machine_definition::validate().
+        bool validate(state_id *unreachable = nullptr) { return definition_.validate(unreachable); }
+        // See machine_definition::reorder().
+        template <typename Weight>
+        void reorder(Weight weight) { definition_.reorder(std::move(weight)); }
+        // See machine_definition::set_timing_wheel(). The wheel must outlive the machine, which cancels its timer when
+        // it's destroyed, moved or assigned to; copies and moved-to machines arm timers of their own.
+        void set_timing_wheel(timing_wheel *wheel) { definition_.set_timing_wheel(wheel); }
+
+        // With a payload_policy, start(), stop() and notify() take the payload, see machine_definition.
+        template <typename... Payload>
+        void start(const Payload&... payload)
+        {
+            if constexpr (runs_to_completion)
+            {
+                run_to_completion([this]() { start_regions(); });
+            }
+            else
+            {
+                start_regions(payload...);
+            }
+        }
+
+        template <typename... Payload>
+        void stop(const Payload&... payload)
+        {
+            deferred_.clear();
+            if (active_.empty()) definition_.stop(instance_, payload...);
+            else                 definition_.stop(instance_, active_.data(), active_.size(), payload...);
+        }
+
+        bool is_running() const { return instance_.is_running; }
+        bool is_stopped() const { return !is_running(); }
+        // True in a composite state whenever one of its substates is current.
+        bool is_in(const state &s) const
+        {
+            if (active_.empty()) return definition_.is_in(instance_, definition_.id_of(s));
+            return definition_.is_in(active_.data(), active_.size(), definition_.id_of(s));
+        }
+
+        // Current state of each orthogonal region, empty unless the machine has several and is started.
+        const configuration& active_configuration() const { return active_; }
+
+        // Events kept by a state that defers them, see defer(). Dropped when the machine stops or is restored.
+        std::size_t deferred_count() const { return deferred_.size(); }
+
+        // See machine_definition::snapshot(); not from within a callback.
+        std::size_t snapshot(void *buffer, std::size_t size, const void *blob = nullptr, std::size_t blob_size = 0) const
+        {
+            assert(!is_dispatching_ && active_.empty());
+            return definition_.snapshot(instance_, buffer, size, blob, blob_size);
+        }
+
+        std::size_t restore(const void *buffer, std::size_t size, void *blob = nullptr, std::size_t blob_capacity = 0)
+        {
+            assert(!is_dispatching_ && active_.empty());
+            deferred_.clear();
+            route_own_timers();
+            return definition_.restore(instance_, buffer, size, blob, blob_capacity);
+        }
+        bool is_finalized() const { return definition_.is_finalized(); }
+
+        // With a run_to_completion_policy, an event notified from a callback is queued until the ongoing dispatch is over.
+        // Keys other than event_type are accepted as by machine_definition::notify().
+        template <typename Key, typename... Payload>
+        void notify(const Key &event, const Payload&... payload)
+        {
+            if constexpr (runs_to_completion)
+            {
+                if (is_dispatching_)
+                {
+                    // Queued events outlive the key they were notified with.
+                    const event_type queued(event);
+                    queue_.push(queued);
+                }
+                else
+                {
+                    run_to_completion([this, &event]() { dispatch(event); });
+                }
+            }
+            else
+            {
+                dispatch(event, payload...);
+            }
+        }
+
+        // See machine_definition::notify_unchecked(). Events aren't queued, so not with run to completion either.
+        template <typename Key, typename... Payload>
+        void notify_unchecked(const Key &event, const Payload&... payload)
+        {
+            static_assert(!runs_to_completion, "Queued dispatch has its own checks, use notify()");
+            assert(active_.empty() && "Machines with orthogonal regions notify each of them, use notify()");
+            assert(definition_.deferral_count() == 0 && "Deferred events are kept by notify()");
+            definition_.notify_unchecked(instance_, event, payload...);
+        }
+
+        template <typename InputIt>
+        void notify_all(InputIt first, InputIt last)
+        {
+            if constexpr (runs_to_completion)
+            {
+                if (is_dispatching_)
+                {
+                    for (; first != last; ++first) queue_.push(*first);
+                    return;
+                }
+                // Each event of the batch runs to completion before the next one.
+                run_to_completion([this, &first, &last]()
+                {
+                    for (; first != last; ++first)
+                    {
+                        dispatch(*first);
+                        drain();
+                    }
+                });
+            }
+            else if (active_.empty() && definition_.deferral_count() == 0)
+            {
+                definition_.notify_all(instance_, first, last);
+            }
+            else
+            {
+                for (; first != last; ++first) dispatch(*first);
+            }
+        }
+#if defined(__cpp_lib_span)
+        void notify_all(std::span<const event_type> events) { notify_all(events.begin(), events.end()); }
+#endif
+
+        const definition_type& definition() const { return definition_; }
+        const machine_instance& instance() const { return instance_; }
+        typename definition_type::observer_type& observer() const { return definition_.observer(); }
+
+    private:
+        template <typename F>
+        void run_to_completion(F &&f)
+        {
+            struct dispatch_scope
+            {
+                explicit dispatch_scope(self_type &m) : m_(m) { m_.is_dispatching_ = true; }
+                // Also reached if a callback throws: whatever was queued behind it is dropped.
+                ~dispatch_scope() { m_.queue_.clear(); m_.is_dispatching_ = false; }
+                self_type &m_;
+            } scope(*this);
+
+            f();
+            drain();
+        }
+
+        void drain()
+        {
+            while (!queue_.empty()) dispatch(queue_.pop());
+        }
+
+        template <typename... Payload>
+        void start_regions(const Payload&... payload)
+        {
+            deferred_.clear();
+            deferred_in_ = machine_instance::no_state;
+            if (definition_.region_count() == 1)
+            {
+                route_own_timers();
+                definition_.start(instance_, payload...);
+                return;
+            }
+            assert(definition_.deferral_count() == 0 && "Deferred events wait for a single current state to change, not with orthogonal regions");
+            active_.assign(definition_.region_count(), machine_instance::no_state);
+            definition_.start(instance_, active_.data(), active_.size(), payload...);
+        }
+
+        template <typename Key, typename... Payload>
+        void dispatch(const Key &event, const Payload&... payload)
+        {
+            if (!active_.empty())
+            {
+                definition_.notify(instance_, active_.data(), active_.size(), event, payload...);
+                return;
+            }
+            if constexpr (std::is_void_v<typename policy_type::payload>)
+            {
+                if (definition_.deferral_count() != 0)
+                {
+                    if (!definition_.notify(instance_, event)) defer(event);
+                    replay();
+                    return;
+                }
+            }
+            definition_.notify(instance_, event, payload...);
+        }
+
+        template <typename Key>
+        void defer(const Key &event)
+        {
+            int priority = 0;
+            if (!instance_.is_running || !definition_.defers(instance_.current_state, event, &priority)) return;
+            if (deferred_.empty()) deferred_in_ = instance_.current_state;
+            // Like queued events, deferred ones outlive the key they were notified with.
+            const event_type deferred(event);
+            deferred_.push(deferred, priority);
+        }
+
+        // Replaces the timer id copied from another machine with a timer of this one.
+        void adopt_timer()
+        {
+            route_own_timers();
+            definition_.rearm_copy(instance_);
+        }
+
+        // Done wherever the machine owning the instance may have changed since timers were last armed: on start,
+        // restore, copy and move.
+        void route_own_timers()
+        {
+            if constexpr (std::is_void_v<typename policy_type::payload>)
+            {
+                if (definition_.timeout_count() != 0) route_timers();
+            }
+        }
+
+        // Timers of the instance are expired by the machine, so that the events they make it notify run to completion
+        // and those deferred are notified again once they change the state.
+        void route_timers() { definition_.route_timers(&on_timer, this); }
+
+        static void on_timer(void *target, const void *owner, std::uint32_t tag)
+        {
+            static_cast<self_type*>(const_cast<void*>(owner))->expire(*static_cast<machine_instance*>(target), tag);
+        }
+
+        void expire(machine_instance &instance, std::uint32_t tag)
+        {
+            if constexpr (runs_to_completion)
+            {
+                if (!is_dispatching_)
+                {
+                    run_to_completion([this, &instance, tag]() { expire(instance, tag); });
+                    return;
+                }
+            }
+            definition_.expire_timer(instance, tag);
+            replay();
+        }
+
+        // Notifies the deferred events again once the current state isn't the one they were deferred in, as a batch,
+        // and again as long as a batch changes it. Events notified from their callbacks are dispatched or deferred as
+        // usual, the batch under way takes care of any change they make.
+        void replay()
+        {
+            if (!is_replaying_ && !deferred_.empty() && instance_.current_state != deferred_in_) replay_batches();
+        }
+
+        void replay_batches()
+        {
+            struct replay_scope
+            {
+                explicit replay_scope(self_type &m) : m_(m) { m_.is_replaying_ = true; }
+                ~replay_scope() { m_.is_replaying_ = false; }
+                self_type &m_;
+            } scope(*this);
+
+            for (bool changed = true; changed && !deferred_.empty(); )
+            {
+                const state_id from = instance_.current_state;
+                deferred_.take(replayed_);
+                for (auto &entry : replayed_)
+                {
+                    // Stopped from a callback: what's left is dropped along with the rest.
+                    if (!instance_.is_running) break;
+                    if (definition_.notify(instance_, entry.event)) continue;
+                    if (definition_.defers(instance_.current_state, entry.event, &entry.priority)) deferred_.push(std::move(entry));
+                }
+                changed = instance_.current_state != from;
+            }
+            replayed_.clear();
+            deferred_in_ = instance_.current_state;
+        }
+
+    private:
+        definition_type definition_;
+        machine_instance instance_;
+        configuration active_;
+        event_queue queue_;
+        bool is_dispatching_;
+        deferred_queue deferred_;
+        // The batch being notified again, kept to reuse its storage.
+        typename deferred_queue::entries replayed_;
+        // Current state when the deferred events were last dispatched.
+        state_id deferred_in_;
+        bool is_replaying_;
+    };
+
+    namespace details
+    {
+        template <typename Policy>
+        struct transition_builder
+        {
+            typedef basic_state<Policy> state_type;
+
+            transition_builder(const state_type &from, const state_type &to)
                 : from_(from), to_(to)
             {
             }
 
             template<typename Event>
-            transition<Event> operator[](const Event &on_this_event)
+            transition<std::decay_t<Event>, Policy> operator[](Event &&on_this_event)
             {
-                return transition<Event>(from_, to_, on_this_event);
+                return transition<std::decay_t<Event>, Policy>(from_, to_, std::forward<Event>(on_this_event));
             }
 
-            const state &from_, &to_;
+            const state_type &from_, &to_;
         };
     }
 }
 
-lightweight_state_machine::details::transition_builder operator|(const lightweight_state_machine::state &s1, const lightweight_state_machine::state &s2)
+template <typename Policy>
+lightweight_state_machine::details::transition_builder<Policy> operator|(const lightweight_state_machine::basic_state<Policy> &s1, const lightweight_state_machine::basic_state<Policy> &s2)
 {
-    return lightweight_state_machine::details::transition_builder(s1, s2);
+    return lightweight_state_machine::details::transition_builder<Policy>(s1, s2);
 }
 
 #endif
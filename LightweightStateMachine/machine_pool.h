@@ -0,0 +1,338 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_MACHINE_POOL_H
+#define LIGHTWEIGHT_STATE_MACHINE_MACHINE_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "concurrent_machine.h"
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    namespace details
+    {
+        // Bounded lock-free queue for many producers and many consumers, same layout as mpsc_queue but consumers
+        // claim cells with a CAS so that idle workers can steal from any shard.
+        template <typename T>
+        class mpmc_queue
+        {
+        public:
+            explicit mpmc_queue(std::size_t capacity)
+                : mask_(round_up(capacity) - 1), cells_(new cell[mask_ + 1]), enqueue_pos_(0), dequeue_pos_(0)
+            {
+                for (std::size_t i = 0; i <= mask_; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+
+            bool try_push(const T &value)
+            {
+                cell *c;
+                std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+                for (;;)
+                {
+                    c = &cells_[pos & mask_];
+                    const std::intptr_t diff = static_cast<std::intptr_t>(c->sequence.load(std::memory_order_acquire)) - static_cast<std::intptr_t>(pos);
+                    if (diff == 0)
+                    {
+                        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                    }
+                    else if (diff < 0) return false;
+                    else pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+
+                c->value = value;
+                c->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+
+            bool try_pop(T &value)
+            {
+                cell *c;
+                std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+                for (;;)
+                {
+                    c = &cells_[pos & mask_];
+                    const std::intptr_t diff = static_cast<std::intptr_t>(c->sequence.load(std::memory_order_acquire)) - static_cast<std::intptr_t>(pos + 1);
+                    if (diff == 0)
+                    {
+                        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                    }
+                    else if (diff < 0) return false;
+                    else pos = dequeue_pos_.load(std::memory_order_relaxed);
+                }
+
+                value = c->value;
+                c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+
+        private:
+            struct cell
+            {
+                std::atomic<std::size_t> sequence;
+                T value;
+            };
+
+            static std::size_t round_up(std::size_t n)
+            {
+                std::size_t p = 2;
+                while (p < n) p <<= 1;
+                return p;
+            }
+
+        private:
+            const std::size_t mask_;
+            std::unique_ptr<cell[]> cells_;
+            alignas(64) std::atomic<std::size_t> enqueue_pos_;
+            alignas(64) std::atomic<std::size_t> dequeue_pos_;
+        };
+    }
+
+    // Runs many instances of one shared definition on a fixed set of worker threads.
+    //
+    // Each session owns an instance and a lock-free mailbox, along with a count of the requests it hasn't handled yet.
+    // Whoever moves that count away from zero schedules the session on the run queue of its home shard, picked by hashing
+    // the session id, and the worker running it keeps it until the count drops back to zero: a session is in at most one
+    // run queue at a time, so its instance is only ever driven by one worker and needs no lock. Workers that run out of
+    // sessions steal runnable ones from the other shards, moving the whole instance along with its mailbox.
+    //
+    // The definition can't have after() transitions: their timing_wheel isn't thread-safe, and workers would arm and
+    // cancel timers on it concurrently.
+    template <typename Event, typename Policy = default_policy>
+    class machine_pool
+    {
+    public:
+        typedef Event event_type;
+        typedef Policy policy_type;
+        typedef machine_definition<event_type, policy_type> definition_type;
+
+        class session
+        {
+        public:
+            std::uint64_t id() const { return id_; }
+            // Only safe to read while the session isn't scheduled, e.g. after wait_idle().
+            const machine_instance& instance() const { return instance_; }
+
+        private:
+            friend class machine_pool;
+
+            session(std::uint64_t id, std::size_t home_shard, std::size_t mailbox_capacity, void *context)
+                : id_(id), home_shard_(home_shard), mailbox_(mailbox_capacity), unhandled_(1), start_requested_(true), stop_requested_(false)
+            {
+                instance_.context = context;
+            }
+
+            const std::uint64_t id_;
+            const std::size_t home_shard_;
+            machine_instance instance_;
+            mpsc_queue<event_type> mailbox_;
+            // Events posted plus start and stop requests, each counted once queued.
+            std::atomic<std::size_t> unhandled_;
+            std::atomic<bool> start_requested_, stop_requested_;
+        };
+
+    public:
+        // The definition must outlive the pool. max_sessions bounds how many sessions may be added.
+        machine_pool(const definition_type &definition, std::size_t worker_count, std::size_t max_sessions, std::size_t mailbox_capacity = 64)
+            : definition_(definition), mailbox_capacity_(mailbox_capacity), max_sessions_(max_sessions), stopping_(false), sleepers_(0), wake_signal_(0), pending_(0), idle_waiters_(0)
+        {
+            assert(worker_count > 0);
+            assert(definition.timeout_count() == 0 && "Workers would share the definition's timing_wheel, which isn't thread-safe");
+            sessions_.reserve(max_sessions);
+            for (std::size_t i = 0; i < worker_count; ++i) shards_.emplace_back(new shard(max_sessions));
+            for (std::size_t i = 0; i < worker_count; ++i) workers_.emplace_back([this, i]() { run_worker(i); });
+        }
+
+        machine_pool(const machine_pool&) = delete;
+        machine_pool& operator=(const machine_pool&) = delete;
+
+        // Events still queued are dropped, instances are left as they are.
+        ~machine_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex_);
+                stopping_.store(true);
+            }
+            wake_up_.notify_all();
+            for (auto &w : workers_) w.join();
+        }
+
+        std::size_t worker_count() const { return workers_.size(); }
+
+        // Any thread. The instance is started by its worker before any event posted to it is dispatched. Returns
+        // nullptr, adding nothing, once the pool holds max_sessions sessions: run queues can't hold more.
+        session* add_session(std::uint64_t session_id, void *context = nullptr)
+        {
+            session *s;
+            {
+                std::lock_guard<std::mutex> lock(sessions_mutex_);
+                if (sessions_.size() == max_sessions_) return nullptr;
+                sessions_.emplace_back(new session(session_id, std::hash<std::uint64_t>()(session_id) % shards_.size(), mailbox_capacity_, context));
+                s = sessions_.back().get();
+            }
+            schedule(*s);
+            return s;
+        }
+
+        // Any thread. Returns false, dropping the event, if the session's mailbox is full.
+        bool post(session *s, const event_type &event)
+        {
+            if (!s->mailbox_.try_push(event)) return false;
+            if (s->unhandled_.fetch_add(1) == 0) schedule(*s);
+            return true;
+        }
+
+        // Any thread. The instance is stopped once the events already posted to it are dispatched.
+        void stop_session(session *s)
+        {
+            if (s->stop_requested_.exchange(true)) return;
+            if (s->unhandled_.fetch_add(1) == 0) schedule(*s);
+        }
+
+        // Blocks until no session is scheduled or running.
+        void wait_idle() const
+        {
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            idle_waiters_.fetch_add(1);
+            idle_.wait(lock, [this]() { return pending_.load() == 0; });
+            idle_waiters_.fetch_sub(1);
+        }
+
+    private:
+        // Sessions handled in one go before yielding the worker to other runnable sessions.
+        static constexpr std::size_t batch_size = 64;
+
+        struct shard
+        {
+            explicit shard(std::size_t capacity) : run_queue(capacity) {}
+            details::mpmc_queue<session*> run_queue;
+        };
+
+        void schedule(session &s)
+        {
+            pending_.fetch_add(1);
+            // Can't fail: every session is in at most one run queue, which are sized for all of them.
+            const bool pushed = shards_[s.home_shard_]->run_queue.try_push(&s);
+            assert(pushed);
+            (void)pushed;
+
+            // Pairs with the fence of a worker going to sleep: either it sees the session, or we see it sleeping.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleepers_.load(std::memory_order_relaxed) != 0)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(sleep_mutex_);
+                    wake_signal_++;
+                }
+                wake_up_.notify_one();
+            }
+        }
+
+        session* next_session(std::size_t worker)
+        {
+            session *s = nullptr;
+            if (shards_[worker]->run_queue.try_pop(s)) return s;
+            for (std::size_t i = 1; i < shards_.size(); ++i)
+            {
+                if (shards_[(worker + i) % shards_.size()]->run_queue.try_pop(s)) return s;
+            }
+            return nullptr;
+        }
+
+        void run_worker(std::size_t worker)
+        {
+            while (!stopping_.load(std::memory_order_relaxed))
+            {
+                if (session *s = next_session(worker))
+                {
+                    run(*s);
+                    continue;
+                }
+
+                // Registered as a sleeper before looking at the run queues one last time, so that a session scheduled
+                // after that look wakes us up.
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                sleepers_.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                session *s = next_session(worker);
+                if (s == nullptr)
+                {
+                    const std::uint64_t signal = wake_signal_;
+                    wake_up_.wait(lock, [this, signal]() { return stopping_.load() || wake_signal_ != signal; });
+                }
+                sleepers_.fetch_sub(1, std::memory_order_relaxed);
+                lock.unlock();
+                if (s != nullptr) run(*s);
+            }
+        }
+
+        void run(session &s)
+        {
+            // Only handles what's been counted, so that the count can't be released below zero by a post racing with us.
+            const std::size_t budget = std::min(s.unhandled_.load(), batch_size);
+            std::size_t handled = 0;
+
+            if (s.start_requested_.exchange(false))
+            {
+                definition_.start(s.instance_);
+                handled++;
+            }
+
+            event_type event;
+            while (handled < budget && s.mailbox_.try_pop(event))
+            {
+                definition_.notify(s.instance_, event);
+                handled++;
+            }
+
+            // Counted but not in the mailbox: only the stop request can be left.
+            if (handled < budget && s.stop_requested_.exchange(false))
+            {
+                definition_.stop(s.instance_);
+                handled++;
+            }
+
+            if (s.unhandled_.fetch_sub(handled) != handled) schedule(s);
+            // Either a waiter registered before the count dropped, and is woken up, or it sees it at zero.
+            if (pending_.fetch_sub(1) == 1 && idle_waiters_.load() != 0)
+            {
+                { std::lock_guard<std::mutex> lock(idle_mutex_); }
+                idle_.notify_all();
+            }
+        }
+
+    private:
+        const definition_type &definition_;
+        const std::size_t mailbox_capacity_, max_sessions_;
+
+        std::vector<std::unique_ptr<shard>> shards_;
+        std::vector<std::thread> workers_;
+
+        std::mutex sessions_mutex_;
+        std::vector<std::unique_ptr<session>> sessions_;
+
+        // Only used to park idle workers.
+        std::mutex sleep_mutex_;
+        std::condition_variable wake_up_;
+        std::atomic<bool> stopping_;
+        std::atomic<std::size_t> sleepers_;
+        // Bumped under the mutex by every wakeup, so that sleepers tell them from spurious ones.
+        std::uint64_t wake_signal_;
+
+        mutable std::atomic<std::size_t> pending_;
+        // Only used to block wait_idle() callers until pending_ drops to zero.
+        mutable std::mutex idle_mutex_;
+        mutable std::condition_variable idle_;
+        mutable std::atomic<std::size_t> idle_waiters_;
+    };
+}
+
+#endif
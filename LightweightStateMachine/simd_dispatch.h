@@ -0,0 +1,186 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_SIMD_DISPATCH_H
+#define LIGHTWEIGHT_STATE_MACHINE_SIMD_DISPATCH_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    namespace details
+    {
+        inline unsigned lowest_set_bit(std::uint64_t mask)
+        {
+            assert(mask != 0);
+#if defined(_MSC_VER) && !defined(__clang__)
+            unsigned long index;
+            _BitScanForward64(&index, mask);
+            return static_cast<unsigned>(index);
+#else
+            return static_cast<unsigned>(__builtin_ctzll(mask));
+#endif
+        }
+
+        // Position of key among keys[0, count), count if it isn't there. Compares 8 keys at a time with AVX2, 4 with
+        // SSE2 or NEON, and falls back to scalar compares for the tail or on other targets.
+        inline std::size_t find_key(const std::uint32_t *keys, std::size_t count, std::uint32_t key)
+        {
+            std::size_t i = 0;
+#if defined(__AVX2__)
+            const __m256i k = _mm256_set1_epi32(static_cast<int>(key));
+            for (; i + 8 <= count; i += 8)
+            {
+                const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+                const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, k)));
+                if (mask != 0) return i + lowest_set_bit(static_cast<unsigned>(mask));
+            }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+            const __m128i k = _mm_set1_epi32(static_cast<int>(key));
+            for (; i + 4 <= count; i += 4)
+            {
+                const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+                const int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, k)));
+                if (mask != 0) return i + lowest_set_bit(static_cast<unsigned>(mask));
+            }
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+            const uint32x4_t k = vdupq_n_u32(key);
+            for (; i + 4 <= count; i += 4)
+            {
+                // Narrowed to 16 bits a lane, the comparison fits a 64-bit mask.
+                const uint16x4_t equal = vmovn_u32(vceqq_u32(vld1q_u32(keys + i), k));
+                const std::uint64_t mask = vget_lane_u64(vreinterpret_u64_u16(equal), 0);
+                if (mask != 0) return i + lowest_set_bit(mask) / 16;
+            }
+#endif
+            for (; i < count; ++i)
+            {
+                if (keys[i] == key) return i;
+            }
+            return count;
+        }
+
+        // Per state, the distinct events it has transitions for, as sorted 32-bit codes: a lookup halves the state's
+        // codes down to a window of a few vector widths, then compares the window at once. Cells are numbered by
+        // (state, code), so the candidates of a state are contiguous, and a state's codes take 4 bytes each.
+        template <typename Event, typename Allocator>
+        class simd_dispatch_table
+        {
+        public:
+            static_assert(is_dense_event_v<Event> && sizeof(Event) <= sizeof(std::uint32_t), "SIMD dispatch requires integral or enum events of at most 32 bits");
+
+            typedef std::pair<std::uint32_t, std::uint32_t> span;
+
+            // Codes left to compare once the binary search is over.
+            static constexpr std::size_t window = 16;
+
+        private:
+            template <typename T>
+            using allocator_for = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+        public:
+            explicit simd_dispatch_table(const Allocator &alloc = Allocator()) : first_(alloc), codes_(alloc), offsets_(alloc) {}
+
+            template <typename Keys>
+            void build(std::size_t state_count, const Keys &keys)
+            {
+                first_.assign(state_count + 1, 0);
+                codes_.clear();
+                offsets_.clear();
+                if (keys.empty()) return;
+                assert(keys.size() <= std::numeric_limits<std::uint32_t>::max());
+
+                std::vector<std::pair<std::size_t, std::uint32_t>> cells;
+                cells.reserve(keys.size());
+                for (auto &k : keys) cells.emplace_back(k.first, code(k.second));
+                std::sort(cells.begin(), cells.end());
+                cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+
+                codes_.reserve(cells.size());
+                for (auto &c : cells)
+                {
+                    first_[c.first + 1]++;
+                    codes_.push_back(c.second);
+                }
+                for (std::size_t s = 1; s <= state_count; ++s) first_[s] += first_[s - 1];
+
+                offsets_.assign(cells.size() + 1, 0);
+                for (auto &k : keys) offsets_[cell(k.first, k.second) + 1]++;
+                for (std::size_t i = 1; i < offsets_.size(); ++i) offsets_[i] += offsets_[i - 1];
+            }
+
+            std::uint32_t cell(std::size_t state_index, const Event &e) const
+            {
+                const std::uint32_t c = locate(state_index, code(e));
+                assert(c != no_cell);
+                return c;
+            }
+
+            span find(std::size_t state_index, const Event &e) const
+            {
+                if (codes_.empty()) return span(0, 0);
+                const std::uint32_t c = locate(state_index, code(e));
+                if (c == no_cell) return span(0, 0);
+                return span(offsets_[c], offsets_[c + 1]);
+            }
+
+        private:
+            static constexpr std::uint32_t no_cell = std::numeric_limits<std::uint32_t>::max();
+
+            static std::uint32_t code(const Event &e) { return static_cast<std::uint32_t>(event_value(e)); }
+
+            std::uint32_t locate(std::size_t state_index, std::uint32_t key) const
+            {
+                const std::size_t begin = first_[state_index];
+                const std::uint32_t *base = codes_.data() + begin;
+                std::size_t count = first_[state_index + 1] - begin;
+                while (count > window)
+                {
+                    // Keeps key within [base, base + count), if it's there at all. Selected without branching, as
+                    // codes in the same state don't tell much about the next one notified.
+                    const std::size_t half = count / 2;
+                    const bool below = base[half] < key;
+                    base += below ? half + 1 : 0;
+                    count = below ? count - half - 1 : half + 1;
+                }
+                const std::size_t found = find_key(base, count, key);
+                return found == count ? no_cell : static_cast<std::uint32_t>(base - codes_.data() + found);
+            }
+
+        private:
+            // The codes of state s are codes_[first_[s], first_[s + 1]), and the candidates of cell c are
+            // [offsets_[c], offsets_[c + 1]).
+            std::vector<std::uint32_t, allocator_for<std::uint32_t>> first_;
+            std::vector<std::uint32_t, allocator_for<std::uint32_t>> codes_;
+            std::vector<std::uint32_t, allocator_for<std::uint32_t>> offsets_;
+        };
+    }
+
+    // Finalizes into per-state sorted arrays of event codes searched with vector compares, for states with tens to
+    // hundreds of events from a sparse domain: the table stays proportional to the transitions, where a dense one
+    // would be mostly empty, and a lookup touches one or two cache lines of codes.
+    template <typename Base = std_function_policy>
+    struct simd_dispatch_policy : Base
+    {
+        template <typename Event, typename Allocator>
+        using dispatch_table = details::simd_dispatch_table<Event, Allocator>;
+    };
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_STATIC_MACHINE_H
+#define LIGHTWEIGHT_STATE_MACHINE_STATIC_MACHINE_H
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Fully static counterpart of lightweight_state_machine::machine: states are types, events compile-time values, and
+// guards and actions are stored by value in the machine type itself. The table only exists in the type system: notify()
+// is an unrolled sequence of comparisons the compiler turns into a switch, with every callback inlined.
+//
+//     struct idle {};
+//     struct running { void on_enter() { ... } };
+//
+//     auto sm = lsm::make_static_machine(lsm::state_c<idle>,
+//                   (lsm::state_c<idle>    | lsm::state_c<running>) [lsm::event_c<Event::go>] (guard) / action,
+//                   (lsm::state_c<running> | lsm::state_c<idle>)    [lsm::event_c<Event::halt>]);
+//
+// States may provide on_enter() and on_leave() members; the machine holds one instance of each state type.
+
+namespace lightweight_state_machine
+{
+    template <typename Tag>
+    struct static_state
+    {
+        typedef Tag tag_type;
+    };
+
+    template <auto Event>
+    struct static_event
+    {
+        typedef decltype(Event) event_type;
+        static constexpr event_type value = Event;
+    };
+
+    template <typename Tag>
+    constexpr static_state<Tag> state_c{};
+
+    template <auto Event>
+    constexpr static_event<Event> event_c{};
+
+    namespace details
+    {
+        struct no_static_guard
+        {
+            constexpr bool operator()() const { return true; }
+        };
+
+        template <typename... T> struct type_list {};
+
+        template <typename List, typename T> struct append_unique;
+        template <typename... Ts, typename T>
+        struct append_unique<type_list<Ts...>, T>
+        {
+            typedef std::conditional_t<(std::is_same_v<T, Ts> || ...), type_list<Ts...>, type_list<Ts..., T>> type;
+        };
+
+        template <typename List, typename... T> struct unique_types { typedef List type; };
+        template <typename List, typename T, typename... Rest>
+        struct unique_types<List, T, Rest...> : unique_types<typename append_unique<List, T>::type, Rest...> {};
+
+        template <typename T, typename List> struct type_index;
+        template <typename T, typename... Ts>
+        struct type_index<T, type_list<T, Ts...>> : std::integral_constant<std::size_t, 0> {};
+        template <typename T, typename U, typename... Ts>
+        struct type_index<T, type_list<U, Ts...>> : std::integral_constant<std::size_t, 1 + type_index<T, type_list<Ts...>>::value> {};
+
+        template <typename List> struct tuple_of;
+        template <typename... Ts> struct tuple_of<type_list<Ts...>> { typedef std::tuple<Ts...> type; };
+
+        template <typename T, typename = void> struct has_on_enter : std::false_type {};
+        template <typename T> struct has_on_enter<T, std::void_t<decltype(std::declval<T&>().on_enter())>> : std::true_type {};
+        template <typename T, typename = void> struct has_on_leave : std::false_type {};
+        template <typename T> struct has_on_leave<T, std::void_t<decltype(std::declval<T&>().on_leave())>> : std::true_type {};
+    }
+
+    template <typename From, typename To, auto Event, typename Guard = details::no_static_guard, typename... Actions>
+    class static_transition
+    {
+    public:
+        typedef From from_type;
+        typedef To to_type;
+        typedef decltype(Event) event_type;
+        static constexpr event_type event = Event;
+
+    public:
+        constexpr static_transition() = default;
+        constexpr static_transition(Guard g, std::tuple<Actions...> a) : guard_(std::move(g)), actions_(std::move(a)) {}
+
+        template <typename G>
+        constexpr static_transition<From, To, Event, G, Actions...> operator() (G g) const
+        {
+            static_assert(std::is_same_v<Guard, details::no_static_guard>, "A transition can only have one guard");
+            return static_transition<From, To, Event, G, Actions...>(std::move(g), actions_);
+        }
+
+        template <typename A>
+        constexpr static_transition<From, To, Event, Guard, Actions..., A> operator/ (A a) const
+        {
+            return static_transition<From, To, Event, Guard, Actions..., A>(guard_, std::tuple_cat(actions_, std::make_tuple(std::move(a))));
+        }
+
+        constexpr bool check_guard() const { return guard_(); }
+        constexpr void invoke_actions() const { std::apply([](const auto&... a) { (a(), ...); }, actions_); }
+
+    private:
+        Guard guard_;
+        std::tuple<Actions...> actions_;
+    };
+
+    namespace details
+    {
+        template <typename From, typename To>
+        struct static_transition_builder
+        {
+            template <auto Event>
+            constexpr static_transition<From, To, Event> operator[](static_event<Event>) const { return {}; }
+        };
+    }
+
+    template <typename From, typename To>
+    constexpr details::static_transition_builder<From, To> operator|(static_state<From>, static_state<To>)
+    {
+        return {};
+    }
+
+    template <typename Initial, typename... Transitions>
+    class static_machine
+    {
+    public:
+        static_assert(sizeof...(Transitions) > 0, "A static machine needs at least one transition");
+
+        typedef std::common_type_t<typename Transitions::event_type...> event_type;
+        static_assert((std::is_same_v<typename Transitions::event_type, event_type> && ...), "All transitions of a static machine must share the same event type");
+
+        typedef typename details::unique_types<details::type_list<>, Initial, typename Transitions::from_type..., typename Transitions::to_type...>::type states;
+        static constexpr std::size_t state_count = std::tuple_size_v<typename details::tuple_of<states>::type>;
+
+        template <typename Tag>
+        static constexpr std::size_t state_index = details::type_index<Tag, states>::value;
+
+    public:
+        constexpr explicit static_machine(Transitions... t) : transitions_(std::move(t)...), is_running_(false), current_(state_index<Initial>) {}
+
+        void start()
+        {
+            current_ = state_index<Initial>;
+            is_running_ = true;
+            enter<Initial>();
+        }
+
+        void stop()
+        {
+            if (is_running_) leave_current(std::make_index_sequence<state_count>());
+            is_running_ = false;
+        }
+
+        bool is_running() const { return is_running_; }
+        bool is_stopped() const { return !is_running(); }
+
+        template <typename Tag>
+        bool is_in() const { return is_running_ && current_ == state_index<Tag>; }
+
+        template <typename Tag>
+        Tag& get_state() { return std::get<state_index<Tag>>(states_); }
+
+        // Ignored unless started, as by machine::notify().
+        void notify(event_type event)
+        {
+            if (!is_running_) return;
+            dispatch(event, std::index_sequence_for<Transitions...>());
+        }
+
+    private:
+        template <std::size_t... I>
+        void dispatch(event_type event, std::index_sequence<I...>)
+        {
+            // Short-circuits on the first transition that fires, in registration order.
+            (void)(try_fire<I>(event) || ...);
+        }
+
+        template <std::size_t I>
+        bool try_fire(event_type event)
+        {
+            typedef std::tuple_element_t<I, std::tuple<Transitions...>> transition_type;
+            typedef typename transition_type::from_type from_type;
+            typedef typename transition_type::to_type to_type;
+
+            if (event != transition_type::event || current_ != state_index<from_type>) return false;
+
+            const auto &t = std::get<I>(transitions_);
+            if (!t.check_guard()) return false;
+
+            leave<from_type>();
+            t.invoke_actions();
+            current_ = state_index<to_type>;
+            enter<to_type>();
+            return true;
+        }
+
+        template <std::size_t... I>
+        void leave_current(std::index_sequence<I...>)
+        {
+            (void)((current_ == I ? (leave<std::tuple_element_t<I, state_tuple>>(), true) : false) || ...);
+        }
+
+        template <typename Tag>
+        void enter() { if constexpr (details::has_on_enter<Tag>::value) get_state<Tag>().on_enter(); }
+
+        template <typename Tag>
+        void leave() { if constexpr (details::has_on_leave<Tag>::value) get_state<Tag>().on_leave(); }
+
+    private:
+        typedef typename details::tuple_of<states>::type state_tuple;
+
+        std::tuple<Transitions...> transitions_;
+        state_tuple states_;
+        bool is_running_;
+        std::size_t current_;
+    };
+
+    template <typename Initial, typename... Transitions>
+    constexpr static_machine<Initial, Transitions...> make_static_machine(static_state<Initial>, Transitions... t)
+    {
+        return static_machine<Initial, Transitions...>(std::move(t)...);
+    }
+}
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_STATS_OBSERVER_H
+#define LIGHTWEIGHT_STATE_MACHINE_STATS_OBSERVER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    // Durations bucketed by powers of two: bucket 0 counts those under a nanosecond, bucket i those in
+    // [2^(i-1), 2^i) nanoseconds, and the last bucket everything beyond.
+    struct latency_histogram
+    {
+        static constexpr std::size_t bucket_count = 40;
+
+        std::array<std::uint64_t, bucket_count> buckets{};
+
+        // Exclusive upper bound of bucket i, in nanoseconds.
+        static std::uint64_t upper_bound(std::size_t i) { return std::uint64_t(1) << i; }
+
+        static std::size_t bucket_of(std::uint64_t nanoseconds)
+        {
+            std::size_t i = 0;
+            while (nanoseconds != 0 && i < bucket_count - 1)
+            {
+                nanoseconds >>= 1;
+                i++;
+            }
+            return i;
+        }
+
+        std::uint64_t count() const
+        {
+            std::uint64_t total = 0;
+            for (auto b : buckets) total += b;
+            return total;
+        }
+
+        // Upper bound of the bucket holding the given fraction (0 to 1) of the samples, 0 if there are none.
+        std::uint64_t percentile(double fraction) const
+        {
+            const std::uint64_t total = count();
+            if (total == 0) return 0;
+
+            const double wanted = fraction * static_cast<double>(total);
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < bucket_count; ++i)
+            {
+                seen += buckets[i];
+                if (static_cast<double>(seen) >= wanted && seen != 0) return upper_bound(i);
+            }
+            return upper_bound(bucket_count - 1);
+        }
+    };
+
+    // Plain copy of what a stats_observer counted, indexed like the definition's states and transitions.
+    struct machine_stats
+    {
+        struct state_stats
+        {
+            std::uint64_t entries = 0;
+            latency_histogram enter_time, leave_time;
+        };
+
+        struct transition_stats
+        {
+            std::uint64_t fired = 0,
+                          guard_evaluations = 0,
+                          guard_rejections = 0;
+            latency_histogram action_time;
+
+            double rejection_rate() const { return guard_evaluations == 0 ? 0.0 : static_cast<double>(guard_rejections) / static_cast<double>(guard_evaluations); }
+        };
+
+        std::uint64_t dispatched = 0,
+                      unmatched = 0;
+        latency_histogram dispatch_time;
+        std::vector<state_stats> states;
+        std::vector<transition_stats> transitions;
+    };
+
+    namespace details
+    {
+        struct atomic_histogram
+        {
+            std::array<std::atomic<std::uint64_t>, latency_histogram::bucket_count> buckets{};
+
+            template <typename Duration>
+            void record(Duration d)
+            {
+                const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+                buckets[latency_histogram::bucket_of(ns > 0 ? static_cast<std::uint64_t>(ns) : 0)].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void load_into(latency_histogram &h) const
+            {
+                for (std::size_t i = 0; i < h.bucket_count; ++i) h.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            }
+
+            void store_from(const latency_histogram &h)
+            {
+                for (std::size_t i = 0; i < h.bucket_count; ++i) buckets[i].store(h.buckets[i], std::memory_order_relaxed);
+            }
+        };
+    }
+
+    // Observer counting state entries, transitions fired and guard rejections, with histograms of the time spent in
+    // dispatches, enter and leave callbacks and transition actions. Every counter is a relaxed atomic, so instances
+    // dispatched from several threads can share it and snapshot() can be called at any time, without stopping them;
+    // a snapshot taken while dispatching may be a few increments off between counters.
+    //
+    //     lsm::machine<Event, lsm::observer_policy<lsm::stats_observer>> sm;
+    //     ...
+    //     const lsm::machine_stats stats = sm.observer().snapshot();
+    //
+    // Counters are sized by finalize(); definitions that aren't finalized must be sized with resize() once built.
+    // Events on states or transitions beyond that size are only counted as dispatched.
+    class stats_observer : public null_observer
+    {
+    public:
+        stats_observer() : state_count_(0), transition_count_(0) {}
+
+        stats_observer(const stats_observer &other) : stats_observer() { restore(other.snapshot()); }
+        stats_observer(stats_observer&&) = default;
+
+        stats_observer& operator=(stats_observer other)
+        {
+            swap(other);
+            return *this;
+        }
+
+        void swap(stats_observer &other)
+        {
+            std::swap(state_count_, other.state_count_);
+            std::swap(transition_count_, other.transition_count_);
+            states_.swap(other.states_);
+            transitions_.swap(other.transitions_);
+            totals_.swap(other.totals_);
+        }
+
+        // Not while the definition is dispatching. Clears every counter.
+        void resize(std::size_t state_count, std::size_t transition_count)
+        {
+            state_count_ = state_count;
+            transition_count_ = transition_count;
+            states_.reset(new state_counters[state_count]);
+            transitions_.reset(new transition_counters[transition_count]);
+            totals_.reset(new total_counters());
+        }
+
+        machine_stats snapshot() const
+        {
+            machine_stats stats;
+            if (totals_)
+            {
+                stats.dispatched = totals_->dispatched.load(std::memory_order_relaxed);
+                stats.unmatched = totals_->unmatched.load(std::memory_order_relaxed);
+                totals_->dispatch_time.load_into(stats.dispatch_time);
+            }
+
+            stats.states.resize(state_count_);
+            for (std::size_t i = 0; i < state_count_; ++i)
+            {
+                stats.states[i].entries = states_[i].entries.load(std::memory_order_relaxed);
+                states_[i].enter_time.load_into(stats.states[i].enter_time);
+                states_[i].leave_time.load_into(stats.states[i].leave_time);
+            }
+
+            stats.transitions.resize(transition_count_);
+            for (std::size_t i = 0; i < transition_count_; ++i)
+            {
+                auto &t = stats.transitions[i];
+                t.fired = transitions_[i].fired.load(std::memory_order_relaxed);
+                t.guard_evaluations = transitions_[i].guard_evaluations.load(std::memory_order_relaxed);
+                t.guard_rejections = transitions_[i].guard_rejections.load(std::memory_order_relaxed);
+                transitions_[i].action_time.load_into(t.action_time);
+            }
+            return stats;
+        }
+
+        // Hooks
+
+        void on_finalize(std::size_t state_count, std::size_t transition_count) { resize(state_count, transition_count); }
+
+        // Transition counters follow their transition, so that they can keep weighting later reorders.
+        void on_reorder(const std::size_t *positions, std::size_t transition_count)
+        {
+            if (transition_count != transition_count_) return;
+            machine_stats stats = snapshot();
+            const std::vector<machine_stats::transition_stats> before(stats.transitions);
+            for (std::size_t i = 0; i < transition_count; ++i) stats.transitions[i] = before[positions[i]];
+            restore(stats);
+        }
+
+        template <typename Event>
+        void on_dispatch_end(const machine_instance&, const Event&, std::size_t fired, time_point begin, time_point end)
+        {
+            if (!totals_) return;
+            totals_->dispatched.fetch_add(1, std::memory_order_relaxed);
+            totals_->dispatch_time.record(end - begin);
+            if (fired < transition_count_) transitions_[fired].fired.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        template <typename Event>
+        void on_unmatched(const machine_instance&, const Event&, time_point)
+        {
+            if (totals_) totals_->unmatched.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void on_guard(const machine_instance&, std::size_t transition, bool accepted)
+        {
+            if (transition >= transition_count_) return;
+            transitions_[transition].guard_evaluations.fetch_add(1, std::memory_order_relaxed);
+            if (!accepted) transitions_[transition].guard_rejections.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void on_enter(const machine_instance&, state_id state, time_point begin, time_point end)
+        {
+            if (state >= state_count_) return;
+            states_[state].entries.fetch_add(1, std::memory_order_relaxed);
+            states_[state].enter_time.record(end - begin);
+        }
+
+        void on_leave(const machine_instance&, state_id state, time_point begin, time_point end)
+        {
+            if (state < state_count_) states_[state].leave_time.record(end - begin);
+        }
+
+        void on_actions(const machine_instance&, std::size_t transition, time_point begin, time_point end)
+        {
+            if (transition < transition_count_) transitions_[transition].action_time.record(end - begin);
+        }
+
+    private:
+        struct state_counters
+        {
+            std::atomic<std::uint64_t> entries{0};
+            details::atomic_histogram enter_time, leave_time;
+        };
+
+        struct transition_counters
+        {
+            std::atomic<std::uint64_t> fired{0}, guard_evaluations{0}, guard_rejections{0};
+            details::atomic_histogram action_time;
+        };
+
+        struct total_counters
+        {
+            std::atomic<std::uint64_t> dispatched{0}, unmatched{0};
+            details::atomic_histogram dispatch_time;
+        };
+
+        void restore(const machine_stats &stats)
+        {
+            resize(stats.states.size(), stats.transitions.size());
+            totals_->dispatched.store(stats.dispatched, std::memory_order_relaxed);
+            totals_->unmatched.store(stats.unmatched, std::memory_order_relaxed);
+            totals_->dispatch_time.store_from(stats.dispatch_time);
+            for (std::size_t i = 0; i < state_count_; ++i)
+            {
+                states_[i].entries.store(stats.states[i].entries, std::memory_order_relaxed);
+                states_[i].enter_time.store_from(stats.states[i].enter_time);
+                states_[i].leave_time.store_from(stats.states[i].leave_time);
+            }
+            for (std::size_t i = 0; i < transition_count_; ++i)
+            {
+                const auto &t = stats.transitions[i];
+                transitions_[i].fired.store(t.fired, std::memory_order_relaxed);
+                transitions_[i].guard_evaluations.store(t.guard_evaluations, std::memory_order_relaxed);
+                transitions_[i].guard_rejections.store(t.guard_rejections, std::memory_order_relaxed);
+                transitions_[i].action_time.store_from(t.action_time);
+            }
+        }
+
+    private:
+        std::size_t state_count_, transition_count_;
+        std::unique_ptr<state_counters[]> states_;
+        std::unique_ptr<transition_counters[]> transitions_;
+        std::unique_ptr<total_counters> totals_;
+    };
+}
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_TIMING_WHEEL_H
+#define LIGHTWEIGHT_STATE_MACHINE_TIMING_WHEEL_H
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace lightweight_state_machine
+{
+    // Hierarchical timing wheel shared by any number of timers: four levels of 256 slots, each slot of a level spanning
+    // a whole turn of the level below, so that 2^32 ticks are covered and scheduling, cancelling and expiring a timer
+    // are O(1). Timers due further away wait in the last slot of the top level and are placed again when it comes up.
+    //
+    // Timers live in a pool owned by the wheel and are identified by their index in it. The wheel doesn't keep time on
+    // its own: advance() is given the current time by whoever drives it, and fires what's due on the way there. Not
+    // thread-safe, the wheel belongs to one thread, like the instances it serves.
+    class timing_wheel
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+        typedef clock::duration duration;
+        typedef clock::time_point time_point;
+        typedef std::uint32_t timer_id;
+
+        // Called once a timer is due, after it's released: its id may already be reused from within the call.
+        typedef void (*expiry_func)(void *target, const void *owner, std::uint32_t tag);
+
+        static constexpr timer_id no_timer = std::numeric_limits<timer_id>::max();
+
+    public:
+        explicit timing_wheel(duration tick = std::chrono::milliseconds(1), time_point start = clock::now())
+            : tick_(tick), start_(start), current_(0), free_(no_timer), size_(0)
+        {
+            assert(tick > duration::zero());
+            for (auto &h : heads_) h = no_timer;
+        }
+
+        timing_wheel(const timing_wheel&) = delete;
+        timing_wheel& operator=(const timing_wheel&) = delete;
+
+        duration tick() const { return tick_; }
+        // Time the wheel has been advanced to, a whole number of ticks after its start.
+        time_point now() const { return start_ + tick_ * static_cast<duration::rep>(current_); }
+        // Timers scheduled and not yet fired or cancelled.
+        std::size_t size() const { return size_; }
+
+        // Fires target's callback once delay has passed, rounded up to the next tick and at least one tick away.
+        timer_id schedule(duration delay, expiry_func on_expiry, void *target, const void *owner = nullptr, std::uint32_t tag = 0)
+        {
+            timer_id id = free_;
+            if (id != no_timer) free_ = timers_[id].next;
+            else
+            {
+                assert(timers_.size() < no_timer);
+                id = static_cast<timer_id>(timers_.size());
+                timers_.emplace_back();
+            }
+
+            std::uint64_t ticks = delay <= duration::zero() ? 1 : static_cast<std::uint64_t>((delay + tick_ - duration(1)) / tick_);
+            if (ticks == 0) ticks = 1;
+
+            timer &t = timers_[id];
+            t.deadline = current_ + ticks;
+            t.on_expiry = on_expiry;
+            t.target = target;
+            t.owner = owner;
+            t.tag = tag;
+            place(id);
+            size_++;
+            return id;
+        }
+
+        // O(1), the timer mustn't have fired or been cancelled already.
+        void cancel(timer_id id)
+        {
+            assert(id < timers_.size() && timers_[id].slot != free_slot);
+            unlink(id);
+            release(id);
+            size_--;
+        }
+
+        // Moves the wheel forward to now, firing timers as they come due. Returns how many fired.
+        std::size_t advance(time_point now)
+        {
+            if (now < start_) return 0;
+            const std::uint64_t target = static_cast<std::uint64_t>((now - start_) / tick_);
+            std::size_t fired = 0;
+
+            while (current_ < target)
+            {
+                // Nothing to wait for: skip the idle stretch at once.
+                if (size_ == 0)
+                {
+                    current_ = target;
+                    break;
+                }
+                // Nothing due before the next cascade either: skip to it.
+                unsigned lowest = 0;
+                while (lowest < levels && counts_[lowest] == 0) ++lowest;
+                if (lowest != 0 && lowest != levels)
+                {
+                    const std::uint64_t span = std::uint64_t(1) << (lowest * slot_bits);
+                    const std::uint64_t before_cascade = (current_ | (span - 1));
+                    if (before_cascade >= target)
+                    {
+                        current_ = target;
+                        break;
+                    }
+                    current_ = before_cascade;
+                }
+
+                ++current_;
+                // Upper levels first, each refilling the one below before it's spread in turn.
+                unsigned wrapped = 1;
+                while (wrapped < levels && slot_of(current_, wrapped - 1) == 0) ++wrapped;
+                for (unsigned level = wrapped - 1; level > 0; --level) cascade(level, slot_of(current_, level));
+                fired += expire(slot_of(current_, 0));
+            }
+            return fired;
+        }
+
+    private:
+        static constexpr unsigned levels = 4;
+        static constexpr unsigned slot_bits = 8;
+        static constexpr unsigned slots = 1u << slot_bits;
+        // Pseudo slots: the list of timers being fired, and the pool's free list.
+        static constexpr std::uint32_t expiring_slot = levels * slots;
+        static constexpr std::uint32_t free_slot = expiring_slot + 1;
+
+        struct timer
+        {
+            std::uint64_t deadline = 0;
+            timer_id prev = no_timer, next = no_timer;
+            std::uint32_t slot = free_slot;
+            std::uint32_t tag = 0;
+            expiry_func on_expiry = nullptr;
+            void *target = nullptr;
+            const void *owner = nullptr;
+        };
+
+        static unsigned slot_of(std::uint64_t tick, unsigned level)
+        {
+            return static_cast<unsigned>(tick >> (level * slot_bits)) & (slots - 1);
+        }
+
+        void place(timer_id id)
+        {
+            timer &t = timers_[id];
+            const std::uint64_t delta = t.deadline - current_;
+
+            std::uint32_t slot;
+            unsigned level = 0;
+            while (level < levels && delta >> ((level + 1) * slot_bits) != 0) ++level;
+            if (level == levels) slot = (levels - 1) * slots + ((slot_of(current_, levels - 1) + slots - 1) & (slots - 1));
+            else                 slot = level * slots + slot_of(t.deadline, level);
+            link(id, slot);
+        }
+
+        void link(timer_id id, std::uint32_t slot)
+        {
+            timer &t = timers_[id];
+            timer_id &head = slot == expiring_slot ? expiring_ : heads_[slot];
+            t.slot = slot;
+            t.prev = no_timer;
+            t.next = head;
+            if (head != no_timer) timers_[head].prev = id;
+            head = id;
+            if (slot != expiring_slot) counts_[slot / slots]++;
+        }
+
+        void unlink(timer_id id)
+        {
+            timer &t = timers_[id];
+            timer_id &head = t.slot == expiring_slot ? expiring_ : heads_[t.slot];
+            if (t.prev != no_timer) timers_[t.prev].next = t.next;
+            else                    head = t.next;
+            if (t.next != no_timer) timers_[t.next].prev = t.prev;
+            if (t.slot != expiring_slot) counts_[t.slot / slots]--;
+        }
+
+        void release(timer_id id)
+        {
+            timer &t = timers_[id];
+            t.slot = free_slot;
+            t.next = free_;
+            free_ = id;
+        }
+
+        // Spreads a slot of an upper level over the levels below, now that its turn has come.
+        void cascade(unsigned level, unsigned slot)
+        {
+            timer_id id = heads_[level * slots + slot];
+            heads_[level * slots + slot] = no_timer;
+            while (id != no_timer)
+            {
+                const timer_id next = timers_[id].next;
+                counts_[level]--;
+                place(id);
+                id = next;
+            }
+        }
+
+        std::size_t expire(unsigned slot)
+        {
+            // Detached first, as callbacks may schedule or cancel timers, including the ones about to fire.
+            expiring_ = heads_[slot];
+            heads_[slot] = no_timer;
+            for (timer_id id = expiring_; id != no_timer; id = timers_[id].next)
+            {
+                timers_[id].slot = expiring_slot;
+                counts_[0]--;
+            }
+
+            std::size_t fired = 0;
+            while (expiring_ != no_timer)
+            {
+                const timer_id id = expiring_;
+                unlink(id);
+                const timer t = timers_[id];
+                release(id);
+                size_--;
+                t.on_expiry(t.target, t.owner, t.tag);
+                fired++;
+            }
+            return fired;
+        }
+
+    private:
+        const duration tick_;
+        const time_point start_;
+        std::uint64_t current_;
+
+        std::vector<timer> timers_;
+        timer_id heads_[levels * slots];
+        // Timers linked in each level, to skip the ticks where nothing can come due.
+        std::size_t counts_[levels] = {};
+        timer_id expiring_ = no_timer;
+        timer_id free_;
+        std::size_t size_;
+    };
+}
+
+#endif
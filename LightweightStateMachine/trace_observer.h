@@ -0,0 +1,325 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_TRACE_OBSERVER_H
+#define LIGHTWEIGHT_STATE_MACHINE_TRACE_OBSERVER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "lightweight_state_machine.h"
+
+namespace lightweight_state_machine
+{
+    // One transition taken by notify(). Events are recorded as their value when they're integral or enums, otherwise as
+    // their details::event_hash. The instance is the address of the machine_instance, telling machines sharing the
+    // definition apart, and thread the order in which threads first recorded into the trace.
+    struct trace_record
+    {
+        std::uint64_t time;         // Nanoseconds of the observer's clock, when the dispatch ended
+        std::uint64_t event;
+        std::uint64_t instance;
+        state_id from, to;
+        std::uint32_t thread;
+    };
+
+    // Traces written by write_trace() are little-endian 32-bit words: magic, version, record_count, then each record as
+    // time, event and instance (low word first), from, to and thread.
+    namespace details
+    {
+        constexpr std::uint32_t trace_magic = 0x544d534c;   // "LSMT"
+        constexpr std::uint32_t trace_version = 1;
+        constexpr std::size_t trace_header_words = 3;
+        constexpr std::size_t trace_record_words = 9;
+
+        inline void store_le64(unsigned char *p, std::uint64_t v)
+        {
+            store_le32(p, static_cast<std::uint32_t>(v));
+            store_le32(p + 4, static_cast<std::uint32_t>(v >> 32));
+        }
+
+        inline std::uint64_t load_le64(const unsigned char *p) { return load_le32(p) | (static_cast<std::uint64_t>(load_le32(p + 4)) << 32); }
+
+        // The last records of one thread. Only that thread writes, without locking: a record is claimed by bumping
+        // started_, written, then published by bumping committed_. Readers copy the published records and drop those
+        // the writer may have started overwriting meanwhile, as told by started_ read after the copy. Fields are
+        // relaxed atomics, so a torn copy is only ever discarded, never undefined.
+        class trace_ring
+        {
+        public:
+            // Nested dispatches tracked for their source state, deeper ones are recorded from no_state.
+            static constexpr std::size_t max_depth = 32;
+
+            trace_ring(std::size_t capacity, std::uint32_t thread)
+                : mask_(capacity - 1), thread_(thread), words_(new std::atomic<std::uint64_t>[capacity * 4]()), started_(0), committed_(0), depth_(0)
+            {
+                assert(capacity != 0 && (capacity & mask_) == 0);
+            }
+
+            void begin(state_id from)
+            {
+                if (depth_ < max_depth) from_[depth_] = from;
+                depth_++;
+            }
+
+            state_id end()
+            {
+                assert(depth_ != 0);
+                depth_--;
+                return depth_ < max_depth ? from_[depth_] : machine_instance::no_state;
+            }
+
+            void push(std::uint64_t time, std::uint64_t event, std::uint64_t instance, state_id from, state_id to)
+            {
+                const std::uint64_t n = committed_.load(std::memory_order_relaxed);
+                started_.store(n + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+
+                std::atomic<std::uint64_t> *w = words_.get() + (n & mask_) * 4;
+                w[0].store(time, std::memory_order_relaxed);
+                w[1].store(event, std::memory_order_relaxed);
+                w[2].store(instance, std::memory_order_relaxed);
+                w[3].store(from | (static_cast<std::uint64_t>(to) << 32), std::memory_order_relaxed);
+                committed_.store(n + 1, std::memory_order_release);
+            }
+
+            // Appends the records still held, oldest first.
+            void read(std::vector<trace_record> &out) const
+            {
+                const std::uint64_t capacity = mask_ + 1;
+                const std::uint64_t end = committed_.load(std::memory_order_acquire);
+                const std::uint64_t begin = end > capacity ? end - capacity : 0;
+                const std::size_t first = out.size();
+                for (std::uint64_t n = begin; n != end; ++n)
+                {
+                    const std::atomic<std::uint64_t> *w = words_.get() + (n & mask_) * 4;
+                    const std::uint64_t states = w[3].load(std::memory_order_relaxed);
+                    out.push_back(trace_record{ w[0].load(std::memory_order_relaxed), w[1].load(std::memory_order_relaxed), w[2].load(std::memory_order_relaxed),
+                                                static_cast<state_id>(states), static_cast<state_id>(states >> 32), thread_ });
+                }
+
+                // Writing record n overwrites record n - capacity.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const std::uint64_t started = started_.load(std::memory_order_relaxed);
+                const std::uint64_t valid = started > capacity ? started - capacity : 0;
+                if (valid > begin) out.erase(out.begin() + first, out.begin() + first + static_cast<std::size_t>(std::min(valid, end) - begin));
+            }
+
+        private:
+            const std::uint64_t mask_;
+            const std::uint32_t thread_;
+            std::unique_ptr<std::atomic<std::uint64_t>[]> words_;
+            std::atomic<std::uint64_t> started_, committed_;
+            // Only used by the writing thread.
+            state_id from_[max_depth];
+            std::size_t depth_;
+        };
+
+        inline std::uint64_t next_trace_id()
+        {
+            static std::atomic<std::uint64_t> last(0);
+            return last.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+    }
+
+    // Observer keeping the last transitions taken, in fixed-size records written to a ring per thread, so dispatching
+    // threads never share a cache line or a lock and a trace costs a clock read and a few stores per transition. Dispatches
+    // that took no transition aren't recorded. snapshot() can be called from any thread at any time, without stopping
+    // them, and write_trace() turns it into bytes that read_trace() decodes offline:
+    //
+    //     lsm::machine<Event, lsm::observer_policy<lsm::trace_observer>> sm;
+    //     ...
+    //     const std::vector<unsigned char> dump = lsm::write_trace(sm.observer().snapshot());
+    //
+    // Defining LIGHTWEIGHT_STATE_MACHINE_NO_TRACE compiles tracing out: the definition doesn't call the observer or read
+    // the clock, and snapshots are empty.
+    class trace_observer : public null_observer
+    {
+    public:
+#if defined(LIGHTWEIGHT_STATE_MACHINE_NO_TRACE)
+        static constexpr bool is_enabled = false;
+#else
+        static constexpr bool is_enabled = true;
+#endif
+        // Only dispatches are traced, by the time they ended, so neither callbacks nor dispatches are timed.
+        static constexpr bool observes_callbacks = false;
+        static constexpr bool times_dispatch = false;
+
+        // Records kept per thread, rounded up to a power of two.
+        explicit trace_observer(std::size_t capacity = 1024) : id_(details::next_trace_id()), capacity_(round_up(capacity)) {}
+
+        // A copy starts an empty trace of the same capacity.
+        trace_observer(const trace_observer &other) : trace_observer(other.capacity_) {}
+
+        // Threads keep recording into the rings moved, found by id.
+        trace_observer(trace_observer &&other) : id_(other.id_), capacity_(other.capacity_)
+        {
+            std::lock_guard<std::mutex> lock(other.mutex_);
+            rings_.swap(other.rings_);
+            owners_.swap(other.owners_);
+            other.id_ = details::next_trace_id();
+        }
+
+        trace_observer& operator=(const trace_observer &other)
+        {
+            if (this != &other) set_capacity(other.capacity_);
+            return *this;
+        }
+
+        std::size_t capacity() const { return capacity_; }
+
+        // Not while the definition is dispatching. Drops every record.
+        void set_capacity(std::size_t capacity)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            id_ = details::next_trace_id();
+            capacity_ = round_up(capacity);
+            rings_.clear();
+            owners_.clear();
+        }
+
+        // Records of every thread, ordered by time.
+        std::vector<trace_record> snapshot() const
+        {
+            std::vector<trace_record> records;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &r : rings_) r->read(records);
+            }
+            std::stable_sort(records.begin(), records.end(), [](const trace_record &a, const trace_record &b) { return a.time < b.time; });
+            return records;
+        }
+
+        // Hooks
+
+        template <typename Event>
+        void on_dispatch_begin(const machine_instance &instance, const Event&, time_point)
+        {
+            ring().begin(instance.current_state);
+        }
+
+        template <typename Event>
+        void on_dispatch_end(const machine_instance &instance, const Event &event, std::size_t fired, time_point, time_point end)
+        {
+            details::trace_ring &r = ring();
+            const state_id from = r.end();
+            if (fired == no_transition) return;
+
+            const auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(end.time_since_epoch()).count();
+            r.push(static_cast<std::uint64_t>(time), code(event), reinterpret_cast<std::uintptr_t>(&instance), from, instance.current_state);
+        }
+
+    private:
+        static std::size_t round_up(std::size_t capacity)
+        {
+            std::size_t rounded = 1;
+            while (rounded < capacity) rounded <<= 1;
+            return rounded;
+        }
+
+        template <typename Key>
+        static std::uint64_t code(const Key &event)
+        {
+            if constexpr (details::is_dense_event_v<Key>) return static_cast<std::uint64_t>(details::event_value(event));
+            else                                         return static_cast<std::uint64_t>(details::event_hash()(event));
+        }
+
+        // The ring of the calling thread, created when it first records. Threads remember the last rings they wrote to
+        // by trace id, never reused, so a thread outliving a trace doesn't find its rings; the others are looked up
+        // again by thread id, a thread started once another exited possibly taking over its ring.
+        static constexpr std::size_t known_rings = 8;
+
+        details::trace_ring& ring()
+        {
+            struct known_ring
+            {
+                std::uint64_t id;
+                details::trace_ring *ring;
+            };
+            thread_local known_ring last{ 0, nullptr };
+            if (last.id == id_) return *last.ring;
+
+            thread_local std::array<known_ring, known_rings> known{};
+            thread_local std::size_t replaced = 0;
+            for (const known_ring &k : known)
+            {
+                if (k.id == id_)
+                {
+                    last = k;
+                    return *k.ring;
+                }
+            }
+
+            const std::thread::id self = std::this_thread::get_id();
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::size_t i = 0;
+            while (i != owners_.size() && owners_[i] != self) ++i;
+            if (i == owners_.size())
+            {
+                rings_.emplace_back(new details::trace_ring(capacity_, static_cast<std::uint32_t>(rings_.size())));
+                owners_.push_back(self);
+            }
+            last = known_ring{ id_, rings_[i].get() };
+            known[replaced++ % known_rings] = last;
+            return *last.ring;
+        }
+
+    private:
+        std::uint64_t id_;
+        std::size_t capacity_;
+        mutable std::mutex mutex_;
+        std::vector<std::unique_ptr<details::trace_ring>> rings_;
+        std::vector<std::thread::id> owners_;
+    };
+
+    inline std::vector<unsigned char> write_trace(const std::vector<trace_record> &records)
+    {
+        assert(records.size() <= std::numeric_limits<std::uint32_t>::max());
+        std::vector<unsigned char> bytes(4 * (details::trace_header_words + details::trace_record_words * records.size()));
+        unsigned char *p = bytes.data();
+        details::store_le32(p, details::trace_magic);
+        details::store_le32(p + 4, details::trace_version);
+        details::store_le32(p + 8, static_cast<std::uint32_t>(records.size()));
+        p += 4 * details::trace_header_words;
+        for (const trace_record &r : records)
+        {
+            details::store_le64(p, r.time);
+            details::store_le64(p + 8, r.event);
+            details::store_le64(p + 16, r.instance);
+            details::store_le32(p + 24, r.from);
+            details::store_le32(p + 28, r.to);
+            details::store_le32(p + 32, r.thread);
+            p += 4 * details::trace_record_words;
+        }
+        return bytes;
+    }
+
+    // Decodes a trace written by write_trace(), from any address. False if it's truncated or isn't a trace.
+    inline bool read_trace(const unsigned char *in, std::size_t size, std::vector<trace_record> &records)
+    {
+        records.clear();
+        if (size < 4 * details::trace_header_words || details::load_le32(in) != details::trace_magic || details::load_le32(in + 4) != details::trace_version) return false;
+        const std::uint64_t count = details::load_le32(in + 8);
+        if (size != 4 * (details::trace_header_words + details::trace_record_words * count)) return false;
+
+        records.reserve(static_cast<std::size_t>(count));
+        const unsigned char *p = in + 4 * details::trace_header_words;
+        for (std::uint64_t i = 0; i < count; ++i)
+        {
+            records.push_back(trace_record{ details::load_le64(p), details::load_le64(p + 8), details::load_le64(p + 16),
+                                            details::load_le32(p + 24), details::load_le32(p + 28), details::load_le32(p + 32) });
+            p += 4 * details::trace_record_words;
+        }
+        return true;
+    }
+}
+
+#endif
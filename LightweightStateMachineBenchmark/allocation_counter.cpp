@@ -0,0 +1,25 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Kept in their own translation unit, away from the benchmarks, so that the compiler doesn't inline them into callers
+// and then pair the malloc/free calls with the operator new/delete expressions.
+static std::atomic<std::size_t> count(0);
+
+std::size_t allocation_count() { return count.load(std::memory_order_relaxed); }
+
+void* operator new(std::size_t size)
+{
+    count.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
@@ -0,0 +1,9 @@
+#ifndef LIGHTWEIGHT_STATE_MACHINE_BENCHMARK_ALLOCATION_COUNTER_H
+#define LIGHTWEIGHT_STATE_MACHINE_BENCHMARK_ALLOCATION_COUNTER_H
+
+#include <cstddef>
+
+// Number of global operator new calls since the process started, counted by the replacements in allocation_counter.cpp.
+std::size_t allocation_count();
+
+#endif
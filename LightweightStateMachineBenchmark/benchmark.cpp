@@ -0,0 +1,539 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "allocation_counter.h"
+#include "compiled_definition.h"
+#include "instance_array.h"
+#include "lightweight_state_machine.h"
+#include "simd_dispatch.h"
+#include "static_machine.h"
+#include "trace_observer.h"
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    enum class backend { indexed, finalized, hashed, simd };
+
+    enum class Event { e0, e1, e2, e3, e4, e5, e6, e7 };
+
+    template <typename Event>
+    Event make_event(int i) { return static_cast<Event>(i); }
+
+    // Past the small string buffer, as names read from configuration often are.
+    template <>
+    std::string make_event<std::string>(int i) { return "configured_event_" + std::to_string(i); }
+
+    // Message codes spread over the whole 64-bit range.
+    template <>
+    std::uint64_t make_event<std::uint64_t>(int i) { return (static_cast<std::uint64_t>(i) + 1) * 0x9E3779B97F4A7C15ull; }
+
+    // 32-bit message codes, as sparse.
+    template <>
+    std::uint32_t make_event<std::uint32_t>(int i) { return (static_cast<std::uint32_t>(i) + 1) * 0x9E3779B1u; }
+
+    // One state looping on itself through transitions_count transitions, each on its own event.
+    template <typename Event, typename Policy = lsm::default_policy>
+    void build_loop(lsm::machine<Event, Policy> &sm, const lsm::basic_state<typename Policy::callables> &s, int transitions_count, int &counter)
+    {
+        sm << s;
+        for (int i = 0; i < transitions_count; ++i) sm << (s | s) [make_event<Event>(i)] / [&counter]() { counter++; };
+    }
+
+    template <typename Event, typename Key, typename Policy>
+    void run_notify_loop(benchmark::State &bench, bool finalized, int transitions_count)
+    {
+        int counter = 0;
+        const lsm::state s = lsm::state();
+
+        lsm::machine<Event, Policy> sm;
+        build_loop(sm, s, transitions_count, counter);
+        if constexpr (lsm::machine_definition<Event, Policy>::is_finalizable)
+        {
+            if (finalized) sm.finalize();
+        }
+        sm.start();
+
+        std::vector<Event> events;
+        for (int i = 0; i < transitions_count; ++i) events.push_back(make_event<Event>(i));
+        const std::vector<Key> keys(events.begin(), events.end());
+
+        std::size_t next = 0;
+        for (auto _ : bench)
+        {
+            sm.notify(keys[next]);
+            if (++next == keys.size()) next = 0;
+        }
+
+        benchmark::DoNotOptimize(counter);
+        bench.SetItemsProcessed(bench.iterations());
+    }
+
+    // Key is what notify() is given, looked up as is among the Event of the machine.
+    template <typename Event, typename Key = Event>
+    void notify_loop(benchmark::State &bench, backend b, int transitions_count)
+    {
+        if (b == backend::hashed) run_notify_loop<Event, Key, lsm::hashed_dispatch_policy<>>(bench, true, transitions_count);
+        else if constexpr (lsm::details::is_dense_event_v<Event> && sizeof(Event) <= sizeof(std::uint32_t))
+        {
+            if (b == backend::simd) run_notify_loop<Event, Key, lsm::simd_dispatch_policy<>>(bench, true, transitions_count);
+            else                    run_notify_loop<Event, Key, lsm::default_policy>(bench, b == backend::finalized, transitions_count);
+        }
+        else                      run_notify_loop<Event, Key, lsm::default_policy>(bench, b == backend::finalized, transitions_count);
+    }
+}
+
+// notify() throughput against the number of transitions leaving the current state.
+static void notify_transitions_per_state(benchmark::State &bench)
+{
+    notify_loop<int>(bench, static_cast<backend>(bench.range(0)), static_cast<int>(bench.range(1)));
+}
+BENCHMARK(notify_transitions_per_state)->ArgNames({"backend", "transitions"})->ArgsProduct({{0, 1, 2}, {1, 4, 16, 64, 256}});
+
+// Char, enum, string and sparse 64-bit events, by backend (0: indexed, 1: finalized dense, 2: hashed). Strings and
+// wide codes have no dense table; strings are either notified as strings or looked up from string_views.
+static void notify_char_event(benchmark::State &bench)   { notify_loop<char>(bench, static_cast<backend>(bench.range(0)), 8); }
+static void notify_enum_event(benchmark::State &bench)   { notify_loop<Event>(bench, static_cast<backend>(bench.range(0)), 8); }
+static void notify_string_event(benchmark::State &bench) { notify_loop<std::string>(bench, static_cast<backend>(bench.range(0)), 8); }
+static void notify_string_view_event(benchmark::State &bench) { notify_loop<std::string, std::string_view>(bench, static_cast<backend>(bench.range(0)), 8); }
+static void notify_wide_event(benchmark::State &bench)   { notify_loop<std::uint64_t>(bench, static_cast<backend>(bench.range(0)), static_cast<int>(bench.range(1))); }
+BENCHMARK(notify_char_event)->ArgName("backend")->DenseRange(0, 2);
+BENCHMARK(notify_enum_event)->ArgName("backend")->DenseRange(0, 2);
+BENCHMARK(notify_string_event)->ArgName("backend")->Arg(0)->Arg(2);
+BENCHMARK(notify_string_view_event)->ArgName("backend")->Arg(0)->Arg(2);
+BENCHMARK(notify_wide_event)->ArgNames({"backend", "transitions"})->ArgsProduct({{0, 2}, {8, 256}});
+
+// Routing states with 40 to 200 sparse 32-bit codes (0: indexed, 2: hashed, 3: SIMD search).
+static void notify_message_code(benchmark::State &bench) { notify_loop<std::uint32_t>(bench, static_cast<backend>(bench.range(0)), static_cast<int>(bench.range(1))); }
+BENCHMARK(notify_message_code)->ArgNames({"backend", "transitions"})->ArgsProduct({{0, 2, 3}, {8, 40, 200}});
+
+// Transitions sharing one trigger, like the shared_trigger test: every guard but the last one rejects the event.
+static void notify_guard_fan_out(benchmark::State &bench)
+{
+    const int guards_count = static_cast<int>(bench.range(1));
+    int counter = 0;
+
+    const lsm::state a = lsm::state(),
+                     b = lsm::state();
+
+    lsm::machine<char> sm;
+    sm << a;
+    for (int i = 0; i < guards_count - 1; ++i) sm << (a | b) ['k'] ([&counter]() { counter++; return false; });
+    sm << (a | a) ['k'] ([]() { return true; });
+    if (bench.range(0)) sm.finalize();
+    sm.start();
+
+    for (auto _ : bench) sm.notify('k');
+
+    benchmark::DoNotOptimize(counter);
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_guard_fan_out)->ArgNames({"finalized", "guards"})->ArgsProduct({{0, 1}, {1, 2, 8, 32}});
+
+// Ping-pong between two states without any callback: once finalized, each notify is a lookup and a store. 2 is
+// finalized and validated, notified through notify_unchecked().
+static void notify_direct_transition(benchmark::State &bench)
+{
+    const lsm::state a = lsm::state(),
+                     b = lsm::state();
+
+    lsm::machine<char> sm;
+    sm << a << (a | b) ['n'] << (b | a) ['n'];
+    if (bench.range(0)) sm.finalize();
+    if (bench.range(0) == 2) sm.validate();
+    sm.start();
+
+    if (bench.range(0) == 2) for (auto _ : bench) sm.notify_unchecked('n');
+    else                     for (auto _ : bench) sm.notify('n');
+
+    benchmark::DoNotOptimize(sm.instance());
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_direct_transition)->ArgName("finalized")->DenseRange(0, 2);
+
+// The same finalized ping-pong, 1 recording each transition with a trace_observer.
+template <typename Policy>
+static void notify_ping_pong(benchmark::State &bench)
+{
+    const lsm::state a = lsm::state(),
+                     b = lsm::state();
+
+    lsm::machine<char, Policy> sm;
+    sm << a << (a | b) ['n'] << (b | a) ['n'];
+    sm.finalize();
+    sm.start();
+
+    for (auto _ : bench) sm.notify('n');
+
+    benchmark::DoNotOptimize(sm.instance());
+    bench.SetItemsProcessed(bench.iterations());
+}
+
+static void notify_traced_transition(benchmark::State &bench)
+{
+    if (bench.range(0)) notify_ping_pong<lsm::observer_policy<lsm::trace_observer>>(bench);
+    else                notify_ping_pong<lsm::std_function_policy>(bench);
+}
+BENCHMARK(notify_traced_transition)->ArgName("traced")->DenseRange(0, 1);
+
+// A handshake receiving 8 key presses before it's over, then a reset: 0 buffers them outside the machine and notifies
+// them again once the session is up, 1 has the handshake defer them.
+static void notify_deferred_events(benchmark::State &bench)
+{
+    const lsm::state handshake, session;
+    int keys = 0;
+
+    lsm::machine<char> sm;
+    sm << handshake
+       << (handshake | session)   ['r']
+       << (session   | session)   ['k'] / [&keys]() { keys++; }
+       << (session   | handshake) ['x'];
+    const bool deferred = bench.range(0) != 0;
+    if (deferred) sm << lsm::defer(handshake, 'k');
+    sm.finalize();
+    sm.start();
+
+    std::vector<char> buffered;
+    for (auto _ : bench)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            if (deferred || !sm.is_in(handshake)) sm.notify('k');
+            else                                  buffered.push_back('k');
+        }
+        sm.notify('r');
+        for (char e : buffered) sm.notify(e);
+        buffered.clear();
+        sm.notify('x');
+    }
+
+    benchmark::DoNotOptimize(keys);
+    bench.SetItemsProcessed(bench.iterations() * 10);
+}
+BENCHMARK(notify_deferred_events)->ArgName("deferred")->DenseRange(0, 1);
+
+// A tick broadcast to a fleet of 65536 devices cycling through 4 states: 0 notifies each instance in turn, 1 applies
+// the tick to an instance_array at once.
+static void broadcast_tick(benchmark::State &bench)
+{
+    const std::size_t count = 65536;
+    const lsm::state s0, s1, s2, s3;
+
+    lsm::machine_definition<char> definition;
+    definition << s0 << (s0 | s1) ['t'] << (s1 | s2) ['t'] << (s2 | s3) ['t'] << (s3 | s0) ['t'];
+    definition.finalize();
+
+    lsm::instance_array<lsm::machine_definition<char>> fleet(definition, count);
+    std::vector<lsm::machine_instance> instances(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        fleet.start(i);
+        definition.start(instances[i]);
+        for (std::size_t n = 0; n < i % 4; ++n)
+        {
+            fleet.notify(i, 't');
+            definition.notify(instances[i], 't');
+        }
+    }
+
+    for (auto _ : bench)
+    {
+        if (bench.range(0)) fleet.notify_all('t');
+        else                for (auto &instance : instances) definition.notify(instance, 't');
+    }
+
+    benchmark::DoNotOptimize(fleet.data());
+    benchmark::DoNotOptimize(instances.data());
+    bench.SetItemsProcessed(bench.iterations() * count);
+}
+BENCHMARK(broadcast_tick)->ArgName("array")->DenseRange(0, 1);
+
+// Idle timeout of many sessions sharing one wheel: every activity cancels the session's timer and arms a new one,
+// and the wheel moves on a tick every 64 notifies.
+static void notify_timed_sessions(benchmark::State &bench)
+{
+    const std::size_t count = static_cast<std::size_t>(bench.range(0));
+    lsm::timing_wheel wheel(std::chrono::milliseconds(1), lsm::timing_wheel::clock::time_point());
+    const lsm::state active, idle;
+
+    lsm::machine_definition<char> definition;
+    definition.set_timing_wheel(&wheel);
+    definition << active
+               << (active | active) ['d']
+               << (idle   | active) ['d']
+               << (active | idle)   [lsm::after(std::chrono::seconds(30))];
+    definition.finalize();
+
+    std::vector<lsm::machine_instance> sessions(count);
+    for (auto &s : sessions) definition.start(s);
+
+    std::size_t next = 0;
+    std::uint64_t notified = 0;
+    for (auto _ : bench)
+    {
+        definition.notify(sessions[next], 'd');
+        if (++next == count) next = 0;
+        if ((++notified & 63) == 0) wheel.advance(wheel.now() + wheel.tick());
+    }
+
+    benchmark::DoNotOptimize(sessions.data());
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_timed_sessions)->ArgName("sessions")->Arg(1)->Arg(1024)->Arg(65536);
+
+// Cost of the action list of the transition fired.
+template <typename Policy>
+static void notify_action_count(benchmark::State &bench)
+{
+    const int actions_count = static_cast<int>(bench.range(0));
+    int counter = 0;
+
+    const lsm::basic_state<typename Policy::callables> s;
+
+    lsm::machine<char, Policy> sm;
+    auto t = (s | s) ['k'];
+    for (int i = 0; i < actions_count; ++i) t / [&counter]() { counter++; };
+    sm << s << std::move(t);
+    sm.finalize();
+    sm.start();
+
+    for (auto _ : bench) sm.notify('k');
+
+    benchmark::DoNotOptimize(counter);
+    bench.SetItemsProcessed(bench.iterations() * actions_count);
+}
+BENCHMARK_TEMPLATE(notify_action_count, lsm::std_function_policy)->ArgName("actions")->RangeMultiplier(4)->Range(1, 64);
+BENCHMARK_TEMPLATE(notify_action_count, lsm::inplace_function_policy<>)->ArgName("actions")->RangeMultiplier(4)->Range(1, 64);
+
+// A 200-byte event payload read by guard and action: stashed into state captured by the callbacks before each
+// notify(), against handed to them by reference through a payload_policy.
+struct market_data
+{
+    int price;
+    char fields[196];
+};
+
+static void notify_captured_payload(benchmark::State &bench)
+{
+    market_data stash = {}, incoming = {};
+    long long total = 0;
+
+    const lsm::state s = lsm::state();
+
+    lsm::machine<char> sm;
+    sm << s << (s | s) ['m'] ([&stash]() { return stash.price >= 0; }) / [&stash, &total]() { total += stash.price; };
+    sm.finalize();
+    sm.start();
+
+    for (auto _ : bench)
+    {
+        incoming.price++;
+        benchmark::DoNotOptimize(incoming);
+        stash = incoming;
+        sm.notify('m');
+    }
+
+    benchmark::DoNotOptimize(total);
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_captured_payload);
+
+static void notify_forwarded_payload(benchmark::State &bench)
+{
+    typedef lsm::payload_policy<market_data> policy;
+    market_data incoming = {};
+    long long total = 0;
+
+    const lsm::basic_state<policy> s;
+
+    lsm::machine<char, policy> sm;
+    sm << s << (s | s) ['m'] ([](const market_data &m) { return m.price >= 0; }) / [&total](const market_data &m) { total += m.price; };
+    sm.finalize();
+    sm.start(incoming);
+
+    for (auto _ : bench)
+    {
+        incoming.price++;
+        benchmark::DoNotOptimize(incoming);
+        sm.notify('m', incoming);
+    }
+
+    benchmark::DoNotOptimize(total);
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_forwarded_payload);
+
+// Ping-pong between two innermost states through a transition inherited from their grandparents, against the same
+// ping-pong between two flat states: once finalized, both cost a table lookup plus leave and enter chains.
+static void notify_nested_transition(benchmark::State &bench)
+{
+    const bool nested = bench.range(0) != 0;
+    const lsm::state a = lsm::state(), a1 = lsm::state(), a2 = lsm::state(),
+                     b = lsm::state(), b1 = lsm::state(), b2 = lsm::state();
+
+    lsm::machine<char> sm;
+    if (nested)
+    {
+        sm << a2
+           << lsm::nest(a, a1) << lsm::nest(a1, a2)
+           << lsm::nest(b, b1) << lsm::nest(b1, b2)
+           << (a | b) ['n']
+           << (b | a) ['n'];
+    }
+    else
+    {
+        sm << a2
+           << (a2 | b2) ['n']
+           << (b2 | a2) ['n'];
+    }
+    sm.finalize();
+    sm.start();
+
+    for (auto _ : bench) sm.notify('n');
+
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_nested_transition)->ArgName("nested")->DenseRange(0, 1);
+
+// Lower bound: the same loop on a machine whose table only exists in its type.
+static void notify_static_machine(benchmark::State &bench)
+{
+    struct idle {};
+    int counter = 0;
+
+    auto sm = lsm::make_static_machine(lsm::state_c<idle>,
+                  (lsm::state_c<idle> | lsm::state_c<idle>) [lsm::event_c<'k'>] / [&counter]() { counter++; });
+    sm.start();
+
+    char event = 'k';
+    for (auto _ : bench)
+    {
+        // Otherwise the whole loop folds into a single addition.
+        benchmark::DoNotOptimize(event);
+        sm.notify(event);
+        benchmark::ClobberMemory();
+    }
+
+    benchmark::DoNotOptimize(counter);
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_static_machine);
+
+// Building a machine from states_count states chained in a ring, and the heap allocations it takes.
+template <typename Policy>
+static void build_machine(benchmark::State &bench)
+{
+    const int states_count = static_cast<int>(bench.range(1));
+    const bool finalized = bench.range(0) != 0;
+
+    std::vector<lsm::basic_state<typename Policy::callables>> states(states_count);
+
+    std::size_t allocations = 0;
+    for (auto _ : bench)
+    {
+        const std::size_t before = allocation_count();
+        {
+            lsm::machine<int, Policy> sm;
+            sm.reserve(states_count, states_count);
+            sm << states[0];
+            for (int i = 0; i < states_count; ++i) sm << (states[i] | states[(i + 1) % states_count]) [i];
+            if (finalized) sm.finalize();
+            benchmark::DoNotOptimize(sm);
+        }
+        allocations += allocation_count() - before;
+    }
+
+    bench.counters["allocs_per_machine"] = benchmark::Counter(static_cast<double>(allocations), benchmark::Counter::kAvgIterations);
+    bench.SetItemsProcessed(bench.iterations() * states_count);
+}
+BENCHMARK_TEMPLATE(build_machine, lsm::std_function_policy)->ArgNames({"finalized", "states"})->ArgsProduct({{0, 1}, {4, 64, 1024}});
+
+// Same, backed by an arena: what's left is only the arena's own blocks.
+static void build_machine_in_arena(benchmark::State &bench)
+{
+    typedef lsm::arena_policy<lsm::inplace_function_policy<>> policy;
+    const int states_count = static_cast<int>(bench.range(0));
+
+    std::vector<lsm::basic_state<policy::callables>> states(states_count);
+
+    std::size_t allocations = 0;
+    for (auto _ : bench)
+    {
+        const std::size_t before = allocation_count();
+        {
+            lsm::machine_arena arena(64 * 1024);
+            lsm::machine<int, policy> sm(arena.get_allocator());
+            sm.reserve(states_count, states_count);
+            sm << states[0];
+            for (int i = 0; i < states_count; ++i) sm << (states[i] | states[(i + 1) % states_count]) [i];
+            sm.finalize();
+            benchmark::DoNotOptimize(sm);
+        }
+        allocations += allocation_count() - before;
+    }
+
+    bench.counters["allocs_per_machine"] = benchmark::Counter(static_cast<double>(allocations), benchmark::Counter::kAvgIterations);
+    bench.SetItemsProcessed(bench.iterations() * states_count);
+}
+BENCHMARK(build_machine_in_arena)->ArgName("states")->Arg(4)->Arg(64)->Arg(1024);
+
+// Startup from a compiled image of the same ring, each transition with an action: checking the image and binding the
+// callbacks by name is all that's left.
+static void load_compiled_definition(benchmark::State &bench)
+{
+    const int states_count = static_cast<int>(bench.range(0));
+
+    lsm::definition_compiler compiler;
+    for (int i = 0; i < states_count; ++i) compiler.add_state();
+    for (int i = 0; i < states_count; ++i)
+    {
+        compiler.add_transition(i, (i + 1) % states_count, static_cast<std::uint32_t>(i), {}, { "step" });
+    }
+    const std::vector<unsigned char> image = compiler.compile();
+
+    int counter = 0;
+    lsm::callback_registry registry;
+    registry.add_action("step", [&counter]() { counter++; });
+
+    for (auto _ : bench)
+    {
+        lsm::compiled_definition<int> definition;
+        definition.load(image.data(), image.size());
+        definition.bind(registry);
+        benchmark::DoNotOptimize(definition);
+    }
+
+    bench.counters["image_bytes"] = static_cast<double>(image.size());
+    bench.SetItemsProcessed(bench.iterations() * states_count);
+}
+BENCHMARK(load_compiled_definition)->ArgName("states")->Arg(4)->Arg(64)->Arg(1024);
+
+static void notify_compiled_definition(benchmark::State &bench)
+{
+    lsm::definition_compiler compiler;
+    compiler.add_state();
+    compiler.add_state();
+    compiler.add_transition(0, 1, 'n');
+    compiler.add_transition(1, 0, 'n');
+    const std::vector<unsigned char> image = compiler.compile();
+
+    lsm::compiled_definition<char> definition;
+    definition.load(image.data(), image.size());
+    definition.bind(lsm::callback_registry());
+    lsm::machine_instance instance;
+    definition.start(instance);
+
+    for (auto _ : bench) definition.notify(instance, 'n');
+
+    benchmark::DoNotOptimize(instance);
+    bench.SetItemsProcessed(bench.iterations());
+}
+BENCHMARK(notify_compiled_definition);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,206 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/async_machine.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    // Stands for an I/O completion: awaiters are resumed when the test completes it.
+    struct pending_io
+    {
+        struct awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) const { io.waiting.push_back(h); }
+            void await_resume() const noexcept {}
+
+            pending_io &io;
+        };
+
+        awaiter wait() { return { *this }; }
+
+        void complete_one()
+        {
+            const std::coroutine_handle<> h = waiting.front();
+            waiting.erase(waiting.begin());
+            h.resume();
+        }
+
+        std::vector<std::coroutine_handle<>> waiting;
+    };
+
+    typedef lsm::basic_state<lsm::async_policy<>::callables> async_state;
+}
+
+TEST(async_machine_test, notify_async_awaits_handlers_in_order) {
+    pending_io io;
+    std::string trace;
+
+    const async_state idle = async_state().on_leave([&]() -> lsm::task<> { trace += "<"; co_await io.wait(); trace += ">"; }),
+                      sending = async_state().on_enter([&]() { trace += "+"; });
+
+    lsm::async_machine<char> sm;
+    sm << idle
+       << (idle | sending) ['s'] / [&]() -> lsm::task<> { trace += "("; co_await io.wait(); trace += ")"; } / [&]() { trace += "!"; };
+
+    lsm::task<> started = sm.start_async();
+    started.start();
+    EXPECT_TRUE(started.done());
+
+    lsm::task<> sent = sm.notify_async('s');
+    sent.start();
+    EXPECT_TRUE(sm.is_in(sending));
+    EXPECT_TRUE(sm.is_busy());
+    EXPECT_EQ(trace, "<");
+
+    io.complete_one();
+    EXPECT_EQ(trace, "<>(");
+    EXPECT_FALSE(sent.done());
+
+    // The synchronous handlers left were deferred behind the pending one
+    io.complete_one();
+    EXPECT_EQ(trace, "<>()!+");
+    EXPECT_TRUE(sent.done());
+    EXPECT_FALSE(sm.is_busy());
+}
+
+TEST(async_machine_test, machines_interleave_and_notifications_queue) {
+    pending_io io;
+    int exchanges = 0;
+
+    auto request = [&]() -> lsm::task<> { co_await io.wait(); exchanges++; };
+    const async_state idle, busy;
+
+    lsm::async_machine<char> a, b;
+    for (auto *sm : { &a, &b })
+    {
+        *sm << idle
+            << (idle | busy) ['r'] / request
+            << (busy | idle) ['r'] / request;
+        sm->finalize();
+        lsm::task<> started = sm->start_async();
+        started.start();
+    }
+
+    // Both machines are waiting on I/O from the same thread
+    lsm::task<> a1 = a.notify_async('r'), a2 = a.notify_async('r'), b1 = b.notify_async('r');
+    a1.start();
+    a2.start();
+    b1.start();
+    EXPECT_EQ(io.waiting.size(), 2u);
+    EXPECT_TRUE(a.is_in(busy));
+    EXPECT_TRUE(b.is_in(busy));
+
+    // a's second notification takes its turn once the first one is over
+    io.complete_one();
+    EXPECT_TRUE(a1.done());
+    EXPECT_FALSE(a2.done());
+    EXPECT_TRUE(a.is_in(idle));
+
+    io.complete_one();
+    io.complete_one();
+    EXPECT_TRUE(a2.done());
+    EXPECT_TRUE(b1.done());
+    EXPECT_EQ(exchanges, 3);
+}
+
+TEST(async_machine_test, long_queues_hand_over_without_recursing) {
+    pending_io io;
+    int handled = 0;
+    const async_state idle, busy;
+
+    lsm::async_machine<char> sm;
+    sm << idle
+       << (idle | busy) ['r'] / [&]() -> lsm::task<> { co_await io.wait(); }
+       << (busy | busy) ['s'] / [&handled]() { handled++; };
+    lsm::task<> started = sm.start_async();
+    started.start();
+
+    lsm::task<> pending = sm.notify_async('r');
+    pending.start();
+
+    // Enough to overflow the stack if each turn resumed the next one from its own frame
+    const int queued_count = 100000;
+    std::vector<lsm::task<>> queued;
+    queued.reserve(queued_count);
+    for (int i = 0; i < queued_count; ++i)
+    {
+        queued.push_back(sm.notify_async('s'));
+        queued.back().start();
+    }
+    EXPECT_EQ(handled, 0);
+
+    io.complete_one();
+    EXPECT_EQ(handled, queued_count);
+    EXPECT_TRUE(pending.done());
+    EXPECT_TRUE(queued.back().done());
+    EXPECT_FALSE(sm.is_busy());
+}
+
+TEST(async_machine_test, awaited_from_a_coroutine_with_payload) {
+    struct frame { int length; };
+    typedef lsm::async_policy<lsm::payload_policy<frame>> policy;
+    typedef lsm::basic_state<policy::callables> state;
+
+    pending_io io;
+    int received = 0;
+
+    const state idle, reading;
+    lsm::async_machine<char, policy> sm;
+    sm << idle
+       << (idle    | reading) ['f'] / [&](const frame &f) -> lsm::task<> { co_await io.wait(); received += f.length; }
+       << (reading | idle)    ['f'] ([](const frame &f) { return f.length == 0; });
+
+    auto session = [&]() -> lsm::task<int>
+    {
+        co_await sm.start_async(frame{ 0 });
+        const frame first{ 40 }, last{ 0 };
+        co_await sm.notify_async('f', first);
+        co_await sm.notify_async('f', last);
+        co_return received;
+    };
+
+    lsm::task<int> t = session();
+    t.start();
+    EXPECT_FALSE(t.done());
+    io.complete_one();
+    ASSERT_TRUE(t.done());
+    EXPECT_EQ(t.get(), 40);
+    EXPECT_TRUE(sm.is_in(idle));
+}
+
+TEST(async_machine_test, exceptions_reach_the_awaiter) {
+    const async_state idle, failed;
+    lsm::async_machine<char> sm;
+    sm << idle << (idle | failed) ['x'] / []() -> lsm::task<> { throw std::runtime_error("io error"); co_return; };
+
+    lsm::task<> started = sm.start_async();
+    started.start();
+    lsm::task<> t = sm.notify_async('x');
+    t.start();
+    ASSERT_TRUE(t.done());
+    EXPECT_THROW(t.get(), std::runtime_error);
+
+    // The machine is released all the same
+    EXPECT_FALSE(sm.is_busy());
+    EXPECT_TRUE(sm.is_in(failed));
+}
+
+#else
+
+#include <iostream>
+
+// Without coroutine support the async tests cannot be built; report that as a
+// skipped test rather than silently running none of them.
+TEST(async_machine_test, requires_coroutines) {
+#if defined(GTEST_SKIP)
+    GTEST_SKIP() << "async_machine tests need C++20 coroutines";
+#else
+    std::cout << "[  SKIPPED ] async_machine tests need C++20 coroutines" << std::endl;
+#endif
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/compiled_definition.h"
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    enum class Event : std::uint32_t { connect = 1, data = 2, hang_up = 3 };
+
+    // idle --connect--> connected --data [authorized]--> connected, --data--> rejected, --hang_up--> idle
+    std::vector<unsigned char> compile_phone()
+    {
+        lsm::definition_compiler compiler;
+        const lsm::state_id idle = compiler.add_state(),
+                            connected = compiler.add_state("greet", "hang_up_line"),
+                            rejected = compiler.add_state("log");
+        compiler.add_transition(connected, idle, static_cast<std::uint32_t>(Event::hang_up));
+        compiler.add_transition(idle, connected, static_cast<std::uint32_t>(Event::connect), {}, { "log" });
+        compiler.add_transition(connected, connected, static_cast<std::uint32_t>(Event::data), "authorized", { "store", "log" });
+        compiler.add_transition(connected, rejected, static_cast<std::uint32_t>(Event::data));
+        return compiler.compile();
+    }
+}
+
+TEST(compiled_definition_test, runs_from_the_image) {
+    const std::vector<unsigned char> image = compile_phone();
+
+    std::string trace;
+    bool authorized = true;
+    lsm::callback_registry registry;
+    registry.add_guard("authorized", [&authorized]() { return authorized; })
+            .add_action("greet", [&trace]() { trace += "g"; })
+            .add_action("hang_up_line", [&trace]() { trace += "h"; })
+            .add_action("store", [&trace]() { trace += "s"; })
+            .add_action("log", [&trace]() { trace += "l"; });
+
+    lsm::compiled_definition<Event> definition;
+    ASSERT_TRUE(definition.load(image.data(), image.size()));
+    ASSERT_TRUE(definition.bind(registry));
+    EXPECT_EQ(definition.state_count(), 3u);
+    EXPECT_EQ(definition.transition_count(), 4u);
+
+    lsm::machine_instance instance;
+    definition.start(instance);
+    EXPECT_EQ(instance.current_state, 0u);
+
+    EXPECT_TRUE(definition.notify(instance, Event::connect));
+    EXPECT_EQ(trace, "lg");
+
+    // Actions in order, then the guard refusing falls through to the next transition for the event
+    trace.clear();
+    EXPECT_TRUE(definition.notify(instance, Event::data));
+    EXPECT_EQ(trace, "hslg");
+    authorized = false;
+    EXPECT_TRUE(definition.notify(instance, Event::data));
+    EXPECT_EQ(instance.current_state, 2u);
+
+    EXPECT_FALSE(definition.notify(instance, Event::hang_up));
+    definition.stop(instance);
+    EXPECT_FALSE(instance.is_running);
+}
+
+TEST(compiled_definition_test, image_is_position_independent) {
+    const std::vector<unsigned char> image = compile_phone();
+
+    // What a mapped file would be: the same bytes at another, unaligned, address
+    std::vector<unsigned char> moved(image.size() + 1);
+    std::memcpy(moved.data() + 1, image.data(), image.size());
+
+    lsm::callback_registry registry;
+    for (const char *name : { "greet", "hang_up_line", "store", "log" }) registry.add_action(name, []() {});
+    registry.add_guard("authorized", []() { return false; });
+
+    lsm::compiled_definition<Event> definition;
+    ASSERT_TRUE(definition.load(moved.data() + 1, image.size()));
+    ASSERT_TRUE(definition.bind(registry));
+
+    lsm::machine_instance instance;
+    definition.start(instance);
+    definition.notify(instance, Event::connect);
+    definition.notify(instance, Event::data);
+    EXPECT_EQ(instance.current_state, 2u);
+}
+
+TEST(compiled_definition_test, missing_callbacks_are_reported) {
+    const std::vector<unsigned char> image = compile_phone();
+
+    lsm::callback_registry registry;
+    registry.add_action("greet", []() {}).add_action("hang_up_line", []() {}).add_action("log", []() {}).add_action("store", []() {});
+    // Registered as an action, but used as a guard
+    registry.add_action("authorized", []() {});
+
+    lsm::compiled_definition<Event> definition;
+    ASSERT_TRUE(definition.load(image.data(), image.size()));
+    std::string_view missing;
+    EXPECT_FALSE(definition.bind(registry, &missing));
+    EXPECT_EQ(missing, "authorized");
+    EXPECT_FALSE(definition.is_bound());
+}
+
+TEST(compiled_definition_test, malformed_images_are_rejected) {
+    const std::vector<unsigned char> image = compile_phone();
+    lsm::compiled_definition<Event> definition;
+
+    EXPECT_FALSE(definition.load(image.data(), image.size() - 4));
+    EXPECT_FALSE(definition.load(image.data(), 16));
+
+    std::vector<unsigned char> corrupted = image;
+    corrupted[4] = 2;
+    EXPECT_FALSE(definition.load(corrupted.data(), corrupted.size()));
+
+    // The first target points past the states
+    corrupted = image;
+    const std::size_t targets = 8 + 3 * 3 + 1 + 4;
+    corrupted[4 * targets] = 7;
+    EXPECT_FALSE(definition.load(corrupted.data(), corrupted.size()));
+    EXPECT_FALSE(definition.is_loaded());
+
+    EXPECT_TRUE(definition.load(image.data(), image.size()));
+}
@@ -0,0 +1,75 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/concurrent_machine.h"
+
+namespace lsm = lightweight_state_machine;
+
+TEST(concurrent_machine_test, mpsc_queue_is_bounded) {
+    lsm::mpsc_queue<int> q(3);
+    EXPECT_EQ(q.capacity(), 4u);
+
+    for (int i = 0; i < 4; ++i) EXPECT_TRUE(q.try_push(i));
+    EXPECT_FALSE(q.try_push(4));
+
+    int value = -1;
+    for (int i = 0; i < 4; ++i)
+    {
+        EXPECT_TRUE(q.try_pop(value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_FALSE(q.try_pop(value));
+}
+
+TEST(concurrent_machine_test, many_producers_single_owner) {
+    const int producers_count = 4,
+              events_per_producer = 20000;
+    int key_count = 0;
+
+    const lsm::state idle = lsm::state();
+
+    lsm::concurrent_machine<char> sm(256);
+    sm << idle
+       << (idle | idle) ['k'] / [&key_count]() { key_count++; };
+
+    std::mutex mutex;
+    std::condition_variable woken;
+    bool wakeup = false;
+    sm.on_wakeup([&]()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup = true;
+        woken.notify_one();
+    });
+
+    sm.start();
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producers_count; ++p)
+    {
+        producers.emplace_back([&sm]()
+        {
+            for (int i = 0; i < events_per_producer; ++i)
+            {
+                while (!sm.post('k')) std::this_thread::yield();
+            }
+        });
+    }
+
+    const int expected = producers_count * events_per_producer;
+    int drained = 0;
+    while (drained < expected)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // Untimed: a lost wakeup hangs the test instead of going unnoticed.
+            woken.wait(lock, [&wakeup]() { return wakeup; });
+            wakeup = false;
+        }
+        drained += static_cast<int>(sm.drain());
+    }
+
+    for (auto &p : producers) p.join();
+
+    EXPECT_EQ(drained, expected);
+    EXPECT_EQ(key_count, expected);
+}
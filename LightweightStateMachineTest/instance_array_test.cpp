@@ -0,0 +1,114 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/instance_array.h"
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    enum class Event { tick, shutdown, fault };
+}
+
+TEST(instance_array_test, broadcast_matches_single_instances) {
+    int faults = 0;
+    const lsm::state idle, sampling, reporting, off, failed = lsm::state().on_enter([&faults]() { faults++; });
+
+    lsm::machine_definition<Event> definition;
+    definition << idle
+               << (idle      | sampling)  [Event::tick]
+               << (sampling  | reporting) [Event::tick]
+               << (reporting | idle)      [Event::tick]
+               << (idle      | off)       [Event::shutdown]
+               << (sampling  | off)       [Event::shutdown]
+               << (sampling  | failed)    [Event::fault];
+    definition.finalize();
+
+    // Uneven count, so that the vector loop has a tail
+    const std::size_t count = 37;
+    lsm::instance_array<lsm::machine_definition<Event>> fleet(definition, count);
+    std::vector<lsm::machine_instance> reference(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (i % 9 == 4) continue;   // a few stay stopped
+        fleet.start(i);
+        definition.start(reference[i]);
+    }
+    // Spread the fleet over the states
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        for (std::size_t n = 0; n < i % 3; ++n)
+        {
+            fleet.notify(i, Event::tick);
+            definition.notify(reference[i], Event::tick);
+        }
+    }
+
+    auto expect_same = [&]()
+    {
+        for (std::size_t i = 0; i < count; ++i) ASSERT_EQ(fleet.current_state(i), reference[i].current_state) << i;
+    };
+
+    for (Event e : { Event::tick, Event::fault, Event::tick, Event::shutdown })
+    {
+        fleet.notify_all(e);
+        for (auto &r : reference) definition.notify(r, e);
+        expect_same();
+    }
+    // The faults went through the dispatch, entered callbacks included
+    EXPECT_EQ(faults, 2 * static_cast<int>(std::count(fleet.data(), fleet.data() + count, definition.id_of(failed))));
+}
+
+TEST(instance_array_test, notify_listed_instances) {
+    const lsm::state a, b, c;
+    int actions = 0;
+
+    lsm::machine_definition<char> definition;
+    definition << a
+               << (a | b) ['n']
+               << (b | c) ['n'] / [&actions]() { actions++; }
+               << (c | a) ['n'] ([]() { return true; });
+    definition.finalize();
+
+    lsm::instance_array<lsm::machine_definition<char>> fleet(definition, 100);
+    fleet.start_all();
+
+    std::vector<std::uint32_t> odd;
+    for (std::uint32_t i = 1; i < 100; i += 2) odd.push_back(i);
+    for (int round = 0; round < 3; ++round)
+    {
+        fleet.notify_each(odd.data(), odd.size(), 'n');
+    }
+    for (std::size_t i = 0; i < 100; ++i)
+    {
+        EXPECT_EQ(fleet.current_state(i), definition.id_of(a));
+    }
+    EXPECT_EQ(actions, 50);
+
+    fleet.notify_each(odd.data(), 10, 'n');
+    EXPECT_EQ(fleet.current_state(odd[9]), definition.id_of(b));
+    EXPECT_EQ(fleet.current_state(odd[10]), definition.id_of(a));
+}
+
+TEST(instance_array_test, columns_follow_reorder) {
+    const lsm::state idle, sampling, reporting;
+
+    lsm::machine_definition<Event> definition;
+    definition << idle
+               << (idle      | sampling)  [Event::tick]
+               << (idle      | reporting) [Event::tick] ([]() { return true; })
+               << (sampling  | idle)      [Event::shutdown]
+               << (reporting | idle)      [Event::shutdown];
+    definition.finalize();
+
+    lsm::instance_array<lsm::machine_definition<Event>> fleet(definition, 10);
+    fleet.start_all();
+    fleet.notify_all(Event::tick);
+    EXPECT_EQ(fleet.current_state(0), definition.id_of(sampling));
+    fleet.notify_all(Event::shutdown);
+
+    // The guarded transition is tried first from now on, and accepts
+    const lsm::state_id reporting_id = definition.id_of(reporting);
+    definition.reorder([&definition, reporting_id](std::size_t t) { return definition.transition_target(t) == reporting_id ? 10 : 1; });
+    fleet.notify_all(Event::tick);
+    for (std::size_t i = 0; i < fleet.size(); ++i) EXPECT_EQ(fleet.current_state(i), reporting_id) << i;
+}
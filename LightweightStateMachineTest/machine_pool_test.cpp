@@ -0,0 +1,105 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/machine_pool.h"
+
+namespace lsm = lightweight_state_machine;
+
+TEST(machine_pool_test, sessions_start_and_stop_on_workers) {
+    std::atomic<int> enter_count(0);
+
+    lsm::state idle = lsm::state(),
+               busy = lsm::state();
+    busy.on_enter([&enter_count]() { enter_count++; });
+
+    lsm::machine_definition<char> definition;
+    definition << idle
+               << (idle | busy) ['g']
+               << (busy | idle) ['s'];
+    definition.finalize();
+
+    lsm::machine_pool<char> pool(definition, 2, 8);
+    EXPECT_EQ(pool.worker_count(), 2u);
+
+    auto *a = pool.add_session(1),
+         *b = pool.add_session(2);
+    EXPECT_EQ(b->id(), 2u);
+
+    EXPECT_TRUE(pool.post(a, 'g'));
+    pool.wait_idle();
+
+    EXPECT_TRUE(a->instance().is_running);
+    EXPECT_TRUE(b->instance().is_running);
+    EXPECT_NE(a->instance().current_state, b->instance().current_state);
+    EXPECT_EQ(enter_count, 1);
+
+    pool.post(b, 'g');
+    pool.stop_session(b);
+    pool.wait_idle();
+
+    EXPECT_TRUE(a->instance().is_running);
+    EXPECT_FALSE(b->instance().is_running);
+    EXPECT_EQ(enter_count, 2);
+}
+
+TEST(machine_pool_test, every_session_runs_on_one_worker_at_a_time) {
+    const int session_count = 64,
+              producers_count = 2,
+              events_per_session = 2000;
+
+    // Deliberately not atomic: two workers driving the same session at once would lose increments.
+    std::vector<int> counts(session_count, 0);
+
+    const lsm::state idle = lsm::state();
+
+    lsm::machine_definition<int> definition;
+    definition << idle;
+    for (int i = 0; i < session_count; ++i) definition << (idle | idle) [i] / [&counts, i]() { counts[i]++; };
+    definition.finalize();
+
+    lsm::machine_pool<int> pool(definition, 4, session_count, 16);
+
+    std::vector<lsm::machine_pool<int>::session*> sessions;
+    for (int i = 0; i < session_count; ++i) sessions.push_back(pool.add_session(1000 + i));
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producers_count; ++p)
+    {
+        producers.emplace_back([&pool, &sessions]()
+        {
+            for (int n = 0; n < events_per_session; ++n)
+            {
+                for (int i = 0; i < session_count; ++i)
+                {
+                    while (!pool.post(sessions[i], i)) std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    for (auto &p : producers) p.join();
+    pool.wait_idle();
+
+    for (int i = 0; i < session_count; ++i) EXPECT_EQ(counts[i], producers_count * events_per_session);
+}
+
+TEST(machine_pool_test, full_pool_refuses_sessions) {
+    const lsm::state idle = lsm::state(), busy = lsm::state();
+
+    lsm::machine_definition<char> definition;
+    definition << idle
+               << (idle | busy) ['g'];
+    definition.finalize();
+
+    lsm::machine_pool<char> pool(definition, 2, 3);
+    std::vector<lsm::machine_pool<char>::session*> sessions;
+    for (std::uint64_t id = 0; id < 3; ++id) sessions.push_back(pool.add_session(id));
+    EXPECT_EQ(pool.add_session(3), nullptr);
+
+    // Those added still run
+    pool.wait_idle();
+    for (auto *s : sessions)
+    {
+        ASSERT_NE(s, nullptr);
+        EXPECT_TRUE(s->instance().is_running);
+    }
+}
@@ -5,7 +5,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "gtest/gtest.h"
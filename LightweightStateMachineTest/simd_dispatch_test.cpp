@@ -0,0 +1,83 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/simd_dispatch.h"
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    std::uint32_t message_code(int i) { return (static_cast<std::uint32_t>(i) + 1) * 0x9E3779B1u; }
+}
+
+TEST(simd_dispatch_test, find_key) {
+    std::vector<std::uint32_t> keys;
+    for (std::uint32_t n = 0; n < 40; ++n)
+    {
+        // Every position of every length, through the vector loop and the scalar tail
+        for (std::uint32_t i = 0; i < n; ++i) EXPECT_EQ(lsm::details::find_key(keys.data(), n, keys[i]), i);
+        EXPECT_EQ(lsm::details::find_key(keys.data(), n, 7), n);
+        keys.push_back(n * 3 + 8);
+    }
+    const std::uint32_t high[] = { 0, 0x80000000u, 0xFFFFFFFFu, 1 };
+    EXPECT_EQ(lsm::details::find_key(high, 4, 0xFFFFFFFFu), 2u);
+}
+
+TEST(simd_dispatch_test, matches_indexed_dispatch) {
+    // Routing states with 40 to 200 codes each, some codes shared by guarded transitions
+    const int state_count = 4, codes_per_state[state_count] = { 40, 200, 1, 77 };
+    std::vector<lsm::state> states(state_count);
+    int simd_fired = 0, indexed_fired = 0;
+
+    lsm::machine<std::uint32_t, lsm::simd_dispatch_policy<>> simd;
+    lsm::machine<std::uint32_t> indexed;
+    auto build = [&](auto &sm, int &fired)
+    {
+        sm << states[0];
+        for (int s = 0; s < state_count; ++s)
+        {
+            for (int i = 0; i < codes_per_state[s]; ++i)
+            {
+                const lsm::state &to = states[(s + i) % state_count];
+                sm << (states[s] | to) [message_code(i * (s + 1))] ([i]() { return i % 3 != 0; }) / [&fired, i]() { fired += i; };
+                if (i % 5 == 0) sm << (states[s] | states[s]) [message_code(i * (s + 1))];
+            }
+        }
+    };
+    build(simd, simd_fired);
+    build(indexed, indexed_fired);
+    simd.finalize();
+    EXPECT_TRUE(simd.is_finalized());
+
+    simd.start();
+    indexed.start();
+    std::mt19937 random(42);
+    for (int n = 0; n < 5000; ++n)
+    {
+        const std::uint32_t code = n % 7 == 0 ? static_cast<std::uint32_t>(random()) : message_code(static_cast<int>(random() % 800));
+        indexed.notify(code);
+        simd.notify(code);
+        ASSERT_EQ(simd_fired, indexed_fired);
+        ASSERT_EQ(simd.instance().current_state, indexed.instance().current_state);
+    }
+}
+
+TEST(simd_dispatch_test, nested_states) {
+    enum class message : std::int16_t { ping = -3, data = 1000, bye = 7 };
+    const lsm::state session, idle, busy, closed;
+
+    lsm::machine<message, lsm::simd_dispatch_policy<>> sm;
+    sm << session
+       << lsm::nest(session, idle, busy)
+       << (idle    | busy)   [message::data]
+       << (busy    | idle)   [message::ping]
+       << (session | closed) [message::bye];
+    sm.finalize();
+    sm.start();
+
+    sm.notify(message::data);
+    EXPECT_TRUE(sm.is_in(busy));
+    sm.notify(message::ping);
+    EXPECT_TRUE(sm.is_in(idle));
+    sm.notify(message::bye);
+    EXPECT_TRUE(sm.is_in(closed));
+}
@@ -0,0 +1,112 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/static_machine.h"
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    enum class Event { byte, end_of_frame, reset };
+
+    struct idle {};
+    struct in_frame
+    {
+        void on_enter() { entered_count++; }
+        void on_leave() { left_count++; }
+
+        int entered_count = 0,
+            left_count    = 0;
+    };
+    struct done {};
+}
+
+TEST(static_machine_test, external_transition) {
+    auto sm = lsm::make_static_machine(lsm::state_c<idle>,
+                  (lsm::state_c<idle>     | lsm::state_c<in_frame>) [lsm::event_c<Event::byte>],
+                  (lsm::state_c<in_frame> | lsm::state_c<done>)     [lsm::event_c<Event::end_of_frame>]);
+
+    sm.start();
+    EXPECT_TRUE(sm.is_in<idle>());
+
+    sm.notify(Event::byte);
+    EXPECT_TRUE(sm.is_in<in_frame>());
+    EXPECT_EQ(sm.get_state<in_frame>().entered_count, 1);
+
+    // No transition for this event from in_frame
+    sm.notify(Event::reset);
+    EXPECT_TRUE(sm.is_in<in_frame>());
+
+    sm.notify(Event::end_of_frame);
+    EXPECT_TRUE(sm.is_in<done>());
+    EXPECT_EQ(sm.get_state<in_frame>().left_count, 1);
+}
+
+TEST(static_machine_test, guards_and_actions) {
+    int remaining_bytes = 3,
+        bytes_read      = 0;
+
+    auto bytes_remaining = [&remaining_bytes]() { return remaining_bytes > 0; };
+    auto frame_complete  = [&remaining_bytes]() { return remaining_bytes == 0; };
+
+    auto sm = lsm::make_static_machine(lsm::state_c<idle>,
+                  (lsm::state_c<idle>     | lsm::state_c<in_frame>) [lsm::event_c<Event::byte>],
+                  (lsm::state_c<in_frame> | lsm::state_c<in_frame>) [lsm::event_c<Event::byte>] (bytes_remaining)
+                                                                        / [&remaining_bytes]() { remaining_bytes--; }
+                                                                        / [&bytes_read]() { bytes_read++; },
+                  (lsm::state_c<in_frame> | lsm::state_c<done>)     [lsm::event_c<Event::byte>] (frame_complete));
+
+    sm.start();
+    for (int i = 0; i < 5; ++i) sm.notify(Event::byte);
+
+    EXPECT_TRUE(sm.is_in<done>());
+    EXPECT_EQ(bytes_read, 3);
+    EXPECT_EQ(sm.get_state<in_frame>().entered_count, 4);
+}
+
+TEST(static_machine_test, stop_leaves_current_state) {
+    auto sm = lsm::make_static_machine(lsm::state_c<idle>,
+                  (lsm::state_c<idle> | lsm::state_c<in_frame>) [lsm::event_c<Event::byte>]);
+
+    sm.start();
+    sm.notify(Event::byte);
+    sm.stop();
+
+    EXPECT_TRUE(sm.is_stopped());
+    EXPECT_EQ(sm.get_state<in_frame>().left_count, 1);
+}
+
+TEST(static_machine_test, stopped_machine_ignores_events) {
+    auto sm = lsm::make_static_machine(lsm::state_c<idle>,
+                  (lsm::state_c<idle>     | lsm::state_c<in_frame>) [lsm::event_c<Event::byte>],
+                  (lsm::state_c<in_frame> | lsm::state_c<idle>)     [lsm::event_c<Event::reset>]);
+
+    // Before start()
+    sm.notify(Event::byte);
+    EXPECT_FALSE(sm.is_in<in_frame>());
+    EXPECT_EQ(sm.get_state<in_frame>().entered_count, 0);
+
+    sm.start();
+    sm.notify(Event::byte);
+    sm.stop();
+    EXPECT_EQ(sm.get_state<in_frame>().left_count, 1);
+
+    // After stop()
+    sm.notify(Event::reset);
+    sm.notify(Event::byte);
+    EXPECT_TRUE(sm.is_stopped());
+    EXPECT_EQ(sm.get_state<in_frame>().entered_count, 1);
+    EXPECT_EQ(sm.get_state<in_frame>().left_count, 1);
+}
+
+TEST(static_machine_test, stateless_definition_is_constexpr) {
+    constexpr auto sm = lsm::make_static_machine(lsm::state_c<idle>,
+                            (lsm::state_c<idle> | lsm::state_c<done>) [lsm::event_c<Event::reset>] ([]() { return true; }));
+
+    static_assert(decltype(sm)::state_count == 2, "idle and done");
+    static_assert(std::is_trivially_destructible_v<std::decay_t<decltype(sm)>>, "No runtime table to own");
+
+    auto copy = sm;
+    copy.start();
+    copy.notify(Event::reset);
+    EXPECT_TRUE(copy.is_in<done>());
+}
@@ -0,0 +1,155 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/stats_observer.h"
+
+namespace lsm = lightweight_state_machine;
+
+TEST(stats_observer_test, histogram_buckets) {
+    EXPECT_EQ(lsm::latency_histogram::bucket_of(0), 0u);
+    EXPECT_EQ(lsm::latency_histogram::bucket_of(1), 1u);
+    EXPECT_EQ(lsm::latency_histogram::bucket_of(3), 2u);
+    EXPECT_EQ(lsm::latency_histogram::bucket_of(1024), 11u);
+    EXPECT_EQ(lsm::latency_histogram::bucket_of(~std::uint64_t(0)), lsm::latency_histogram::bucket_count - 1);
+
+    lsm::latency_histogram h;
+    EXPECT_EQ(h.percentile(0.5), 0u);
+    h.buckets[2] = 9;
+    h.buckets[11] = 1;
+    EXPECT_EQ(h.count(), 10u);
+    EXPECT_EQ(h.percentile(0.5), 4u);
+    EXPECT_EQ(h.percentile(1.0), 2048u);
+}
+
+TEST(stats_observer_test, counts_states_and_transitions) {
+    typedef lsm::observer_policy<lsm::stats_observer> policy;
+
+    bool allowed = false;
+    const lsm::state idle = lsm::state(),
+                     busy = lsm::state().on_enter([]() { std::this_thread::sleep_for(std::chrono::milliseconds(2)); });
+
+    lsm::machine<char, policy> sm;
+    sm << idle
+       << (idle | busy) ['g'] ([&allowed]() { return allowed; })
+       << (busy | idle) ['s'];
+    sm.finalize();
+
+    sm.start();
+    sm.notify('g');
+    sm.notify('x');
+    allowed = true;
+    sm.notify('g');
+    sm.notify('s');
+
+    const lsm::machine_stats stats = sm.observer().snapshot();
+    EXPECT_EQ(stats.dispatched, 4u);
+    EXPECT_EQ(stats.unmatched, 1u);
+    EXPECT_EQ(stats.dispatch_time.count(), 4u);
+
+    ASSERT_EQ(stats.states.size(), 2u);
+    const std::uint32_t idle_index = sm.instance().current_state;
+    const auto &idle_stats = stats.states[idle_index],
+               &busy_stats = stats.states[1 - idle_index];
+    EXPECT_EQ(idle_stats.entries, 2u);
+    EXPECT_EQ(busy_stats.entries, 1u);
+    EXPECT_EQ(busy_stats.leave_time.count(), 1u);
+    // 2ms and more land in buckets ending at 2^21ns or beyond
+    EXPECT_GE(busy_stats.enter_time.percentile(0.5), std::uint64_t(1) << 21);
+
+    ASSERT_EQ(stats.transitions.size(), 2u);
+    std::uint64_t fired = 0;
+    bool found_guarded = false;
+    for (const auto &t : stats.transitions)
+    {
+        fired += t.fired;
+        EXPECT_EQ(t.action_time.count(), t.fired);
+        if (t.guard_rejections != 0)
+        {
+            found_guarded = true;
+            EXPECT_EQ(t.guard_evaluations, 2u);
+            EXPECT_DOUBLE_EQ(t.rejection_rate(), 0.5);
+        }
+    }
+    EXPECT_EQ(fired, 2u);
+    EXPECT_TRUE(found_guarded);
+}
+
+TEST(stats_observer_test, snapshot_while_dispatching) {
+    typedef lsm::observer_policy<lsm::stats_observer> policy;
+    const int events_count = 20000;
+
+    const lsm::state idle = lsm::state();
+
+    lsm::machine<std::string, policy> sm;
+    sm << idle
+       << (idle | idle) [std::string("tick")];
+    // Never finalized, so counters are sized by hand.
+    sm.observer().resize(sm.definition().state_count(), sm.definition().transition_count());
+
+    std::atomic<bool> done(false);
+    std::thread dispatcher([&]()
+    {
+        sm.start();
+        for (int i = 0; i < events_count; ++i) sm.notify("tick");
+        done = true;
+    });
+
+    std::uint64_t last = 0;
+    while (!done)
+    {
+        const std::uint64_t dispatched = sm.observer().snapshot().dispatched;
+        EXPECT_GE(dispatched, last);
+        last = dispatched;
+    }
+    dispatcher.join();
+
+    const lsm::machine_stats stats = sm.observer().snapshot();
+    EXPECT_EQ(stats.dispatched, static_cast<std::uint64_t>(events_count));
+    EXPECT_EQ(stats.transitions[0].fired, static_cast<std::uint64_t>(events_count));
+    EXPECT_EQ(stats.states[0].entries, static_cast<std::uint64_t>(events_count) + 1);
+}
+
+TEST(stats_observer_test, counters_follow_reorder) {
+    typedef lsm::observer_policy<lsm::stats_observer> policy;
+
+    int level = 0;
+    const lsm::state init, a, b;
+
+    lsm::machine<char, policy> sm;
+    sm << init
+       << (init | a) ['q'] ([&level]() { return level == 0; })
+       << (init | b) ['q'] ([&level]() { return level == 1; })
+       << (a | init) ['r']
+       << (b | init) ['r'];
+    sm.finalize();
+
+    auto fired_into = [&sm](const lsm::state &target)
+    {
+        const lsm::machine_stats stats = sm.observer().snapshot();
+        for (std::size_t t = 0; t < stats.transitions.size(); ++t)
+        {
+            if (sm.definition().transition_target(t) == sm.definition().id_of(target)) return stats.transitions[t].fired;
+        }
+        return std::uint64_t(0);
+    };
+
+    sm.start();
+    level = 1;
+    for (int i = 0; i < 3; ++i)
+    {
+        sm.notify('q');
+        sm.notify('r');
+    }
+    EXPECT_EQ(fired_into(b), 3u);
+
+    // Fed back as weights: b moves first, and its count with it
+    const lsm::machine_stats before = sm.observer().snapshot();
+    sm.reorder([&before](std::size_t t) { return before.transitions[t].fired; });
+    EXPECT_EQ(sm.definition().transition_target(0), sm.definition().id_of(b));
+    EXPECT_EQ(fired_into(b), 3u);
+    EXPECT_EQ(fired_into(a), 0u);
+
+    level = 0;
+    sm.notify('q');
+    EXPECT_EQ(fired_into(a), 1u);
+    EXPECT_EQ(fired_into(b), 3u);
+}
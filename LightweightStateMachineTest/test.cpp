@@ -1,6 +1,7 @@
 #include "pch.h"
 
 #include "../LightweightStateMachine/lightweight_state_machine.h"
+#include "../LightweightStateMachine/simd_dispatch.h"
 #include "test.h"
 
 namespace lsm = lightweight_state_machine;
@@ -226,3 +227,1592 @@ TEST(lightweight_state_machine_test, multi_state_with_guards_tests) {
     EXPECT_EQ(remaining_keys_count, 0);
     EXPECT_TRUE(is_broken);
 }
+
+TEST(lightweight_state_machine_test, finalized_shared_trigger) {
+    bool invalid_final_state = false,
+         valid_final_state = false;
+
+    const lsm::state init          = lsm::state(),
+                     final_invalid = lsm::state().on_enter([&invalid_final_state]() { invalid_final_state = true; }),
+                     final_valid   = lsm::state().on_enter([&valid_final_state]  () { valid_final_state   = true; });
+
+    lsm::machine<char> sm;
+    sm << init
+       << (init | final_invalid) ['q'] ([]() { return false; })
+       << (init | final_valid)   ['q'] ([]() { return true ; });
+    sm.finalize();
+
+    sm.start();
+    sm.notify('q');
+
+    EXPECT_TRUE(sm.is_finalized());
+    EXPECT_TRUE(valid_final_state);
+    EXPECT_FALSE(invalid_final_state);
+}
+
+TEST(lightweight_state_machine_test, finalized_ignores_unknown_events) {
+    int entered_count = 0;
+
+    const lsm::state init  = lsm::state(),
+                     final = lsm::state().on_enter([&entered_count]() { entered_count++; });
+
+    lsm::machine<char> sm;
+    sm << init
+       << (init  | final) ['b']
+       << (final | init)  ['c'];
+    sm.finalize();
+
+    sm.start();
+    sm.notify('a'); // below the table
+    sm.notify('z'); // above the table
+    sm.notify('c'); // known event, no transition from init
+    EXPECT_EQ(entered_count, 0);
+
+    sm.notify('b');
+    EXPECT_EQ(entered_count, 1);
+}
+
+TEST(lightweight_state_machine_test, finalized_sparse_event_codes) {
+    const lsm::state init, other;
+
+    // Far too sparse for a dense table, found by hash instead
+    lsm::machine<std::uint64_t> sm;
+    sm << init
+       << (init  | other) [std::uint64_t(1)]
+       << (other | init)  [std::uint64_t(1) << 40]
+       << (other | other) [~std::uint64_t(0)];
+    sm.finalize();
+    EXPECT_TRUE(sm.is_finalized());
+
+    sm.start();
+    sm.notify(std::uint64_t(1) << 40);
+    EXPECT_TRUE(sm.is_in(init));
+    sm.notify(1);
+    EXPECT_TRUE(sm.is_in(other));
+    sm.notify(~std::uint64_t(0));
+    sm.notify(2);
+    EXPECT_TRUE(sm.is_in(other));
+    sm.notify(std::uint64_t(1) << 40);
+    EXPECT_TRUE(sm.is_in(init));
+
+    lsm::machine<std::uint32_t> codes;
+    codes << init
+          << (init  | other) [400000000u]
+          << (other | init)  [7u]
+          << lsm::defer(init, 7u);
+    codes.finalize();
+    codes.start();
+    codes.notify(7u);
+    EXPECT_EQ(codes.deferred_count(), 1u);
+    codes.notify(400000000u);
+    EXPECT_TRUE(codes.is_in(init));
+    EXPECT_EQ(codes.deferred_count(), 0u);
+}
+
+TEST(lightweight_state_machine_test, finalized_multi_state_with_guards) {
+    enum class Event { key_pressed, caps_lock_pressed };
+    unsigned int remaining_keys_count = 10;
+    bool is_broken = false;
+
+    lsm::machine<Event> sm;
+
+    const lsm::state standard    = lsm::state(),
+                     caps_locked = lsm::state(),
+                     broken      = lsm::state().on_enter([&is_broken, &sm]() { is_broken = true; sm.stop(); });
+
+    auto too_many_keys_pressed = [&remaining_keys_count]() { return remaining_keys_count == 0; };
+    auto keys_remaining = [&remaining_keys_count]() { return remaining_keys_count > 0; };
+
+    sm << standard
+       << (standard    | caps_locked)  [Event::caps_lock_pressed]
+       << (caps_locked | standard)     [Event::caps_lock_pressed]
+       << (standard    | standard)     [Event::key_pressed] (keys_remaining) / [&remaining_keys_count]() { remaining_keys_count--; }
+       << (caps_locked | caps_locked)  [Event::key_pressed] (keys_remaining) / [&remaining_keys_count]() { remaining_keys_count--; }
+       << (standard    | broken)       [Event::key_pressed] (too_many_keys_pressed)
+       << (caps_locked | broken)       [Event::key_pressed] (too_many_keys_pressed);
+    sm.finalize();
+
+    sm.start();
+    size_t loop_exec_count = 0;
+    for (size_t i = 0; sm.is_running() && loop_exec_count < 11; ++i)
+    {
+        const Event e = i % 3 == 0 ? Event::caps_lock_pressed : Event::key_pressed;
+        sm.notify(e);
+
+        if (e == Event::key_pressed) {
+            loop_exec_count++;
+        }
+    }
+
+    EXPECT_EQ(loop_exec_count, 11);
+    EXPECT_EQ(remaining_keys_count, 0);
+    EXPECT_TRUE(is_broken);
+}
+
+TEST(lightweight_state_machine_test, inplace_function_policy) {
+    typedef lsm::inplace_function_policy<> policy;
+
+    int entered_count = 0;
+    bool action_called = false;
+    // Move-only capture: wouldn't compile with std::function
+    auto answer = std::make_unique<int>(42);
+
+    lsm::machine<char, policy> sm;
+
+    const auto init  = lsm::basic_state<policy>(),
+               final = lsm::basic_state<policy>().on_enter([&entered_count]() { entered_count++; });
+
+    sm << init
+       << (init | final) ['q'] ([answer = std::move(answer)]() { return *answer == 42; })
+                               / [&action_called]() { action_called = true; };
+
+    sm.start();
+    sm.notify('q');
+
+    EXPECT_TRUE(action_called);
+    EXPECT_EQ(entered_count, 1);
+}
+
+TEST(lightweight_state_machine_test, inplace_function_moves_target) {
+    int calls = 0;
+    lsm::inplace_function<int(int), 16> f = [&calls](int i) { calls++; return i * 2; };
+    EXPECT_TRUE(static_cast<bool>(f));
+
+    lsm::inplace_function<int(int), 16> g = std::move(f);
+    EXPECT_FALSE(static_cast<bool>(f));
+    EXPECT_EQ(g(21), 42);
+    EXPECT_EQ(calls, 1);
+}
+
+TEST(lightweight_state_machine_test, inplace_function_copies_by_type) {
+    typedef lsm::inplace_function_policy<> policy;
+    static_assert(!std::is_copy_constructible_v<lsm::inplace_function<void()>> && !std::is_copy_assignable_v<lsm::inplace_function<void()>>, "Move-only targets make it move-only");
+    static_assert(std::is_copy_constructible_v<lsm::copyable_inplace_function<void()>>, "Copyable targets only");
+    static_assert(std::is_nothrow_move_constructible_v<lsm::copyable_inplace_function<void()>>, "Relocated by moves");
+    static_assert(std::is_copy_constructible_v<lsm::basic_state<policy>>, "States are copied into definitions");
+
+    int calls = 0;
+    lsm::copyable_inplace_function<int(int), 16> f = [&calls](int i) { calls++; return i * 2; };
+    lsm::copyable_inplace_function<int(int), 16> g = f;
+    EXPECT_EQ(f(1) + g(2), 6);
+    EXPECT_EQ(calls, 2);
+    g = nullptr;
+    EXPECT_FALSE(static_cast<bool>(g));
+    g = f;
+    EXPECT_EQ(g(3), 6);
+}
+
+namespace
+{
+    struct copy_counter
+    {
+        copy_counter(int &copies) : copies_(&copies) {}
+        copy_counter(const copy_counter &other) : copies_(other.copies_) { (*copies_)++; }
+        copy_counter(copy_counter&&) = default;
+
+        bool operator()() const { return true; }
+        bool operator<(const copy_counter &other) const { return copies_ < other.copies_; }
+
+        int *copies_;
+    };
+}
+
+TEST(lightweight_state_machine_test, builder_chain_does_not_copy) {
+    int guard_copies = 0,
+        event_copies = 0;
+
+    const lsm::state init  = lsm::state(),
+                     final = lsm::state();
+
+    lsm::machine<copy_counter> sm;
+    sm << init
+       << (init | final) [copy_counter(event_copies)] (copy_counter(guard_copies)) / []() {};
+
+    EXPECT_EQ(guard_copies, 0);
+    // The multimap key keeps its own copy
+    EXPECT_EQ(event_copies, 1);
+
+    auto t = (init | final) [copy_counter(event_copies)] (copy_counter(guard_copies));
+    sm << t;
+    EXPECT_EQ(guard_copies, 1);
+    EXPECT_EQ(event_copies, 3);
+}
+
+namespace
+{
+    // Tracks what is currently allocated through it.
+    class counting_resource : public std::pmr::memory_resource
+    {
+    public:
+        std::size_t live_bytes() const { return live_bytes_; }
+
+    private:
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override
+        {
+            live_bytes_ += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+        {
+            live_bytes_ -= bytes;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+        std::size_t live_bytes_ = 0;
+    };
+}
+
+TEST(lightweight_state_machine_test, arena_backed_machine) {
+    typedef lsm::arena_policy<lsm::inplace_function_policy<>> policy;
+
+    counting_resource default_resource;
+    auto *previous_resource = std::pmr::set_default_resource(&default_resource);
+    {
+        int actions_called = 0;
+
+        // Nothing can be allocated beyond that block
+        alignas(std::max_align_t) unsigned char buffer[16 * 1024];
+        lsm::machine_arena arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+        const auto init  = lsm::basic_state<policy::callables>(),
+                   final = lsm::basic_state<policy::callables>();
+
+        lsm::machine<char, policy> sm(arena.get_allocator());
+        sm.reserve(2, 2);
+        sm << init
+           << (init  | final) ['q'] / [&actions_called]() { actions_called++; } / [&actions_called]() { actions_called++; }
+           << (final | init)  ['q'] / [&actions_called]() { actions_called++; };
+
+        // Builder temporaries were handed over to the arena
+        EXPECT_EQ(default_resource.live_bytes(), 0u);
+
+        sm.finalize();
+        sm.start();
+        sm.notify('q');
+        sm.notify('q');
+
+        EXPECT_EQ(actions_called, 3);
+    }
+    std::pmr::set_default_resource(previous_resource);
+    EXPECT_EQ(default_resource.live_bytes(), 0u);
+}
+
+TEST(lightweight_state_machine_test, shared_definition) {
+    enum class Event { toggle };
+    int on_count = 0;
+
+    const lsm::state off = lsm::state(),
+                     on  = lsm::state().on_enter([&on_count]() { on_count++; });
+
+    lsm::machine_definition<Event> definition;
+    definition << off
+               << (off | on)  [Event::toggle]
+               << (on  | off) [Event::toggle];
+    definition.finalize();
+
+    std::vector<lsm::machine_instance> sessions(3);
+    for (auto &s : sessions) definition.start(s);
+
+    definition.notify(sessions[0], Event::toggle);
+    definition.notify(sessions[2], Event::toggle);
+    definition.notify(sessions[2], Event::toggle);
+
+    EXPECT_EQ(on_count, 2);
+    EXPECT_NE(sessions[0].current_state, sessions[1].current_state);
+    EXPECT_EQ(sessions[1].current_state, sessions[2].current_state);
+    EXPECT_TRUE(sessions[1].is_running);
+
+    definition.stop(sessions[1]);
+    EXPECT_FALSE(sessions[1].is_running);
+    EXPECT_TRUE(sessions[0].is_running);
+}
+
+TEST(lightweight_state_machine_test, notify_all_batch) {
+    enum class Event { key_pressed, caps_lock_pressed };
+    unsigned int keys_count = 0;
+
+    const lsm::state standard    = lsm::state(),
+                     caps_locked = lsm::state();
+
+    auto count_key = [&keys_count]() { keys_count++; };
+
+    for (bool finalized : { false, true })
+    {
+        keys_count = 0;
+
+        lsm::machine<Event> sm;
+        sm << standard
+           << (standard    | caps_locked)  [Event::caps_lock_pressed]
+           << (caps_locked | standard)     [Event::caps_lock_pressed]
+           << (standard    | standard)     [Event::key_pressed] / count_key
+           << (caps_locked | caps_locked)  [Event::key_pressed] / count_key;
+        if (finalized) sm.finalize();
+
+        const std::vector<Event> batch(4096, Event::key_pressed);
+        // The batch is ignored until the machine is started
+        sm.notify_all(batch.begin(), batch.end());
+        EXPECT_EQ(keys_count, 0u);
+
+        sm.start();
+        sm.notify_all(batch.begin(), batch.end());
+        EXPECT_EQ(keys_count, batch.size());
+
+#if defined(__cpp_lib_span)
+        sm.notify_all(std::span<const Event>(batch));
+        EXPECT_EQ(keys_count, 2 * batch.size());
+#endif
+    }
+}
+
+TEST(lightweight_state_machine_test, notify_each_batch) {
+    const lsm::state off = lsm::state(),
+                     on  = lsm::state();
+
+    lsm::machine_definition<char> definition;
+    definition << off
+               << (off | on)  ['t']
+               << (on  | off) ['t'];
+    definition.finalize();
+
+    lsm::machine_instance a, b;
+    definition.start(a);
+    definition.start(b);
+    const auto initial = a.current_state;
+
+    const std::vector<std::pair<lsm::machine_instance*, char>> batch = { { &a, 't' }, { &b, 't' }, { &a, 't' }, { &b, 'x' } };
+    definition.notify_each(batch.begin(), batch.end());
+
+    EXPECT_EQ(a.current_state, initial);
+    EXPECT_NE(b.current_state, initial);
+}
+
+TEST(lightweight_state_machine_test, run_to_completion_from_state) {
+    typedef lsm::run_to_completion_policy<> policy;
+
+    bool first_state_left = false,
+         second_state_entered = false;
+    lsm::machine<char, policy> sm;
+
+    const lsm::state init  = lsm::state().on_enter([&sm]() { sm.notify('q'); })
+                                         .on_leave([&first_state_left]() { first_state_left = true;     }),
+                     final = lsm::state().on_enter([&second_state_entered]() { second_state_entered = true; });
+
+    sm << init
+       << (init | final) ['q'];
+
+    sm.start();
+
+    EXPECT_TRUE(first_state_left);
+    EXPECT_TRUE(second_state_entered);
+}
+
+TEST(lightweight_state_machine_test, run_to_completion_bounds_stack_depth) {
+    typedef lsm::run_to_completion_policy<lsm::default_policy, 4> policy;
+
+    const int chain_length = 100000;
+    int entered_count = 0,
+        depth = 0,
+        max_depth = 0;
+    lsm::machine<char, policy> sm;
+
+    // Each entry automatically re-triggers the state until the chain is over
+    const lsm::state looping = lsm::state().on_enter([&]()
+    {
+        max_depth = std::max(max_depth, ++depth);
+        if (++entered_count < chain_length) sm.notify('n');
+        depth--;
+    });
+
+    const auto loop = (looping | looping) ['n'];
+    sm << looping
+       << loop;
+
+    sm.start();
+
+    EXPECT_EQ(entered_count, chain_length);
+    EXPECT_EQ(max_depth, 1);
+}
+
+TEST(lightweight_state_machine_test, run_to_completion_keeps_order) {
+    typedef lsm::run_to_completion_policy<> policy;
+
+    std::string trace;
+    lsm::machine<char, policy> sm;
+
+    const lsm::state a = lsm::state().on_enter([&trace]() { trace += "A"; }),
+                     b = lsm::state().on_enter([&trace]() { trace += "B"; }),
+                     c = lsm::state().on_enter([&trace]() { trace += "C"; });
+
+    sm << a
+       << (a | b) ['b'] / [&]() { trace += "1"; sm.notify('c'); sm.notify('a'); trace += "2"; }
+       << (b | c) ['c']
+       << (c | a) ['a'];
+
+    sm.start();
+    sm.notify('b');
+
+    // Queued events only run once the transition that posted them is complete
+    EXPECT_EQ(trace, "A12BCA");
+}
+
+namespace
+{
+    struct counting_observer : lsm::null_observer
+    {
+        template <typename Event>
+        void on_dispatch_begin(const lsm::machine_instance&, const Event&, time_point) { dispatched++; }
+
+        template <typename Event>
+        void on_dispatch_end(const lsm::machine_instance&, const Event&, std::size_t fired, time_point begin, time_point end)
+        {
+            if (fired != no_transition) fired_count++;
+            if (end < begin) backwards_time = true;
+        }
+
+        void on_guard(const lsm::machine_instance&, std::size_t, bool accepted) { (accepted ? guards_accepted : guards_rejected)++; }
+
+        template <typename Event>
+        void on_unmatched(const lsm::machine_instance&, const Event&, time_point) { unmatched++; }
+
+        void on_enter(const lsm::machine_instance&, std::uint32_t state, time_point, time_point) { entered.push_back(state); }
+        void on_leave(const lsm::machine_instance&, std::uint32_t, time_point, time_point) { left++; }
+
+        int dispatched = 0, fired_count = 0, guards_accepted = 0, guards_rejected = 0, unmatched = 0, left = 0;
+        bool backwards_time = false;
+        std::vector<std::uint32_t> entered;
+    };
+}
+
+TEST(lightweight_state_machine_test, observer_hooks) {
+    typedef lsm::observer_policy<counting_observer> policy;
+
+    for (bool finalized : { false, true })
+    {
+        const lsm::state idle = lsm::state(),
+                         busy = lsm::state();
+
+        lsm::machine<char, policy> sm;
+        sm << idle
+           << (idle | busy) ['g'] ([]() { return false; })
+           << (idle | busy) ['g']
+           << (busy | idle) ['s'];
+        if (finalized) sm.finalize();
+
+        sm.start();
+        sm.notify('g');
+        sm.notify('x');
+        sm.notify('s');
+        sm.stop();
+
+        const counting_observer &o = sm.observer();
+        EXPECT_EQ(o.dispatched, 3);
+        EXPECT_EQ(o.fired_count, 2);
+        EXPECT_EQ(o.guards_accepted, 2);
+        EXPECT_EQ(o.guards_rejected, 1);
+        EXPECT_EQ(o.unmatched, 1);
+        EXPECT_EQ(o.left, 3);
+        EXPECT_FALSE(o.backwards_time);
+        ASSERT_EQ(o.entered.size(), 3u);
+        EXPECT_EQ(o.entered[0], o.entered[2]);
+        EXPECT_NE(o.entered[0], o.entered[1]);
+    }
+}
+
+TEST(lightweight_state_machine_test, definition_owns_its_states) {
+    int entered_count = 0;
+    lsm::machine_definition<char> definition;
+    {
+        // Only used to identify states while building
+        const lsm::state init  = lsm::state(),
+                         other = lsm::state().on_enter([&entered_count]() { entered_count++; });
+
+        definition << init
+                   << (init | other) ['a']
+                   << (other | init) ['b'];
+
+        EXPECT_EQ(definition.id_of(init), definition.initial_state());
+        EXPECT_EQ(definition.transition_source(0), definition.id_of(init));
+        EXPECT_EQ(definition.transition_target(0), definition.id_of(other));
+    }
+    definition.finalize();
+
+    lsm::machine_instance instance;
+    definition.start(instance);
+    definition.notify(instance, 'a');
+    EXPECT_EQ(entered_count, 1);
+
+    // Plain values: a copy carries on from where the original was
+    lsm::machine_instance moved;
+    std::memcpy(&moved, &instance, sizeof(instance));
+    definition.notify(moved, 'b');
+    definition.notify(moved, 'a');
+    EXPECT_EQ(entered_count, 2);
+    EXPECT_EQ(moved.current_state, instance.current_state);
+}
+
+TEST(lightweight_state_machine_test, snapshot_and_restore) {
+    int entered_count = 0;
+
+    const lsm::state init  = lsm::state(),
+                     other = lsm::state().on_enter([&entered_count]() { entered_count++; });
+
+    lsm::machine<char> sm;
+    sm << init
+       << (init | other) ['a']
+       << (other | init) ['b'];
+    sm.start();
+    sm.notify('a');
+
+    const char blob[] = "session";
+    unsigned char buffer[32];
+    EXPECT_EQ(sm.snapshot(buffer, 8, blob, sizeof(blob)), 0u);
+    ASSERT_EQ(sm.snapshot(buffer, sizeof(buffer), blob, sizeof(blob)), 8 + sizeof(blob));
+    // Fixed layout: state id, flags, version, blob size
+    EXPECT_EQ(buffer[0], sm.instance().current_state);
+    EXPECT_EQ(buffer[4], 1);
+    EXPECT_EQ(buffer[6], sizeof(blob));
+
+    sm.notify('b');
+    char restored_blob[16] = {};
+    EXPECT_EQ(sm.restore(buffer, sizeof(buffer), restored_blob, 4), 0u);
+    EXPECT_EQ(sm.restore(buffer, sizeof(buffer), restored_blob, sizeof(restored_blob)), 8 + sizeof(blob));
+    EXPECT_STREQ(restored_blob, "session");
+    EXPECT_TRUE(sm.is_running());
+
+    // Back in 'other' without entering it again
+    EXPECT_EQ(entered_count, 1);
+    sm.notify('b');
+    sm.notify('a');
+    EXPECT_EQ(entered_count, 2);
+
+    buffer[0] = 42;
+    EXPECT_EQ(sm.restore(buffer, sizeof(buffer), restored_blob, sizeof(restored_blob)), 0u);
+
+    // A stopped instance is in no state, or notify() would still dispatch it
+    ASSERT_EQ(sm.snapshot(buffer, sizeof(buffer)), 8u);
+    buffer[4] = 0;
+    EXPECT_EQ(sm.restore(buffer, sizeof(buffer)), 0u);
+    EXPECT_TRUE(sm.is_running());
+    sm.stop();
+    ASSERT_EQ(sm.snapshot(buffer, sizeof(buffer)), 8u);
+    EXPECT_EQ(sm.restore(buffer, sizeof(buffer)), 8u);
+    EXPECT_FALSE(sm.is_running());
+}
+
+TEST(lightweight_state_machine_test, bulk_snapshot) {
+    const lsm::state a = lsm::state(),
+                     b = lsm::state();
+
+    lsm::machine_definition<char> definition;
+    definition << a
+               << (a | b) ['n']
+               << (b | a) ['n'];
+
+    std::vector<lsm::machine_instance> instances(100);
+    for (std::size_t i = 0; i < instances.size(); ++i)
+    {
+        definition.start(instances[i]);
+        if (i % 3 == 0) definition.notify(instances[i], 'n');
+    }
+
+    std::vector<unsigned char> buffer(instances.size() * definition.snapshot_size);
+    ASSERT_EQ(definition.snapshot_all(instances.data(), instances.size(), buffer.data(), buffer.size()), instances.size());
+
+    std::vector<lsm::machine_instance> restored(instances.size());
+    ASSERT_EQ(definition.restore_all(restored.data(), restored.size(), buffer.data(), buffer.size()), restored.size());
+    for (std::size_t i = 0; i < instances.size(); ++i)
+    {
+        EXPECT_EQ(restored[i].current_state, instances[i].current_state);
+        EXPECT_TRUE(restored[i].is_running);
+    }
+
+    // Truncated: only whole records are read back
+    EXPECT_EQ(definition.restore_all(restored.data(), restored.size(), buffer.data(), 20), 2u);
+}
+
+TEST(lightweight_state_machine_test, finalized_sparse_event_codes_with_nested_states) {
+    enum class code : std::uint32_t { tick = 5, reset = 4000000000u };
+    const lsm::state top = lsm::state(), x = lsm::state(), y = lsm::state(),
+                     other = lsm::state(), z = lsm::state();
+
+    // Hashed by the default policy, with other's cell seen before x's
+    lsm::machine<code> sm;
+    sm << top
+       << lsm::nest(top, x, y)
+       << (other | z) [code::tick]
+       << (x | y) [code::tick] ([]() { return false; })
+       << (top | other) [code::reset];
+    sm.finalize();
+    sm.start();
+
+    sm.notify(code::tick);
+    EXPECT_TRUE(sm.is_in(x));
+    sm.notify(code::reset);
+    EXPECT_TRUE(sm.is_in(other));
+    sm.notify(code::tick);
+    EXPECT_TRUE(sm.is_in(z));
+}
+
+TEST(lightweight_state_machine_test, nested_states) {
+    for (bool finalized : { false, true })
+    {
+        std::string trace;
+        auto traced = [&trace](const char *name)
+        {
+            return lsm::state().on_enter([&trace, name]() { trace += "+"; trace += name; })
+                               .on_leave([&trace, name]() { trace += "-"; trace += name; });
+        };
+
+        const lsm::state connected    = traced("C"),
+                         idle         = traced("i"),
+                         busy         = traced("b"),
+                         disconnected = traced("D");
+
+        lsm::machine<char> sm;
+        sm << disconnected
+           << lsm::nest(connected, idle, busy)
+           << (disconnected | connected) ['c']
+           << (idle | busy) ['w']
+           << (busy | idle) ['d']
+           // Inherited by idle and busy
+           << (connected | disconnected) ['h']
+           << (connected | connected) ['r'];
+        if (finalized) sm.finalize();
+
+        sm.start();
+        sm.notify('c');
+        EXPECT_TRUE(sm.is_in(connected));
+        EXPECT_TRUE(sm.is_in(idle));
+        sm.notify('w');
+        EXPECT_TRUE(sm.is_in(busy));
+        // Self transition of the composite state: leaves and enters it again, back into its initial substate
+        sm.notify('r');
+        EXPECT_TRUE(sm.is_in(idle));
+        sm.notify('w');
+        sm.notify('h');
+        EXPECT_FALSE(sm.is_in(connected));
+        EXPECT_TRUE(sm.is_in(disconnected));
+
+        EXPECT_EQ(trace, "+D" "-D+C+i" "-i+b" "-b-C+C+i" "-i+b" "-b-C+D");
+    }
+}
+
+TEST(lightweight_state_machine_test, nested_states_prefer_the_innermost_handler) {
+    for (bool finalized : { false, true })
+    {
+        bool allow_inner = false;
+        const lsm::state parent = lsm::state(),
+                         child  = lsm::state(),
+                         inner_target = lsm::state(),
+                         outer_target = lsm::state();
+
+        lsm::machine<int> sm;
+        sm << parent
+           << lsm::nest(parent, child)
+           << (child | inner_target) [1] ([&allow_inner]() { return allow_inner; })
+           << (parent | outer_target) [1]
+           << (inner_target | parent) [2]
+           << (outer_target | parent) [2];
+        if (finalized) sm.finalize();
+
+        sm.start();
+        EXPECT_TRUE(sm.is_in(child));
+
+        // The child's guard rejects the event, so the parent's transition applies
+        sm.notify(1);
+        EXPECT_TRUE(sm.is_in(outer_target));
+
+        sm.notify(2);
+        allow_inner = true;
+        sm.notify(1);
+        EXPECT_TRUE(sm.is_in(inner_target));
+    }
+}
+
+TEST(lightweight_state_machine_test, orthogonal_regions) {
+    enum class Event { power, toggle_light, toggle_fan };
+
+    for (bool finalized : { false, true })
+    {
+        std::string trace;
+        auto traced = [&trace](const char *name) { return lsm::state().on_enter([&trace, name]() { trace += name; }); };
+
+        const lsm::state light_off = traced("l"), light_on = traced("L"),
+                         fan_off   = traced("f"), fan_on   = traced("F");
+
+        lsm::machine<Event> sm;
+        sm << light_off
+           << lsm::region(fan_off)
+           << (light_off | light_on)  [Event::toggle_light]
+           << (light_on  | light_off) [Event::toggle_light]
+           << (light_on  | light_off) [Event::power]
+           << (fan_off   | fan_on)    [Event::toggle_fan]
+           << (fan_on    | fan_off)   [Event::power];
+        if (finalized) sm.finalize();
+
+        EXPECT_EQ(sm.definition().region_count(), 2u);
+
+        sm.start();
+        EXPECT_EQ(sm.active_configuration().size(), 2u);
+        EXPECT_TRUE(sm.is_in(light_off));
+        EXPECT_TRUE(sm.is_in(fan_off));
+
+        sm.notify(Event::toggle_light);
+        sm.notify(Event::toggle_fan);
+        EXPECT_TRUE(sm.is_in(light_on));
+        EXPECT_TRUE(sm.is_in(fan_on));
+
+        // Handled by both regions in the same notify
+        sm.notify(Event::power);
+        EXPECT_TRUE(sm.is_in(light_off));
+        EXPECT_TRUE(sm.is_in(fan_off));
+
+        EXPECT_EQ(trace, "lf" "L" "F" "lf");
+    }
+}
+
+TEST(lightweight_state_machine_test, payload_is_passed_by_reference) {
+    struct quote
+    {
+        quote(int p, int &c) : price(p), copies(&c) {}
+        quote(const quote &other) : price(other.price), copies(other.copies) { (*copies)++; }
+
+        int price;
+        int *copies;
+        char padding[192] = {};
+    };
+
+    typedef lsm::payload_policy<quote> policy;
+    typedef lsm::machine<char, policy> machine_type;
+    typedef machine_type::state state;
+
+    for (bool finalized : { false, true })
+    {
+        int copies = 0;
+        std::vector<int> seen;
+        const quote *last = nullptr;
+
+        const state idle = state(),
+                    trading = state().on_enter([&last](const quote &q) { last = &q; });
+
+        machine_type sm;
+        sm << idle
+           << (idle | trading) ['q'] ([](const quote &q) { return q.price > 100; })
+                                     / [&seen](const quote &q) { seen.push_back(q.price); }
+           << (trading | idle) ['q'] / [&seen](const quote &q) { seen.push_back(-q.price); };
+        if (finalized) sm.finalize();
+
+        const quote start(0, copies), low(50, copies), high(150, copies), next(200, copies);
+        sm.start(start);
+        sm.notify('q', low);
+        EXPECT_TRUE(sm.is_in(idle));
+        sm.notify('q', high);
+        EXPECT_TRUE(sm.is_in(trading));
+        EXPECT_EQ(last, &high);
+        sm.notify('q', next);
+        EXPECT_TRUE(sm.is_in(idle));
+        sm.stop(next);
+
+        EXPECT_EQ(seen, (std::vector<int>{ 150, -200 }));
+        EXPECT_EQ(copies, 0);
+    }
+}
+
+namespace
+{
+    // String event counting how many times the machine had to build one.
+    struct event_name
+    {
+        event_name(std::string_view n) : name(n) { constructed++; }
+
+        std::string name;
+        static int constructed;
+    };
+    int event_name::constructed = 0;
+
+    bool operator<(const event_name &a, const event_name &b) { return a.name < b.name; }
+    bool operator<(const event_name &a, std::string_view b) { return a.name < b; }
+    bool operator<(std::string_view a, const event_name &b) { return a < b.name; }
+}
+
+TEST(lightweight_state_machine_test, heterogeneous_event_lookup) {
+    const lsm::state closed = lsm::state(),
+                     opened = lsm::state();
+
+    lsm::machine<std::string> sm;
+    sm << closed
+       << (closed | opened) [std::string("open")]
+       << (opened | closed) [std::string("close")];
+    sm.start();
+
+    const std::string_view open = "open";
+    sm.notify(open);
+    EXPECT_TRUE(sm.is_in(opened));
+    sm.notify("close");
+    EXPECT_TRUE(sm.is_in(closed));
+
+    lsm::machine<event_name> named;
+    named << closed
+          << (closed | opened) [event_name("open")]
+          << (opened | closed) [event_name("close")];
+    named.start();
+
+    const int built = event_name::constructed;
+    named.notify(std::string_view("open"));
+    named.notify(std::string_view("unknown"));
+    EXPECT_TRUE(named.is_in(opened));
+    named.notify(std::string_view("close"));
+    EXPECT_TRUE(named.is_in(closed));
+    EXPECT_EQ(event_name::constructed, built);
+}
+
+TEST(lightweight_state_machine_test, hashed_dispatch) {
+    typedef lsm::hashed_dispatch_policy<> policy;
+
+    // Message codes far too sparse for a dense table, and transitions sharing a trigger
+    {
+        const std::uint64_t logon = 0x4C4F474F4E000001ull, order = 0x4F52444552000002ull, logout = 0xFFFFFFFF00000003ull;
+        std::string trace;
+
+        const lsm::state idle = lsm::state(),
+                         session = lsm::state(),
+                         rejected = lsm::state().on_enter([&trace]() { trace += "!"; });
+
+        lsm::machine<std::uint64_t, policy> sm;
+        sm << idle
+           << (idle | rejected) [logon] ([]() { return false; })
+           << (idle | session)  [logon] ([]() { return true; }) / [&trace]() { trace += "+"; }
+           << (session | session) [order] / [&trace]() { trace += "o"; }
+           << (session | idle) [logout] / [&trace]() { trace += "-"; };
+        sm.finalize();
+        sm.start();
+
+        sm.notify(order);
+        EXPECT_TRUE(sm.is_in(idle));
+        sm.notify(logon);
+        sm.notify(order);
+        sm.notify(order);
+        sm.notify(std::uint64_t(42));
+        sm.notify(logout);
+        EXPECT_TRUE(sm.is_in(idle));
+        EXPECT_EQ(trace, "+oo-");
+    }
+
+    // Finalized string events, looked up from string_views, with an inherited transition
+    {
+        const lsm::state connected = lsm::state(), idle = lsm::state(), busy = lsm::state(),
+                         disconnected = lsm::state();
+
+        lsm::machine<std::string, policy> sm;
+        sm << connected
+           << lsm::nest(connected, idle, busy)
+           << (idle | busy) [std::string("request")]
+           << (busy | idle) [std::string("reply")]
+           << (connected | disconnected) [std::string("hang_up")];
+        sm.finalize();
+        sm.start();
+
+        sm.notify(std::string_view("request"));
+        EXPECT_TRUE(sm.is_in(busy));
+        sm.notify("unknown");
+        EXPECT_TRUE(sm.is_in(busy));
+        sm.notify("hang_up");
+        EXPECT_TRUE(sm.is_in(disconnected));
+    }
+}
+
+TEST(lightweight_state_machine_test, nested_states_on_every_dispatch_backend) {
+    auto check = [](auto policy_tag)
+    {
+        typedef typename decltype(policy_tag)::type policy;
+
+        const lsm::state top = lsm::state(), x = lsm::state(), y = lsm::state(),
+                         other = lsm::state(), z = lsm::state();
+
+        // other's cell is seen first, so hashed cells aren't sorted by state
+        lsm::machine<char, policy> sm;
+        sm << top
+           << lsm::nest(top, x, y)
+           << (other | z) ['a']
+           << (x | y) ['a'] ([]() { return false; })
+           << (top | other) ['b'];
+        sm.finalize();
+        sm.start();
+
+        sm.notify('a');
+        EXPECT_TRUE(sm.is_in(x));
+        sm.notify('b');
+        EXPECT_TRUE(sm.is_in(other));
+        sm.notify('a');
+        EXPECT_TRUE(sm.is_in(z));
+    };
+    check(std::type_identity<lsm::std_function_policy>());
+    check(std::type_identity<lsm::hashed_dispatch_policy<>>());
+    check(std::type_identity<lsm::simd_dispatch_policy<>>());
+}
+
+TEST(lightweight_state_machine_test, transition_priorities) {
+    for (bool finalized : { false, true })
+    {
+        std::string trace;
+        const lsm::state init = lsm::state(),
+                         low = lsm::state(), high = lsm::state(), guarded = lsm::state();
+
+        lsm::machine<char> sm;
+        sm << init
+           << (init | low)     ['q'] / [&trace]() { trace += "l"; }
+           << (init | guarded) ['q'] ([&trace]() { trace += "g"; return false; }).priority(2)
+           << (init | high)    ['q'] ([]() { return true; }).priority(1)
+           << (high | init)    ['r']
+           << (low  | init)    ['r'];
+        if (finalized) sm.finalize();
+
+        sm.start();
+        sm.notify('q');
+        EXPECT_TRUE(sm.is_in(high));
+        EXPECT_EQ(trace, "g");
+
+        // Unguarded transitions without callbacks are still taken once finalized
+        sm.notify('r');
+        EXPECT_TRUE(sm.is_in(init));
+    }
+}
+
+TEST(lightweight_state_machine_test, reorder_by_weight) {
+    std::string trace;
+    int level = 0;
+
+    const lsm::state init = lsm::state(), a = lsm::state(), b = lsm::state();
+
+    lsm::machine<char> sm;
+    sm << init
+       << (init | a) ['q'] ([&trace, &level]() { trace += "a"; return level == 0; })
+       << (init | b) ['q'] ([&trace, &level]() { trace += "b"; return level == 1; })
+       << (a | init) ['r']
+       << (b | init) ['r'];
+    sm.finalize();
+    EXPECT_EQ(sm.definition().transition_target(0), sm.definition().id_of(a));
+
+    // b fires most often: it's tried first from now on
+    sm.reorder([&sm, &b](std::size_t t) { return sm.definition().transition_target(t) == sm.definition().id_of(b) ? 10 : 1; });
+    sm.start();
+
+    level = 1;
+    sm.notify('q');
+    EXPECT_TRUE(sm.is_in(b));
+    EXPECT_EQ(trace, "b");
+    sm.notify('r');
+
+    trace.clear();
+    level = 0;
+    sm.notify('q');
+    EXPECT_TRUE(sm.is_in(a));
+    EXPECT_EQ(trace, "ba");
+}
+
+TEST(lightweight_state_machine_test, completion_transitions) {
+    for (bool finalized : { false, true })
+    {
+        std::string trace;
+        bool ready = false;
+        auto traced = [&trace](const char *name) { return lsm::state().on_enter([&trace, name]() { trace += name; }); };
+
+        const lsm::state boot = traced("b"), check = traced("c"), idle = traced("i"), wait = traced("w");
+
+        lsm::machine<char> sm;
+        sm << boot
+           << (boot  | check) [lsm::completion] / [&trace]() { trace += "/"; }
+           << (check | idle)  [lsm::completion] ([&ready]() { return ready; })
+           << (check | wait)  [lsm::completion] ([]() { return true; }).priority(-1)
+           << (wait  | check) ['r']
+           << (idle  | boot)  ['x'];
+        if (finalized) sm.finalize();
+        EXPECT_EQ(sm.definition().completion_count(), 3u);
+
+        // Chained from start(), the guarded one falling through to the lower priority one
+        sm.start();
+        EXPECT_TRUE(sm.is_in(wait));
+        EXPECT_EQ(trace, "b/cw");
+
+        // and from notify()
+        ready = true;
+        trace.clear();
+        sm.notify('r');
+        EXPECT_TRUE(sm.is_in(idle));
+        EXPECT_EQ(trace, "ci");
+
+        // A state without completions stays put
+        sm.notify('q');
+        EXPECT_TRUE(sm.is_in(idle));
+    }
+}
+
+TEST(lightweight_state_machine_test, nested_completion_transitions) {
+    std::string trace;
+    auto traced = [&trace](const char *enter, const char *leave)
+    {
+        return lsm::state().on_enter([&trace, enter]() { trace += enter; }).on_leave([&trace, leave]() { trace += leave; });
+    };
+
+    const lsm::state job = traced("+J", "-J"), step1 = traced("+1", "-1"), step2 = traced("+2", "-2"),
+                     done = traced("+D", "-D");
+
+    lsm::machine<char> sm;
+    sm << job
+       << lsm::nest(job, step1, step2)
+       << (step1 | step2) [lsm::completion]
+       << (step2 | done)  [lsm::completion];
+    sm.finalize();
+    sm.start();
+
+    EXPECT_TRUE(sm.is_in(done));
+    EXPECT_EQ(trace, "+J+1" "-1+2" "-2-J+D");
+}
+
+TEST(lightweight_state_machine_test, completion_from_composite_state) {
+    for (bool finalized : { false, true })
+    {
+        bool finished = false;
+        const lsm::state job, step1, step2, done;
+
+        lsm::machine<char> sm;
+        sm << job
+           << lsm::nest(job, step1, step2)
+           << (step1 | step2) ['n']
+           << (step2 | step1) ['n']
+           << (job   | done)  [lsm::completion] ([&finished]() { return finished; });
+        if (finalized) sm.finalize();
+
+        sm.start();
+        EXPECT_TRUE(sm.is_in(step1));
+        sm.notify('n');
+        EXPECT_TRUE(sm.is_in(step2));
+
+        // Tried again as a substate becomes current
+        finished = true;
+        sm.notify('n');
+        EXPECT_TRUE(sm.is_in(done));
+        EXPECT_FALSE(sm.is_in(job));
+    }
+}
+
+TEST(lightweight_state_machine_test, timed_transitions) {
+    using std::chrono::milliseconds;
+
+    for (bool finalized : { false, true })
+    {
+        const auto start = lsm::timing_wheel::clock::now();
+        lsm::timing_wheel wheel(milliseconds(1), start);
+        bool retry = true;
+        int warnings = 0;
+
+        const lsm::state idle, waiting, warned = lsm::state().on_enter([&warnings]() { warnings++; }), timed_out;
+
+        lsm::machine<char> sm;
+        sm.set_timing_wheel(&wheel);
+        sm << idle
+           << (idle    | waiting)   ['r']
+           << (waiting | idle)      ['a']
+           << (waiting | timed_out) [lsm::after(milliseconds(50))]
+           << (waiting | warned)    [lsm::after(milliseconds(20))] ([&retry]() { return !retry; })
+           << (warned  | idle)      [lsm::completion];
+        if (finalized) sm.finalize();
+        EXPECT_EQ(sm.definition().timeout_count(), 2u);
+
+        // Leaving the state cancels its timer
+        sm.start();
+        sm.notify('r');
+        EXPECT_EQ(wheel.size(), 1u);
+        wheel.advance(start + milliseconds(10));
+        sm.notify('a');
+        EXPECT_TRUE(sm.is_in(idle));
+        EXPECT_EQ(wheel.size(), 0u);
+
+        // A refusing guard hands over to the next timer, for the rest of its delay
+        sm.notify('r');
+        wheel.advance(start + milliseconds(30));
+        EXPECT_TRUE(sm.is_in(waiting));
+        wheel.advance(start + milliseconds(59));
+        EXPECT_TRUE(sm.is_in(waiting));
+        wheel.advance(start + milliseconds(60));
+        EXPECT_TRUE(sm.is_in(timed_out));
+        EXPECT_EQ(wheel.size(), 0u);
+
+        // An accepting one is taken, followed by completions
+        sm.stop();
+        retry = false;
+        sm.start();
+        sm.notify('r');
+        wheel.advance(start + milliseconds(80));
+        EXPECT_TRUE(sm.is_in(idle));
+        EXPECT_EQ(warnings, 1);
+        EXPECT_EQ(wheel.size(), 0u);
+    }
+}
+
+TEST(lightweight_state_machine_test, timers_of_many_instances) {
+    using std::chrono::milliseconds;
+
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    const lsm::state connected, idle, closed;
+
+    lsm::machine_definition<char> definition;
+    definition.set_timing_wheel(&wheel);
+    definition << connected
+               << (connected | idle)      [lsm::after(milliseconds(100))]
+               << (idle      | connected) ['d']
+               << (idle      | closed)    [lsm::after(milliseconds(1000))];
+    definition.finalize();
+
+    std::vector<lsm::machine_instance> sessions(64);
+    for (auto &s : sessions) definition.start(s);
+    EXPECT_EQ(wheel.size(), sessions.size());
+
+    // Activity on even sessions only
+    wheel.advance(start + milliseconds(100));
+    for (std::size_t i = 0; i < sessions.size(); i += 2) definition.notify(sessions[i], 'd');
+    wheel.advance(start + milliseconds(1100));
+
+    for (std::size_t i = 0; i < sessions.size(); ++i)
+    {
+        EXPECT_EQ(sessions[i].current_state, definition.id_of(i % 2 == 0 ? idle : closed));
+    }
+    EXPECT_EQ(wheel.size(), sessions.size() / 2);
+}
+
+TEST(lightweight_state_machine_test, restored_instances_time_out) {
+    using std::chrono::milliseconds;
+
+    for (bool finalized : { false, true })
+    {
+        const auto start = lsm::timing_wheel::clock::now();
+        lsm::timing_wheel wheel(milliseconds(1), start);
+        const lsm::state idle, waiting, timed_out;
+
+        lsm::machine_definition<char> definition;
+        definition.set_timing_wheel(&wheel);
+        definition << idle
+                   << (idle    | waiting)   ['r']
+                   << (waiting | timed_out) [lsm::after(milliseconds(50))];
+        if (finalized) definition.finalize();
+
+        lsm::machine_instance saved, restored;
+        definition.start(saved);
+        definition.notify(saved, 'r');
+        unsigned char buffer[definition.snapshot_size];
+        ASSERT_EQ(definition.snapshot(saved, buffer, sizeof(buffer)), sizeof(buffer));
+        definition.stop(saved);
+        EXPECT_EQ(wheel.size(), 0u);
+
+        // Its timer starts over from the restore
+        wheel.advance(start + milliseconds(30));
+        ASSERT_EQ(definition.restore(restored, buffer, sizeof(buffer)), sizeof(buffer));
+        EXPECT_EQ(wheel.size(), 1u);
+        wheel.advance(start + milliseconds(79));
+        EXPECT_EQ(restored.current_state, definition.id_of(waiting));
+        wheel.advance(start + milliseconds(80));
+        EXPECT_EQ(restored.current_state, definition.id_of(timed_out));
+        EXPECT_EQ(wheel.size(), 0u);
+    }
+}
+
+TEST(lightweight_state_machine_test, restarting_cancels_the_timer) {
+    using std::chrono::milliseconds;
+
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    const lsm::state waiting, timed_out;
+
+    lsm::machine_definition<char> definition;
+    definition.set_timing_wheel(&wheel);
+    definition << waiting
+               << (waiting | timed_out) [lsm::after(milliseconds(50))];
+    definition.finalize();
+
+    lsm::machine_instance instance;
+    definition.start(instance);
+    wheel.advance(start + milliseconds(30));
+    definition.start(instance);
+    EXPECT_EQ(wheel.size(), 1u);
+
+    // The first timer would have fired by now
+    wheel.advance(start + milliseconds(60));
+    EXPECT_EQ(instance.current_state, definition.id_of(waiting));
+    wheel.advance(start + milliseconds(80));
+    EXPECT_EQ(instance.current_state, definition.id_of(timed_out));
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(lightweight_state_machine_test, copied_machines_time_out_on_their_own) {
+    using std::chrono::milliseconds;
+
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    const lsm::state idle, waiting, timed_out;
+
+    lsm::machine<char> original;
+    original.set_timing_wheel(&wheel);
+    original << idle
+             << (idle    | waiting)   ['r']
+             << (waiting | idle)      ['a']
+             << (waiting | timed_out) [lsm::after(milliseconds(50))];
+    original.finalize();
+    original.start();
+    original.notify('r');
+
+    // The copy's timer starts over, and leaving its state doesn't cancel the original's
+    wheel.advance(start + milliseconds(20));
+    lsm::machine<char> copy(original);
+    EXPECT_EQ(wheel.size(), 2u);
+    copy.notify('a');
+    EXPECT_EQ(wheel.size(), 1u);
+    wheel.advance(start + milliseconds(60));
+    EXPECT_TRUE(original.is_in(timed_out));
+    EXPECT_TRUE(copy.is_in(idle));
+
+    // Assigning over a waiting machine cancels its timer first
+    copy.notify('r');
+    original.stop();
+    original.start();
+    original.notify('r');
+    EXPECT_EQ(wheel.size(), 2u);
+    copy = original;
+    EXPECT_EQ(wheel.size(), 2u);
+    wheel.advance(start + milliseconds(120));
+    EXPECT_TRUE(original.is_in(timed_out));
+    EXPECT_TRUE(copy.is_in(timed_out));
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(lightweight_state_machine_test, destroyed_and_moved_machines_release_their_timers) {
+    using std::chrono::milliseconds;
+
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    const lsm::state waiting, timed_out;
+
+    auto make = [&]()
+    {
+        lsm::machine<char> sm;
+        sm.set_timing_wheel(&wheel);
+        sm << waiting
+           << (waiting | timed_out) [lsm::after(milliseconds(5))];
+        sm.finalize();
+        return sm;
+    };
+
+    // Destroyed with its timer armed
+    {
+        lsm::machine<char> sm = make();
+        sm.start();
+        EXPECT_EQ(wheel.size(), 1u);
+    }
+    EXPECT_EQ(wheel.size(), 0u);
+    wheel.advance(start + milliseconds(10));
+
+    // Moved: only the machine moved to times out, from the move on
+    lsm::machine<char> source = make();
+    source.start();
+    wheel.advance(start + milliseconds(12));
+    lsm::machine<char> moved(std::move(source));
+    EXPECT_EQ(wheel.size(), 1u);
+    wheel.advance(start + milliseconds(16));
+    EXPECT_TRUE(moved.is_in(waiting));
+    wheel.advance(start + milliseconds(20));
+    EXPECT_TRUE(moved.is_in(timed_out));
+
+    // Move-assigned over a waiting machine, whose timer is cancelled
+    lsm::machine<char> other = make();
+    other.start();
+    moved.stop();
+    moved.start();
+    EXPECT_EQ(wheel.size(), 2u);
+    moved = std::move(other);
+    EXPECT_EQ(wheel.size(), 1u);
+    wheel.advance(start + milliseconds(30));
+    EXPECT_TRUE(moved.is_in(timed_out));
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(lightweight_state_machine_test, validate_reachability) {
+    const lsm::state idle, busy, done, orphan, parent, child1, child2;
+
+    lsm::machine<char> sm;
+    sm << idle
+       << (idle   | busy)   ['b']
+       << (busy   | done)   [lsm::completion]
+       << lsm::nest(parent, child1, child2)
+       << (done   | parent) ['p']
+       << (child1 | child2) ['n']
+       << (orphan | idle)   ['o'];
+    sm.finalize();
+
+    lsm::state_id unreachable = 0;
+    EXPECT_FALSE(sm.validate(&unreachable));
+    EXPECT_EQ(unreachable, sm.definition().id_of(orphan));
+    EXPECT_FALSE(sm.definition().is_validated());
+
+    // Reached through parent's transitions, from any of its substates
+    lsm::machine<char> fixed;
+    fixed << idle
+          << lsm::nest(parent, child1, child2)
+          << (idle   | parent) ['p']
+          << (parent | orphan) ['x']
+          << (child1 | child2) ['n'];
+    fixed.finalize();
+    EXPECT_TRUE(fixed.validate());
+
+    lsm::machine<char> empty;
+    empty.finalize();
+    EXPECT_FALSE(empty.validate(&unreachable));
+    EXPECT_EQ(unreachable, lsm::machine_instance::no_state);
+}
+
+TEST(lightweight_state_machine_test, notify_unchecked) {
+    int fired = 0;
+    const lsm::state a, b = lsm::state().on_enter([&fired]() { fired++; });
+
+    lsm::machine<char> sm;
+    sm << a
+       << (a | b) ['n']
+       << (b | a) ['n'] ([&fired]() { return fired % 2 == 0; })
+       << (b | b) ['n'];
+    sm.finalize();
+    ASSERT_TRUE(sm.validate());
+    sm.start();
+
+    sm.notify_unchecked('n');
+    EXPECT_TRUE(sm.is_in(b));
+    sm.notify_unchecked('n');
+    EXPECT_TRUE(sm.is_in(b));
+    EXPECT_EQ(fired, 2);
+    sm.notify_unchecked('n');
+    EXPECT_TRUE(sm.is_in(a));
+    // Unknown events are still ignored
+    sm.notify_unchecked('z');
+    EXPECT_TRUE(sm.is_in(a));
+}
+
+TEST(lightweight_state_machine_test, stopped_machine_ignores_events) {
+    for (bool finalized : { false, true })
+    {
+        int entered = 0;
+        const lsm::state a, b = lsm::state().on_enter([&entered]() { entered++; });
+
+        lsm::machine<char> sm;
+        sm << a
+           << (a | b) ['n']
+           << (b | a) ['n'];
+        if (finalized) sm.finalize();
+        sm.start();
+        sm.stop();
+        EXPECT_EQ(sm.instance().current_state, lsm::machine_instance::no_state);
+
+        sm.notify('n');
+        EXPECT_EQ(entered, 0);
+        EXPECT_FALSE(sm.is_in(a));
+        EXPECT_FALSE(sm.is_in(b));
+
+        lsm::machine_instance instance;
+        sm.definition().start(instance);
+        sm.definition().stop(instance);
+        EXPECT_FALSE(sm.definition().notify(instance, 'n'));
+        EXPECT_EQ(entered, 0);
+    }
+}
+
+TEST(lightweight_state_machine_test, stop_from_callbacks) {
+    for (bool finalized : { false, true })
+    {
+        // From the on_enter of a state reached partway through a batch: the rest of the batch is dropped.
+        {
+            int entered = 0;
+            lsm::machine<char> sm;
+            const lsm::state a, b = lsm::state().on_enter([&sm, &entered]() { if (++entered == 2) sm.stop(); });
+            sm << a
+               << (a | b) ['n']
+               << (b | a) ['n'];
+            if (finalized) sm.finalize();
+            sm.start();
+            const char batch[] = { 'n', 'n', 'n', 'n', 'n', 'n' };
+            sm.notify_all(std::begin(batch), std::end(batch));
+            EXPECT_EQ(entered, 2);
+            EXPECT_FALSE(sm.is_running());
+            EXPECT_EQ(sm.instance().current_state, lsm::machine_instance::no_state);
+        }
+
+        // From an action or an on_leave: the target isn't entered.
+        for (bool from_action : { false, true })
+        {
+            std::string trace;
+            lsm::machine<char> sm;
+            const lsm::state a = lsm::state().on_leave([&]() { trace += "-a"; if (!from_action) sm.stop(); }),
+                             b = lsm::state().on_enter([&trace]() { trace += "+b"; });
+            sm << a
+               << (a | b) ['n'] / [&]() { trace += "/"; if (from_action) sm.stop(); }
+               << (b | a) ['n'];
+            if (finalized) sm.finalize();
+            sm.start();
+            sm.notify('n');
+            EXPECT_FALSE(sm.is_running());
+            EXPECT_EQ(sm.instance().current_state, lsm::machine_instance::no_state);
+            sm.notify('n');
+            EXPECT_EQ(trace, from_action ? "-a/" : "-a");
+        }
+
+        // From the on_leave of a substate: states still active are left once, and only them.
+        {
+            std::string trace;
+            lsm::machine<char> sm;
+            const lsm::state outer = lsm::state().on_leave([&trace]() { trace += "-o"; }),
+                             inner = lsm::state().on_leave([&]() { trace += "-i"; sm.stop(); }),
+                             other = lsm::state().on_enter([&trace]() { trace += "+x"; });
+            sm << outer
+               << lsm::nest(outer, inner)
+               << (inner | other) ['n'];
+            if (finalized) sm.finalize();
+            sm.start();
+            sm.notify('n');
+            EXPECT_EQ(trace, "-i-o");
+            EXPECT_FALSE(sm.is_running());
+            EXPECT_FALSE(sm.is_in(outer));
+        }
+    }
+}
+
+TEST(lightweight_state_machine_test, deferred_events) {
+    enum class input { key_pressed, mouse_moved, ready, noise };
+    for (bool finalized : { false, true })
+    {
+        std::string handled;
+        const lsm::state handshake, session;
+
+        lsm::machine<input> sm;
+        sm << handshake
+           << (handshake | session) [input::ready]
+           << (session   | session) [input::key_pressed] / [&handled]() { handled += 'k'; }
+           << (session   | session) [input::mouse_moved] / [&handled]() { handled += 'm'; }
+           << lsm::defer(handshake, input::key_pressed).priority(1)
+           << lsm::defer(handshake, input::mouse_moved);
+        if (finalized) sm.finalize();
+        EXPECT_EQ(sm.definition().deferral_count(), 2u);
+
+        int priority = 0;
+        const lsm::state_id handshake_id = sm.definition().id_of(handshake);
+        EXPECT_TRUE(sm.definition().defers(handshake_id, input::key_pressed, &priority));
+        EXPECT_EQ(priority, 1);
+        EXPECT_FALSE(sm.definition().defers(handshake_id, input::noise));
+        EXPECT_FALSE(sm.definition().defers(sm.definition().id_of(session), input::key_pressed));
+
+        sm.start();
+        sm.notify(input::mouse_moved);
+        sm.notify(input::key_pressed);
+        sm.notify(input::noise);
+        sm.notify(input::key_pressed);
+        EXPECT_TRUE(handled.empty());
+        EXPECT_EQ(sm.deferred_count(), 3u);
+
+        // Replayed by priority, then in the order they came, once the handshake is over
+        sm.notify(input::ready);
+        EXPECT_EQ(handled, "kkm");
+        EXPECT_EQ(sm.deferred_count(), 0u);
+
+        sm.stop();
+        sm.start();
+        sm.notify(input::key_pressed);
+        sm.stop();
+        EXPECT_EQ(sm.deferred_count(), 0u);
+    }
+}
+
+TEST(lightweight_state_machine_test, nested_deferral) {
+    for (bool finalized : { false, true })
+    {
+        const lsm::state connecting, dialing, negotiating, online, closed;
+
+        lsm::machine<char> sm;
+        sm << connecting
+           << lsm::nest(connecting, dialing, negotiating)
+           << (dialing     | negotiating) ['n']
+           << (negotiating | online)      ['x']
+           << (connecting  | closed)      ['c']
+           << lsm::defer(connecting, 'x')
+           << lsm::defer(closed, 'x');
+        if (finalized) sm.finalize();
+        EXPECT_TRUE(sm.definition().defers(sm.definition().id_of(dialing), 'x'));
+
+        sm.start();
+        sm.notify('x');
+        EXPECT_EQ(sm.deferred_count(), 1u);
+        // negotiating handles it, its parent's deferral notwithstanding
+        sm.notify('n');
+        EXPECT_TRUE(sm.is_in(online));
+        EXPECT_EQ(sm.deferred_count(), 0u);
+
+        // Deferred again by the state it's replayed in
+        sm.stop();
+        sm.start();
+        sm.notify('x');
+        sm.notify('c');
+        EXPECT_TRUE(sm.is_in(closed));
+        EXPECT_EQ(sm.deferred_count(), 1u);
+    }
+}
+
+TEST(lightweight_state_machine_test, deferred_events_replayed_after_timeout) {
+    using std::chrono::milliseconds;
+
+    for (bool finalized : { false, true })
+    {
+        const auto start = lsm::timing_wheel::clock::now();
+        lsm::timing_wheel wheel(milliseconds(1), start);
+        int keys = 0;
+
+        const lsm::state handshake, session;
+
+        lsm::machine<char> sm;
+        sm.set_timing_wheel(&wheel);
+        sm << handshake
+           << (handshake | session) [lsm::after(milliseconds(10))]
+           << (session   | session) ['k'] / [&keys]() { keys++; }
+           << lsm::defer(handshake, 'k');
+        if (finalized) sm.finalize();
+
+        sm.start();
+        sm.notify('k');
+        sm.notify('k');
+        EXPECT_EQ(sm.deferred_count(), 2u);
+
+        // Replayed by the timer's transition, without waiting for another event
+        wheel.advance(start + milliseconds(20));
+        EXPECT_TRUE(sm.is_in(session));
+        EXPECT_EQ(sm.deferred_count(), 0u);
+        EXPECT_EQ(keys, 2);
+
+        // A copy expires its own timers
+        sm.stop();
+        lsm::machine<char> copy(sm);
+        copy.start();
+        copy.notify('k');
+        wheel.advance(start + milliseconds(40));
+        EXPECT_TRUE(copy.is_in(session));
+        EXPECT_EQ(copy.deferred_count(), 0u);
+        EXPECT_FALSE(sm.is_running());
+        EXPECT_EQ(keys, 3);
+
+        // So does a copy made while a timer is armed and events are deferred
+        copy.stop();
+        copy.start();
+        copy.notify('k');
+        lsm::machine<char> waiting_copy(copy);
+        wheel.advance(start + milliseconds(60));
+        EXPECT_TRUE(waiting_copy.is_in(session));
+        EXPECT_EQ(waiting_copy.deferred_count(), 0u);
+        EXPECT_EQ(copy.deferred_count(), 0u);
+        EXPECT_EQ(keys, 5);
+    }
+}
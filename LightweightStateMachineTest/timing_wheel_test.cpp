@@ -0,0 +1,118 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/timing_wheel.h"
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    using std::chrono::milliseconds;
+
+    struct recorder
+    {
+        static void on_expiry(void *target, const void*, std::uint32_t tag)
+        {
+            static_cast<recorder*>(target)->fired.push_back(tag);
+        }
+
+        std::vector<std::uint32_t> fired;
+    };
+}
+
+TEST(timing_wheel_test, fires_in_deadline_order) {
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    recorder r;
+
+    wheel.schedule(milliseconds(30), &recorder::on_expiry, &r, nullptr, 30);
+    wheel.schedule(milliseconds(10), &recorder::on_expiry, &r, nullptr, 10);
+    wheel.schedule(milliseconds(20), &recorder::on_expiry, &r, nullptr, 20);
+    EXPECT_EQ(wheel.size(), 3u);
+
+    EXPECT_EQ(wheel.advance(start + milliseconds(9)), 0u);
+    EXPECT_EQ(wheel.advance(start + milliseconds(20)), 2u);
+    EXPECT_EQ(r.fired, (std::vector<std::uint32_t>{ 10, 20 }));
+    EXPECT_EQ(wheel.now(), start + milliseconds(20));
+
+    // Partial ticks round up, zero still waits for the next tick
+    wheel.schedule(std::chrono::microseconds(1500), &recorder::on_expiry, &r, nullptr, 1);
+    wheel.schedule(milliseconds(0), &recorder::on_expiry, &r, nullptr, 0);
+    wheel.advance(start + milliseconds(21));
+    EXPECT_EQ(r.fired, (std::vector<std::uint32_t>{ 10, 20, 0 }));
+    wheel.advance(start + milliseconds(40));
+    EXPECT_EQ(r.fired, (std::vector<std::uint32_t>{ 10, 20, 0, 1, 30 }));
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(timing_wheel_test, cancel) {
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    recorder r;
+
+    const auto a = wheel.schedule(milliseconds(5), &recorder::on_expiry, &r, nullptr, 1);
+    wheel.schedule(milliseconds(5), &recorder::on_expiry, &r, nullptr, 2);
+    const auto c = wheel.schedule(milliseconds(100000), &recorder::on_expiry, &r, nullptr, 3);
+    wheel.cancel(a);
+    wheel.cancel(c);
+    EXPECT_EQ(wheel.size(), 1u);
+
+    // Ids are reused once released
+    EXPECT_EQ(wheel.schedule(milliseconds(7), &recorder::on_expiry, &r, nullptr, 4), c);
+
+    wheel.advance(start + milliseconds(200000));
+    EXPECT_EQ(r.fired, (std::vector<std::uint32_t>{ 2, 4 }));
+}
+
+TEST(timing_wheel_test, long_delays_cascade) {
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    recorder r;
+
+    // One per level, and beyond the span of the wheel
+    const std::uint64_t delays[] = { 200, 300, 70000, 20000000, 5000000000ull };
+    for (std::uint32_t i = 0; i < 5; ++i)
+    {
+        wheel.schedule(milliseconds(delays[4 - i]), &recorder::on_expiry, &r, nullptr, 4 - i);
+    }
+
+    for (std::uint32_t i = 0; i < 5; ++i)
+    {
+        wheel.advance(start + milliseconds(delays[i] - 1));
+        EXPECT_EQ(r.fired.size(), i);
+        wheel.advance(start + milliseconds(delays[i]));
+        ASSERT_EQ(r.fired.size(), i + 1);
+        EXPECT_EQ(r.fired.back(), i);
+    }
+}
+
+TEST(timing_wheel_test, callbacks_schedule_and_cancel) {
+    struct periodic
+    {
+        static void on_expiry(void *target, const void*, std::uint32_t)
+        {
+            periodic &p = *static_cast<periodic*>(target);
+            p.count++;
+            // Cancels a timer due in the same slot, before it fires
+            if (p.other != lsm::timing_wheel::no_timer) p.wheel->cancel(p.other);
+            p.other = lsm::timing_wheel::no_timer;
+            if (p.count < 3) p.wheel->schedule(milliseconds(10), &periodic::on_expiry, &p);
+        }
+
+        lsm::timing_wheel *wheel;
+        lsm::timing_wheel::timer_id other;
+        int count;
+    };
+
+    const auto start = lsm::timing_wheel::clock::now();
+    lsm::timing_wheel wheel(milliseconds(1), start);
+    recorder r;
+
+    periodic p{ &wheel, lsm::timing_wheel::no_timer, 0 };
+    p.other = wheel.schedule(milliseconds(10), &recorder::on_expiry, &r, nullptr, 1);
+    wheel.schedule(milliseconds(10), &periodic::on_expiry, &p);
+
+    EXPECT_EQ(wheel.advance(start + milliseconds(100)), 3u);
+    EXPECT_EQ(p.count, 3);
+    EXPECT_TRUE(r.fired.empty());
+    EXPECT_EQ(wheel.size(), 0u);
+}
@@ -0,0 +1,166 @@
+#include "pch.h"
+
+#include "../LightweightStateMachine/trace_observer.h"
+
+namespace lsm = lightweight_state_machine;
+
+namespace
+{
+    typedef lsm::observer_policy<lsm::trace_observer> policy;
+
+    struct compiled_out_observer : lsm::null_observer
+    {
+        static constexpr bool is_enabled = false;
+    };
+}
+
+TEST(trace_observer_test, records_transitions) {
+    static_assert(lsm::machine_definition<char, policy>::is_observed && !lsm::machine_definition<char, policy>::is_observing_callbacks, "Only dispatches are traced");
+    static_assert(!lsm::machine_definition<char, lsm::observer_policy<compiled_out_observer>>::is_observed, "Disabled observers are compiled out");
+    static_assert(!lsm::machine_definition<char, policy>::is_timing_dispatch, "Each traced dispatch reads the clock once");
+
+    int entered = 0;
+    const lsm::state idle, busy = lsm::state().on_enter([&entered]() { entered++; });
+    lsm::machine<char, policy> sm;
+    sm << idle
+       << (idle | busy) ['g']
+       << (busy | idle) ['s'];
+    sm.finalize();
+
+    sm.start();
+    sm.notify('g');
+    // Unmatched, not recorded
+    sm.notify('x');
+    sm.notify('s');
+    EXPECT_EQ(entered, 1);
+
+    const std::vector<lsm::trace_record> records = sm.observer().snapshot();
+    ASSERT_EQ(records.size(), 2u);
+    const lsm::state_id idle_id = sm.definition().id_of(idle), busy_id = sm.definition().id_of(busy);
+    EXPECT_EQ(records[0].event, static_cast<std::uint64_t>('g'));
+    EXPECT_EQ(records[0].from, idle_id);
+    EXPECT_EQ(records[0].to, busy_id);
+    EXPECT_EQ(records[1].event, static_cast<std::uint64_t>('s'));
+    EXPECT_EQ(records[1].from, busy_id);
+    EXPECT_EQ(records[1].to, idle_id);
+    EXPECT_LE(records[0].time, records[1].time);
+    for (const auto &r : records)
+    {
+        EXPECT_EQ(r.instance, reinterpret_cast<std::uintptr_t>(&sm.instance()));
+        EXPECT_EQ(r.thread, 0u);
+    }
+}
+
+TEST(trace_observer_test, keeps_the_last_records) {
+    const lsm::state counting;
+    lsm::machine<int, policy> sm;
+    sm << counting
+       << (counting | counting) [1]
+       << (counting | counting) [2];
+    sm.observer().set_capacity(5);
+    EXPECT_EQ(sm.observer().capacity(), 8u);
+
+    sm.start();
+    for (int i = 0; i < 20; ++i) sm.notify(i % 3 == 0 ? 1 : 2);
+
+    const std::vector<lsm::trace_record> records = sm.observer().snapshot();
+    ASSERT_EQ(records.size(), 8u);
+    for (int i = 0; i < 8; ++i) EXPECT_EQ(records[i].event, (12 + i) % 3 == 0 ? 1u : 2u) << i;
+}
+
+TEST(trace_observer_test, threads_record_apart) {
+    const int thread_count = 4, events_count = 20000;
+    const lsm::state ping, pong;
+
+    lsm::machine_definition<int, policy> definition;
+    definition << ping
+               << (ping | pong) [0]
+               << (pong | ping) [0];
+    definition.finalize();
+    definition.observer().set_capacity(256);
+
+    std::atomic<int> done(0);
+    std::vector<std::thread> dispatchers;
+    for (int t = 0; t < thread_count; ++t)
+    {
+        dispatchers.emplace_back([&]()
+        {
+            lsm::machine_instance instance;
+            definition.start(instance);
+            for (int i = 0; i < events_count; ++i) definition.notify(instance, 0);
+            done++;
+        });
+    }
+
+    // Read while the rings are overwritten: whatever a snapshot returns was recorded whole
+    while (done != thread_count)
+    {
+        for (const auto &r : definition.observer().snapshot())
+        {
+            ASSERT_LT(r.thread, static_cast<std::uint32_t>(thread_count));
+            ASSERT_EQ(r.from + r.to, 1u);
+        }
+    }
+    for (auto &d : dispatchers) d.join();
+
+    const std::vector<lsm::trace_record> records = definition.observer().snapshot();
+    EXPECT_EQ(records.size(), 256u * thread_count);
+    std::vector<int> per_thread(thread_count);
+    for (const auto &r : records) per_thread[r.thread]++;
+    for (int n : per_thread) EXPECT_EQ(n, 256);
+}
+
+TEST(trace_observer_test, many_traces_from_one_thread) {
+    // More than a thread remembers: those it forgot are found again, not given another ring
+    const int trace_count = 20;
+    const lsm::state ping, pong;
+    std::vector<lsm::machine<int, policy>> machines(trace_count);
+    for (auto &sm : machines)
+    {
+        sm << ping
+           << (ping | pong) [0]
+           << (pong | ping) [0];
+        sm.start();
+    }
+
+    for (int round = 0; round < 3; ++round)
+    {
+        for (auto &sm : machines) sm.notify(0);
+    }
+    for (auto &sm : machines)
+    {
+        const std::vector<lsm::trace_record> records = sm.observer().snapshot();
+        ASSERT_EQ(records.size(), 3u);
+        for (const auto &r : records) EXPECT_EQ(r.thread, 0u);
+    }
+}
+
+TEST(trace_observer_test, write_and_read) {
+    std::vector<lsm::trace_record> records;
+    records.push_back(lsm::trace_record{ 1000, 7, 0x7ffe12345678u, 0, 1, 0 });
+    records.push_back(lsm::trace_record{ ~std::uint64_t(0), std::uint64_t(-3), 16, lsm::machine_instance::no_state, 2, 3 });
+
+    const std::vector<unsigned char> bytes = lsm::write_trace(records);
+    // As read back from a file, at any address
+    std::vector<unsigned char> moved(bytes.size() + 1);
+    std::memcpy(moved.data() + 1, bytes.data(), bytes.size());
+
+    std::vector<lsm::trace_record> decoded;
+    ASSERT_TRUE(lsm::read_trace(moved.data() + 1, bytes.size(), decoded));
+    ASSERT_EQ(decoded.size(), 2u);
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+        EXPECT_EQ(decoded[i].time, records[i].time);
+        EXPECT_EQ(decoded[i].event, records[i].event);
+        EXPECT_EQ(decoded[i].instance, records[i].instance);
+        EXPECT_EQ(decoded[i].from, records[i].from);
+        EXPECT_EQ(decoded[i].to, records[i].to);
+        EXPECT_EQ(decoded[i].thread, records[i].thread);
+    }
+
+    EXPECT_FALSE(lsm::read_trace(bytes.data(), bytes.size() - 4, decoded));
+    EXPECT_TRUE(decoded.empty());
+    std::vector<unsigned char> corrupted = bytes;
+    corrupted[0] ^= 1;
+    EXPECT_FALSE(lsm::read_trace(corrupted.data(), corrupted.size(), decoded));
+}